@@ -0,0 +1,153 @@
+/* Acceptor threads. Each acceptor has its own listening socket, all
+ * bound to the same port with SO_REUSEPORT, so the kernel spreads
+ * incoming connections over them and no two acceptors ever contend for
+ * the same accept queue. An acceptor does nothing but accept and hand
+ * the new socket over to the I/O layer, so that a burst of connections
+ * (like every client reconnecting at once after a restart) is taken off
+ * the listen backlog as fast as possible.
+ *
+ * Every acceptor counts the connections it accepted and the accepts
+ * that failed in its own statistics (STATS_ACCEPTS and
+ * STATS_ACCEPT_ERRORS, see stats.c).
+ */
+#define _GNU_SOURCE
+
+#include "acceptor.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+typedef struct acceptor {
+  int listen_fd;
+  pthread_t thread;
+  void (*handoff)(int comm_fd);
+} acceptor;
+
+static acceptor *acceptors = NULL;
+static int nacceptors = 0;
+
+/************************************************************************
+ * Make a TCP listener for port "service" (given as a string, but
+ * either a port number or service name), with a connection queue of
+ * up to "backlog" entries. This function will only create a public
+ * listener (listening on all interfaces). SO_REUSEPORT is set, so any
+ * number of listeners can share the port.
+ *
+ * Either returns a file handle to use with accept(), or -1 on error.
+ * In general, error reporting could be improved, but this just indicates
+ * success or failure.
+ */
+int create_listener(char *service, int backlog) {
+  int sock_fd;
+  if ((sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  // Avoid time delay in reusing port - important for debugging, but
+  // probably not used in a production server.
+
+  int optval = 1;
+  setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+
+  // First, use getaddrinfo() to fill in address struct for later bind
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_PASSIVE;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = 0;
+
+  struct addrinfo *result;
+  int rval;
+  if ((rval = getaddrinfo(NULL, service, &hints, &result)) != 0) {
+    fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rval));
+    close(sock_fd);
+    return -1;
+  }
+
+  // Assign a name/addr to the socket - just blindly grabs first result
+  // off linked list, but really should be exactly one struct returned.
+
+  int bret = bind(sock_fd, result->ai_addr, result->ai_addrlen);
+  freeaddrinfo(result);
+  result = NULL;  // Not really necessary, but ensures no use-after-free
+
+  if (bret < 0) {
+    perror("bind");
+    close(sock_fd);
+    return -1;
+  }
+
+  // Finally, set up listener connection queue
+  int lret = listen(sock_fd, backlog);
+  if (lret < 0) {
+    perror("listen");
+    close(sock_fd);
+    return -1;
+  }
+
+  return sock_fd;
+}
+
+/************************************************************************
+ * Code run by each acceptor thread. Accepts connections on its own
+ * listener forever and hands each one off.
+ */
+static void *acceptor_main(void *arg) {
+  acceptor *a = (acceptor *)arg;
+  while (1) {
+    int comm_fd = accept4(a->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (comm_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      stats_add(STATS_ACCEPT_ERRORS, 1);
+      if (errno == EMFILE || errno == ENFILE) {
+        // Out of file descriptors: back off rather than spin, and let
+        // the backlog hold the connections until some are closed.
+        usleep(10000);
+      }
+      continue;
+    }
+    stats_add(STATS_ACCEPTS, 1);
+    a->handoff(comm_fd);
+  }
+  return NULL;
+}
+
+/************************************************************************
+ * Starts nthreads acceptors, each listening on its own socket for port
+ * "service", which hand every connection they accept to handoff. handoff
+ * is called from the acceptor threads, so it must be thread-safe.
+ * Returns 0 on success, -1 on error.
+ */
+int acceptor_init(char *service, int nthreads, int backlog,
+                  void (*handoff)(int comm_fd)) {
+  if ((acceptors = calloc(nthreads, sizeof(acceptor))) == NULL) {
+    perror("malloc acceptors");
+    exit(1);
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    acceptor *a = &acceptors[i];
+    if ((a->listen_fd = create_listener(service, backlog)) < 0) {
+      return -1;
+    }
+    a->handoff = handoff;
+    if (pthread_create(&a->thread, NULL, &acceptor_main, a) != 0) {
+      perror("pthread_create acceptor");
+      return -1;
+    }
+    pthread_detach(a->thread);
+    nacceptors++;
+  }
+  return 0;
+}
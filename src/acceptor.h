@@ -0,0 +1,11 @@
+// Function prototypes for the acceptor threads
+#ifndef _ACCEPTOR_H
+#define _ACCEPTOR_H
+
+#define ACCEPTOR_DEF_BACKLOG 1024  // default listen backlog of each listener
+
+int create_listener(char *service, int backlog);
+int acceptor_init(char *service, int nacceptors, int backlog,
+                  void (*handoff)(int comm_fd));
+
+#endif  // _ACCEPTOR_H
@@ -0,0 +1,203 @@
+/* The admin socket. A Unix domain stream socket, only accessible to the
+ * user the server runs as, over which an operator (or a monitoring
+ * script) can ask the server for its statistics. Like the player
+ * protocol it takes one command per line; the only command is STATS,
+ * which is answered with one "STAT <name> <value>..." line per figure
+ * and a final "END":
+ * - players connected and logged in, and players in each arena this
+ *   node owns
+ * - connections accepted and failed accepts
+ * - jobs waiting in the queues, and jobs handled by type
+ * - the time each notification manager worker spent handling jobs
+ * - bytes received from and sent to clients
+ * - a latency histogram per command
+ *
+ * Every admin connection gets a thread of its own, which only reads the
+ * counters (see stats.c), so asking for the statistics never holds up
+ * the players.
+ */
+#define _GNU_SOURCE
+
+#include "admin.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "arena_protocol.h"
+#include "cluster.h"
+#include "queue.h"
+#include "records.h"
+#include "roomlist.h"
+#include "stats.h"
+
+static int admin_fd = -1;
+static char admin_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static long long started;
+
+/************************************************************************
+ * Writes the answer to STATS.
+ */
+static void admin_stats(FILE* out) {
+  unsigned long opened = stats_sum(STATS_CONNS_OPENED);
+  unsigned long closed = stats_sum(STATS_CONNS_CLOSED);
+  int logged_in = 0;
+  for (int i = 0; i < NUM_ROOMS; i++) logged_in += roomlist_count(i);
+
+  fprintf(out, "STAT uptime_s %lld\n", (stats_now() - started) / 1000000000);
+  fprintf(out, "STAT players_connected %lu\n", opened - closed);
+  fprintf(out, "STAT players_logged_in %d\n", logged_in);
+  for (int i = 0; i < NUM_ROOMS; i++) {
+    if (cluster_owner(i) == cluster_node) {
+      fprintf(out, "STAT arena_players %d %d\n", i, roomlist_count(i));
+    }
+  }
+  fprintf(out, "STAT connections_accepted %lu\n", stats_sum(STATS_ACCEPTS));
+  fprintf(out, "STAT accept_errors %lu\n", stats_sum(STATS_ACCEPT_ERRORS));
+
+  unsigned long queued = stats_sum(STATS_JOBS_QUEUED);
+  unsigned long done = stats_sum(STATS_JOBS_DONE);
+  fprintf(out, "STAT queue_depth %ld\n", (long)(queued - done));
+  for (int t = JOB_MSG; t < NUM_JOB_TYPES; t++) {
+    fprintf(out, "STAT jobs %s %lu\n", job_names[t], stats_sum_jobs(t));
+  }
+  for (int q = 0; q < queue_count(); q++) {
+    fprintf(out, "STAT notifier_busy_us %d %lu\n", q,
+            stats_notifier_busy(q) / 1000);
+  }
+  fprintf(out, "STAT timeouts challenge %lu\n",
+          stats_sum(STATS_CHALLENGES_EXPIRED));
+  fprintf(out, "STAT timeouts duel %lu\n", stats_sum(STATS_DUELS_TIMED_OUT));
+  fprintf(out, "STAT timeouts idle %lu\n", stats_sum(STATS_IDLE_HANGUPS));
+  fprintf(out, "STAT matches %lu\n", stats_sum(STATS_MATCHES));
+  unsigned long players, backlog;
+  record_counts(&players, &backlog);
+  fprintf(out, "STAT records %lu\n", players);
+  fprintf(out, "STAT record_backlog %lu\n", backlog);
+  fprintf(out, "STAT bytes_in %lu\n", stats_sum(STATS_BYTES_IN));
+  fprintf(out, "STAT bytes_out %lu\n", stats_sum(STATS_BYTES_OUT));
+
+  // Bucket b counts the commands that took under 2^b microseconds
+  for (command_id cmd = 0; cmd < NUM_COMMANDS; cmd++) {
+    unsigned long buckets[STATS_BUCKETS];
+    stats_sum_latency(cmd, buckets);
+    unsigned long count = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) count += buckets[b];
+    if (count == 0) continue;
+
+    fprintf(out, "STAT latency_us %s %lu", command_name(cmd), count);
+    for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+      if (buckets[b] > 0) fprintf(out, " <%lu:%lu", 1UL << b, buckets[b]);
+    }
+    if (buckets[STATS_BUCKETS - 1] > 0) {
+      fprintf(out, " >=%lu:%lu", 1UL << (STATS_BUCKETS - 2),
+              buckets[STATS_BUCKETS - 1]);
+    }
+    fprintf(out, "\n");
+  }
+  fprintf(out, "END\n");
+}
+
+/************************************************************************
+ * Serves one admin connection until it is closed.
+ */
+static void* admin_session(void* arg) {
+  int fd = (int)(intptr_t)arg;
+  FILE* in = fdopen(fd, "r");
+  FILE* out = fdopen(dup(fd), "w");
+  if (in == NULL || out == NULL) {
+    perror("fdopen admin");
+    if (in != NULL) fclose(in);
+    return NULL;
+  }
+
+  char* line = NULL;
+  size_t cap = 0;
+  while (getline(&line, &cap, in) > 0) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strcmp(line, "STATS") == 0) {
+      admin_stats(out);
+    } else if (line[0] != '\0') {
+      fprintf(out, "ERR Unknown command\n");
+    }
+    fflush(out);
+  }
+  free(line);
+  fclose(in);
+  fclose(out);
+  return NULL;
+}
+
+static void* admin_main(void* arg) {
+  while (1) {
+    int fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) continue;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &admin_session, (void*)(intptr_t)fd) !=
+        0) {
+      perror("pthread_create admin session");
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+/************************************************************************
+ * Creates the admin socket at path (replacing a stale one) and starts
+ * serving it. Returns 0 on success, -1 on error.
+ */
+int admin_init(const char* path) {
+  started = stats_now();
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Admin socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+  if ((admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    perror("socket admin");
+    return -1;
+  }
+  if (bind(admin_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("bind admin");
+    close(admin_fd);
+    return -1;
+  }
+  // Nobody can connect before listen, so this is in time
+  if (chmod(path, S_IRUSR | S_IWUSR) < 0 || listen(admin_fd, 16) < 0) {
+    perror("admin socket");
+    close(admin_fd);
+    unlink(path);
+    return -1;
+  }
+  strcpy(admin_path, path);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &admin_main, NULL) != 0) {
+    perror("pthread_create admin");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/************************************************************************
+ * Removes the admin socket, if there is one.
+ */
+void admin_shutdown() {
+  if (admin_fd >= 0) unlink(admin_path);
+}
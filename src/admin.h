@@ -0,0 +1,8 @@
+// Function prototypes for the admin socket
+#ifndef _ADMIN_H
+#define _ADMIN_H
+
+int admin_init(const char* path);
+void admin_shutdown();
+
+#endif  // _ADMIN_H
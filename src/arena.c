@@ -6,195 +6,452 @@
  */
 #define _GNU_SOURCE
 
-#include <arpa/inet.h>
 #include <errno.h>
-#include <netdb.h>
-#include <netinet/in.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "acceptor.h"
+#include "admin.h"
 #include "arena_protocol.h"
+#include "cluster.h"
+#include "conn.h"
 #include "player.h"
 #include "playerlist.h"
 #include "notif_manager.h"
+#include "reactor.h"
+#include "records.h"
+#include "roomlist.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
 
 #define SERVER_PORT "8080"
+#define REPORT_SECS 10  // how often the accept rate is reported
+
+// The ways the server can drive its client connections
+typedef enum io_engine {
+  ENGINE_THREADS,  // one blocking thread per player (the default)
+  ENGINE_EPOLL,    // a few reactor threads multiplexing all players
+  ENGINE_URING,    // a few io_uring threads doing accept, recv and send
+} io_engine;
 
 /************************************************************************
- * Make a TCP listener for port "service" (given as a string, but
- * either a port number or service name). This function will only
- * create a public listener (listening on all interfaces).
- *
- * Either returns a file handle to use with accept(), or -1 on error.
- * In general, error reporting could be improved, but this just indicates
- * success or failure.
+ * conn kick hook for the thread-per-player engine. Wakes the player's
+ * thread up so it starts waiting for the socket to become writable.
+ * The eventfd to poke is kept in conn->io.
  */
-int create_listener(char *service) {
-  int sock_fd;
-  if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    perror("socket");
-    return -1;
+static void kick_player(conn *c) {
+  uint64_t one = 1;
+  if (write((int)(intptr_t)c->io, &one, sizeof(one)) < 0) {
+    perror("write eventfd");
   }
+}
 
-  // Avoid time delay in reusing port - important for debugging, but
-  // probably not used in a production server.
+/************************************************************************
+ * Code that is run by each player thread. Reads input commands and sends
+ * them to the notification manager, and writes out any output that got
+ * backed up. Also responsible for adding/removing player to the global
+ * player list.
+ */
+void *handle_player(void *newconn) {
+  conn *c = (conn *)newconn;
+  int wake_fd = (int)(intptr_t)c->io;
 
-  int optval = 1;
-  setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+  struct pollfd fds[2];
+  fds[0].fd = c->fd;
+  fds[1].fd = wake_fd;
+  fds[1].events = POLLIN;
 
-  // First, use getaddrinfo() to fill in address struct for later bind
+  int finished = 0;
+  while (!finished) {
+    pthread_mutex_lock(&c->outlock);
+    fds[0].events = POLLIN | (c->outarmed ? POLLOUT : 0);
+    pthread_mutex_unlock(&c->outlock);
 
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_flags = AI_PASSIVE;
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = 0;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      break;
+    }
 
-  struct addrinfo *result;
-  int rval;
-  if ((rval = getaddrinfo(NULL, service, &hints, &result)) != 0) {
-    fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rval));
-    close(sock_fd);
-    return -1;
+    if (fds[1].revents & POLLIN) {
+      uint64_t count;
+      if (read(wake_fd, &count, sizeof(count)) < 0) perror("read eventfd");
+    }
+    if (fds[0].revents & POLLOUT) {
+      conn_flush(c);
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      char* buf;
+      size_t space = conn_recv_space(c, &buf);
+      ssize_t n = recv(c->fd, buf, space, MSG_DONTWAIT);
+      if (n > 0) {
+        finished = (conn_received(c, n) < 0);
+      } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+        finished = 1;  // client disconnected
+      }
+    }
   }
 
-  // Assign a name/addr to the socket - just blindly grabs first result
-  // off linked list, but really should be exactly one struct returned.
-
-  int bret = bind(sock_fd, result->ai_addr, result->ai_addrlen);
-  freeaddrinfo(result);
-  result = NULL;  // Not really necessary, but ensures no use-after-free
-
-  if (bret < 0) {
-    perror("bind");
-    close(sock_fd);
-    return -1;
+  /* Finished with session, so unregister it and free resources (or pass
+   * it on if the player moved to an arena on another node). Notifiers
+   * stop kicking first, and the eventfd is closed only once the conn is
+   * dead, so a kick never writes to a descriptor that has been reused. */
+  pthread_mutex_lock(&c->outlock);
+  c->kick = NULL;
+  pthread_mutex_unlock(&c->outlock);
+  if (c->move_to >= 0) {
+    cluster_handoff(c);
+  } else {
+    conn_close(c);
   }
+  close(wake_fd);
 
-  // Finally, set up listener connection queue
-  int lret = listen(sock_fd, 128);
-  if (lret < 0) {
-    perror("listen");
-    close(sock_fd);
-    return -1;
+  int pret = 0;
+  if ((pret = pthread_detach(pthread_self())) != 0) {
+    perror("pthread_detach");
+    exit(1);
   }
 
-  return sock_fd;
+  pthread_exit(NULL);
 }
 
 /************************************************************************
- * Code that is run by each player thread. Reads input commands and sends
- * them to the notification manager. Also responsible for adding/removing
- * player to the global player list.
+ * Hands a connection to the thread-per-player engine: starts a thread
+ * to handle it.
  */
-void *handle_player(void *newplayer) {
-  player_info *player = (player_info *)newplayer;
-  playerlist_addplayer(player);
-
-  char *lineptr = NULL;
-  size_t linesize = 0;
-
-  while (player->state != PLAYER_DONE) {
-    if (getline(&lineptr, &linesize, player->fp_recv) < 0) {
-      // Failed getline means the client disconnected
-      break;
-    }
-    docommand(player, lineptr);
-  }
-
-  /* Finished with session, so unregister it and free resources. */
-  if (lineptr != NULL) {
-    free(lineptr);
+static void start_player(conn *newconn) {
+  int wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd < 0) {
+    perror("eventfd");
+    conn_close(newconn);
+    return;
   }
+  pthread_mutex_lock(&newconn->outlock);
+  newconn->kick = kick_player;
+  newconn->io = (void *)(intptr_t)wake_fd;
+  pthread_mutex_unlock(&newconn->outlock);
 
-  playerlist_removeplayer(player);
-  free(player);
-
+  pthread_t new_thread;
   int pret = 0;
-  if ((pret = pthread_detach(pthread_self())) != 0) {
-    perror("pthread_detach");
+  if ((pret = pthread_create(&new_thread, NULL, &handle_player, newconn)) !=
+      0) {
+    perror("pthread_create player thread");
     exit(1);
   }
+}
 
-  pthread_exit(NULL);
+// The engine's hook for taking over a connection
+static void (*adopt_conn)(conn *c) = start_player;
+
+/************************************************************************
+ * Acceptor handoff: passes a newly accepted socket to the I/O engine, or
+ * to the node that owns the lobby if that is not us.
+ */
+static void accept_player(int comm_fd) {
+  if (cluster_owner(ROOM_LOBBY) != cluster_node) {
+    cluster_handoff_fd(comm_fd);
+  } else {
+    adopt_conn(conn_new(comm_fd));
+  }
 }
 
 /************************************************************************
  * Signal handler for SIGINT to allow server to exit more gracefully.
+ * Only sets done and pokes done_fd to wake main up: allocating and
+ * queueing jobs is not safe in a signal handler, so main tells the
+ * workers to stop once it sees done.
  * TODO: is there a good way to also kill all active player threads using this
  * variable? Because they are currently blocking while waiting for input (for
  * player to enter a command/disconnect).
  */
 volatile sig_atomic_t done = 0;
+static int done_fd = -1;
 void terminate_server(int sig) {
+  uint64_t one = 1;
   done = 1;
-  job *job = newjob(JOB_DONE, NULL, NULL, NULL);
-  queue_enqueue(job);
-  return;
+  if (write(done_fd, &one, sizeof(one)) < 0) return;
+}
+
+/************************************************************************
+ * Waits up to msecs milliseconds (-1 for as long as it takes) for the
+ * server to be told to shut down. Returns nonzero once it has been.
+ */
+static int wait_done(int msecs) {
+  struct pollfd pfd = {.fd = done_fd, .events = POLLIN};
+  if (!done && poll(&pfd, 1, msecs) < 0 && errno != EINTR) perror("poll");
+  return done;
+}
+
+/************************************************************************
+ * Reports how fast connections come in, every REPORT_SECS seconds in
+ * which any did, until the server is told to shut down.
+ */
+static void report_accepts() {
+  unsigned long last = 0;
+  while (!wait_done(REPORT_SECS * 1000)) {
+    unsigned long accepted = stats_sum(STATS_ACCEPTS);
+    if (accepted != last) {
+      printf("Accepted %lu connections (%.1f/s), %lu total, %lu errors\n",
+             accepted - last, (double)(accepted - last) / REPORT_SECS,
+             accepted, stats_sum(STATS_ACCEPT_ERRORS));
+      last = accepted;
+    }
+  }
+}
+
+/************************************************************************
+ * Puts the name of this node's copy of a per-node file (admin socket,
+ * trace) in buf: path itself, or path.<node> in a cluster.
+ */
+static void node_path(char *buf, size_t size, const char *path, int node,
+                      int nnodes) {
+  if (nnodes > 1) {
+    snprintf(buf, size, "%s.%d", path, node);
+  } else {
+    snprintf(buf, size, "%s", path);
+  }
+}
+
+/************************************************************************
+ * Prints command line usage and exits.
+ */
+static void usage(char *progname) {
+  fprintf(stderr, "Usage: %s [-e threads|epoll|uring] [-r io_threads] "
+          "[-b outbuf_bytes] [-s drop|disconnect] [-n notifiers] "
+          "[-a acceptors] [-l backlog] [-c node/nodes] [-d cluster_name] "
+          "[-A admin_socket] [-T trace_file] "
+          "[-t challenge_secs,duel_secs,idle_secs] [-S record_file]\n",
+          progname);
+  exit(1);
 }
 
 /************************************************************************
  * Initializes playerlist, starts notification manager,
  * sets up signal handler, starts TCP server and waits for connections.
- * Then creates threads to handle each connection.
+ * Then hands each connection to the selected I/O engine.
  */
 int main(int argc, char *argv[]) {
+  io_engine engine = ENGINE_THREADS;
+  long nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+  long nnotifiers = sysconf(_SC_NPROCESSORS_ONLN);
+  long nacceptors = 1;
+  long backlog = ACCEPTOR_DEF_BACKLOG;
+  int node = 0, nnodes = 1;
+  char *cluster_name = CLUSTER_DEF_NAME;
+  char *admin_path = NULL;
+  char *trace_path = NULL;
+  char *record_path = NULL;
+  long challenge_secs = NOTIF_DEF_CHALLENGE_SECS;
+  long duel_secs = NOTIF_DEF_DUEL_SECS;
+  long idle_secs = NOTIF_DEF_IDLE_SECS;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:r:b:s:n:a:l:c:d:A:T:t:S:")) != -1) {
+    switch (opt) {
+      case 'e':
+        if (strcmp(optarg, "threads") == 0) {
+          engine = ENGINE_THREADS;
+        } else if (strcmp(optarg, "epoll") == 0) {
+          engine = ENGINE_EPOLL;
+        } else if (strcmp(optarg, "uring") == 0) {
+          engine = ENGINE_URING;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'r':
+        nreactors = strtol(optarg, NULL, 10);
+        if (nreactors <= 0) usage(argv[0]);
+        break;
+      case 'b':
+        conn_outcap = strtoul(optarg, NULL, 10);
+        if (conn_outcap == 0) usage(argv[0]);
+        break;
+      case 's':
+        if (strcmp(optarg, "drop") == 0) {
+          conn_slow_policy = SLOW_DROP;
+        } else if (strcmp(optarg, "disconnect") == 0) {
+          conn_slow_policy = SLOW_DISCONNECT;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'n':
+        nnotifiers = strtol(optarg, NULL, 10);
+        if (nnotifiers <= 0) usage(argv[0]);
+        break;
+      case 'a':
+        nacceptors = strtol(optarg, NULL, 10);
+        if (nacceptors <= 0) usage(argv[0]);
+        break;
+      case 'l':
+        backlog = strtol(optarg, NULL, 10);
+        if (backlog <= 0) usage(argv[0]);
+        break;
+      case 'c':
+        // Every node needs at least one arena of its own
+        if (sscanf(optarg, "%d/%d", &node, &nnodes) != 2 || nnodes <= 0 ||
+            nnodes > NUM_ROOMS || node < 0 || node >= nnodes) {
+          usage(argv[0]);
+        }
+        break;
+      case 'd':
+        cluster_name = optarg;
+        break;
+      case 'A':
+        admin_path = optarg;
+        break;
+      case 'T':
+        trace_path = optarg;
+        break;
+      case 'S':
+        record_path = optarg;
+        break;
+      case 't':
+        // 0 turns a timeout off
+        if (sscanf(optarg, "%ld,%ld,%ld", &challenge_secs, &duel_secs,
+                   &idle_secs) != 3 ||
+            challenge_secs < 0 || duel_secs < 0 || idle_secs < 0) {
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (nreactors <= 0) nreactors = 1;
+  // Jobs are spread over the workers by arena, so more would sit idle
+  if (nnotifiers <= 0) nnotifiers = 1;
+  if (nnotifiers > NUM_ROOMS) nnotifiers = NUM_ROOMS;
+
   /* Set up global playerlist */
   playerlist_init();
+  roomlist_init();
+  conn_init();
+  if (nnodes > 1 && cluster_init(cluster_name, node, nnodes) < 0) {
+    fprintf(stderr, "Cluster setup failed.\n");
+    exit(1);
+  }
 
   /* Set up signal handler to handle SIGINT so resources can be freed when
    * program exits */
+  if ((done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+    perror("eventfd");
+    exit(1);
+  }
   struct sigaction sa;
   sa.sa_handler = terminate_server;
   sigemptyset(&sa.sa_mask);
   sa.sa_flags = SA_RESETHAND;
   sigaction(SIGINT, &sa, NULL);
 
-  /* Set up notification manager thread and job queue*/
-  queue_init();
-  pthread_t notif;
-  int pret = 0;
-  if ((pret = pthread_create(&notif, NULL, &notif_main, NULL)) < 0) {
-    perror("pthread_create notif manager");
-    exit(1);
+  /* Start tracing before the first job can be queued. Like the admin
+   * socket, every node of a cluster writes a file of its own. */
+  if (trace_path != NULL) {
+    char path[PATH_MAX];
+    node_path(path, sizeof(path), trace_path, node, nnodes);
+    if (trace_init(path) < 0) {
+      fprintf(stderr, "Trace setup failed.\n");
+      exit(1);
+    }
   }
 
-  /* Set up server to start accepting connections */
-  int sock_fd = create_listener(SERVER_PORT);
-  if (sock_fd < 0) {
-    fprintf(stderr, "Server setup failed.\n");
+  /* Open the duel records before anyone can log in. The nodes of a
+   * cluster share them, node 0 keeps the log compacted and every node
+   * follows it to rank the others' results. */
+  if (record_path != NULL &&
+      record_init(record_path, node == 0, nnodes > 1) < 0) {
+    fprintf(stderr, "Record store setup failed.\n");
     exit(1);
   }
 
-  struct sockaddr_storage client_addr;
-  socklen_t client_addr_len = sizeof(client_addr);
-  int comm_fd;
-  while ((comm_fd = accept(sock_fd, (struct sockaddr *)&client_addr,
-                           &client_addr_len)) >= 0 &&
-         !done) {
-    printf("Got connection from %s\n",
-           inet_ntoa(((struct sockaddr_in *)&client_addr)->sin_addr));
+  /* Set up notification manager threads, each with its own job queue
+   * and timer wheel */
+  queue_init(nnotifiers);
+  notif_init(nnotifiers, challenge_secs, duel_secs, idle_secs);
+  pthread_t notif[nnotifiers];
+  int pret = 0;
+  for (int i = 0; i < nnotifiers; i++) {
+    if ((pret = pthread_create(&notif[i], NULL, &notif_main,
+                               (void *)(intptr_t)i)) != 0) {
+      perror("pthread_create notif manager");
+      exit(1);
+    }
+  }
 
-    player_info *newplayer = new_player(comm_fd);
+  /* Open the admin socket. Every node of a cluster has its own, since
+   * each only knows its own statistics. */
+  if (admin_path != NULL) {
+    char path[PATH_MAX];
+    node_path(path, sizeof(path), admin_path, node, nnodes);
+    if (admin_init(path) < 0) {
+      fprintf(stderr, "Admin socket setup failed.\n");
+      exit(1);
+    }
+  }
 
-    pthread_t new_thread;
-    pret = 0;
-    if ((pret = pthread_create(&new_thread, NULL, &handle_player, newplayer)) <
-        0) {
-      perror("pthread_create player thread");
+  /* The uring engine accepts connections itself, on one listener shared
+   * by its rings, so all that is left for this thread is to report on them
+   * until the server shuts down. */
+  if (engine == ENGINE_URING) {
+    int sock_fd = create_listener(SERVER_PORT, backlog);
+    if (sock_fd < 0) {
+      fprintf(stderr, "Server setup failed.\n");
       exit(1);
     }
+    if (uring_init(sock_fd, nreactors) == 0) {
+      if (cluster_start(uring_adopt) < 0) exit(1);
+      report_accepts();
+      queue_enqueue(newjob(JOB_DONE, NULL, NULL, NULL));
+      for (int i = 0; i < nnotifiers; i++) pthread_join(notif[i], NULL);
+      admin_shutdown();
+      trace_shutdown();
+      record_shutdown();
+      cluster_shutdown();
+      queue_destroy();
+      playerlist_destroy();
+      roomlist_destroy();
+      return 0;
+    }
+    fprintf(stderr, "io_uring not supported, falling back to epoll.\n");
+    close(sock_fd);
+    engine = ENGINE_EPOLL;
+  }
+
+  if (engine == ENGINE_EPOLL) {
+    if (reactor_init(nreactors) < 0) {
+      fprintf(stderr, "Reactor setup failed.\n");
+      exit(1);
+    }
+    adopt_conn = reactor_adopt;
+  }
+  if (cluster_start(adopt_conn) < 0) exit(1);
+
+  /* Set up acceptors to start accepting connections */
+  if (acceptor_init(SERVER_PORT, nacceptors, backlog, accept_player) < 0) {
+    fprintf(stderr, "Server setup failed.\n");
+    exit(1);
   }
 
-  pthread_join(notif, NULL);
+  report_accepts();
+  queue_enqueue(newjob(JOB_DONE, NULL, NULL, NULL));
+  for (int i = 0; i < nnotifiers; i++) pthread_join(notif[i], NULL);
+  admin_shutdown();
+  trace_shutdown();
+  record_shutdown();
+  cluster_shutdown();
   queue_destroy();
   playerlist_destroy();
+  roomlist_destroy();
 
   return 0;
 }
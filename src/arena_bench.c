@@ -0,0 +1,698 @@
+/* Load generator for the arena server. Opens a number of connections,
+ * logs each one in, spreads the players over the arenas, and then has
+ * every player run a mix of MSG, BROADCAST, MOVETO, CHALLENGE/CHOOSE and
+ * LIST commands for a while. Reports the throughput and, for each kind
+ * of command, the latency percentiles from sending it to the NOTICE it
+ * causes:
+ * - MSG and BROADCAST: to every "From" notice carrying the message
+ *   (which has the time it was sent in it)
+ * - MOVETO: to the player's own "has joined arena" notice
+ * - CHALLENGE: to the "has challenged you" notice at the target, who
+ *   always accepts
+ * - CHOOSE: from the second choice of a duel to the result
+ * - LIST: to the OK, since it causes no notice
+ *
+ * Every player runs one command at a time (waiting for it to complete,
+ * and then for the think time, before the next), all from a single
+ * epoll loop. Only the text protocol is used.
+ *
+ * Usage: arena_bench [-s host] [-p port] [-n connections] [-a arenas]
+ *                    [-d seconds] [-t think_ms] [-m mix] [-P prefix]
+ * where mix is like "msg:40,broadcast:10,moveto:10,duel:10,list:30".
+ */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEF_CONNECTIONS 1000
+#define DEF_ARENAS 4  // the server has arenas 1 through 4
+#define DEF_SECONDS 10
+#define DEF_MIX "msg:40,broadcast:10,moveto:10,duel:10,list:30"
+
+#define BENCH_INSIZE 4096   // longest line we look at
+#define BENCH_OUTSIZE 1024  // commands waiting to be written
+#define BENCH_FIFO 16       // commands waiting for their OK or ERR
+#define BENCH_MAXEVENTS 256
+#define BENCH_TIMEOUT 5000000000LL  // give up on a command after 5 s
+
+// Histogram buckets: 16 per power of two, so within 1/16 of the value
+#define HIST_SUB 16
+#define HIST_BUCKETS (61 * HIST_SUB)
+
+typedef enum op {
+  OP_MSG,
+  OP_BROADCAST,
+  OP_MOVETO,
+  OP_CHALLENGE,
+  OP_CHOOSE,
+  OP_LIST,
+  OP_LOGIN,
+  OP_ACCEPT,
+  NOPS,
+} op;
+
+static const char* op_names[] = {"MSG",  "BROADCAST", "MOVETO", "CHALLENGE",
+                                 "CHOOSE", "LIST",    "LOGIN",  "ACCEPT"};
+
+// Mix entries, in the order the commands are picked in
+static const struct {
+  const char* name;
+  op op;
+} mix_names[] = {{"msg", OP_MSG},         {"broadcast", OP_BROADCAST},
+                 {"moveto", OP_MOVETO},   {"duel", OP_CHALLENGE},
+                 {"list", OP_LIST}};
+#define NMIX (sizeof(mix_names) / sizeof(mix_names[0]))
+
+#define DRIVER 0x100  // marks the command a player is waiting on in the fifo
+
+typedef enum phase {
+  PHASE_LOGIN,  // waiting for every player to be logged in
+  PHASE_PLACE,  // waiting for every player to reach their first arena
+  PHASE_RUN,    // measuring
+  PHASE_DONE,
+} phase;
+
+typedef struct client {
+  int fd;
+  int index;
+  int room;
+  char in[BENCH_INSIZE];
+  size_t inlen;
+  char out[BENCH_OUTSIZE];
+  size_t outlen;
+  int armed;  // watching for the socket to become writable
+  int fifo[BENCH_FIFO];  // ops waiting for OK/ERR, maybe with DRIVER set
+  int fifohead;
+  int fifocount;
+  int busy;          // op the player is waiting on, or -1
+  long long sent;    // when the busy op was sent
+  long long next;    // when the next command may be sent
+  int opponent;      // index of the duel opponent, or -1
+  long long dueled;  // when the challenger sent CHALLENGE
+  long long chose;   // when this player sent CHOOSE in the current duel
+} client;
+
+typedef struct stats {
+  long sent;
+  long errors;
+  long timeouts;
+  long samples;
+  long long hist[HIST_BUCKETS];
+} stats;
+
+static const char* host = "127.0.0.1";
+static const char* port = "8080";
+static int nclients = DEF_CONNECTIONS;
+static int narenas = DEF_ARENAS;
+static int seconds = DEF_SECONDS;
+static long long think = 0;  // ns between commands of one player
+static const char* prefix = "bench";
+static int mix[NMIX];  // cumulative weights
+static int mixtotal = 0;
+
+static client* clients;
+static stats opstats[NOPS];
+static long notices = 0;
+static phase current = PHASE_LOGIN;
+static int waiting = 0;  // players the current setup phase is waiting for
+static int epoll_fd;
+
+static long long now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/************************************************************************
+ * Returns the histogram bucket for a latency of v microseconds.
+ */
+static int hist_bucket(unsigned long long v) {
+  if (v < HIST_SUB) return (int)v;
+  int e = 63 - __builtin_clzll(v);  // at least 4
+  return (e - 3) * HIST_SUB + (int)((v >> (e - 4)) & (HIST_SUB - 1));
+}
+
+/************************************************************************
+ * Returns the smallest latency (in microseconds) that goes in bucket b.
+ */
+static unsigned long long hist_value(int b) {
+  if (b < HIST_SUB) return b;
+  int e = b / HIST_SUB + 3;
+  return (unsigned long long)(HIST_SUB + b % HIST_SUB) << (e - 4);
+}
+
+static void record(op o, long long start) {
+  if (current != PHASE_RUN) return;
+  long long ns = now() - start;
+  opstats[o].hist[hist_bucket(ns > 0 ? ns / 1000 : 0)]++;
+  opstats[o].samples++;
+}
+
+/************************************************************************
+ * Returns the latency (in microseconds) below which fraction p of the
+ * samples of an op fall.
+ */
+static unsigned long long percentile(stats* s, double p) {
+  long long want = (long long)(p * s->samples);
+  if (want >= s->samples) want = s->samples - 1;
+  long long seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += s->hist[b];
+    if (seen > want) return hist_value(b);
+  }
+  return 0;
+}
+
+/************************************************************************
+ * Writes as much of a player's pending output as the socket takes, and
+ * watches for the socket to become writable again if it did not take
+ * all of it.
+ */
+static void flush(client* c) {
+  size_t off = 0;
+  while (off < c->outlen) {
+    ssize_t n = send(c->fd, c->out + off, c->outlen - off, MSG_NOSIGNAL);
+    if (n > 0) {
+      off += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else {
+      break;  // EAGAIN, or an error that the next read will see too
+    }
+  }
+  memmove(c->out, c->out + off, c->outlen - off);
+  c->outlen -= off;
+
+  if (c->armed != (c->outlen > 0)) {
+    c->armed = (c->outlen > 0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (c->armed ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+  }
+}
+
+/************************************************************************
+ * Sends a command line (given without its newline). Commands that are
+ * answered with OK or ERR are remembered as op, so the answer can be
+ * matched up with them.
+ */
+static void command(client* c, int o, const char* format, ...) {
+  char line[BENCH_OUTSIZE];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line) - 1, format, args);
+  va_end(args);
+  if (len < 0 || len >= (int)sizeof(line) - 1) return;
+  line[len++] = '\n';
+
+  if (c->outlen + len > BENCH_OUTSIZE) {
+    fprintf(stderr, "Output backed up for %s%d\n", prefix, c->index);
+    exit(1);
+  }
+  memcpy(c->out + c->outlen, line, len);
+  c->outlen += len;
+  if (!c->armed) flush(c);
+
+  if (o >= 0) {
+    if (c->fifocount == BENCH_FIFO) {
+      fprintf(stderr, "Too many commands in flight for %s%d\n", prefix,
+              c->index);
+      exit(1);
+    }
+    c->fifo[(c->fifohead + c->fifocount++) % BENCH_FIFO] = o;
+    if (current == PHASE_RUN) opstats[o & ~DRIVER].sent++;
+  }
+}
+
+/************************************************************************
+ * Returns the index of the player with the given name, or -1 if it is
+ * not one of ours.
+ */
+static int lookup(const char* name) {
+  size_t plen = strlen(prefix);
+  if (strncmp(name, prefix, plen) != 0) return -1;
+  char* end;
+  long i = strtol(name + plen, &end, 10);
+  if (end == name + plen || i < 0 || i >= nclients) return -1;
+  return (int)i;
+}
+
+/************************************************************************
+ * Returns a random other player in the same arena (as far as we know),
+ * or NULL if a few tries did not turn one up.
+ */
+static client* pick_peer(client* c) {
+  for (int tries = 0; tries < 8; tries++) {
+    client* other = &clients[random() % nclients];
+    if (other != c && other->room == c->room) return other;
+  }
+  return NULL;
+}
+
+static int other_arena(client* c) {
+  int room = 1 + random() % (narenas - 1);
+  return (room >= c->room) ? room + 1 : room;
+}
+
+/************************************************************************
+ * Picks the next command for a player from the mix and sends it. Returns
+ * 0 if it was sent, or -1 if the pick did not fit the player's situation
+ * right now (they will try again).
+ */
+static int start_command(client* c) {
+  int pick = random() % mixtotal;
+  size_t m = 0;
+  while (pick >= mix[m]) m++;
+  op o = mix_names[m].op;
+  client* other = pick_peer(c);
+  long long t = now();
+
+  if (o == OP_MSG) {
+    if (other == NULL) return -1;
+    command(c, o | DRIVER, "MSG %s%d m%lld", prefix, other->index, t);
+  } else if (o == OP_BROADCAST) {
+    command(c, o | DRIVER, "BROADCAST b%lld", t);
+  } else if (o == OP_MOVETO) {
+    if (narenas < 2 || c->opponent >= 0) return -1;  // not in the middle of a duel
+    c->room = other_arena(c);
+    command(c, -1, "MOVETO %d", c->room);
+    if (current == PHASE_RUN) opstats[o].sent++;
+  } else if (o == OP_CHALLENGE) {
+    // Take on someone who is not dueling yet
+    if (c->opponent >= 0 || other == NULL || other->opponent >= 0) return -1;
+    int i = other->index;
+    c->opponent = i;
+    c->dueled = t;
+    c->chose = 0;
+    other->opponent = c->index;
+    other->dueled = t;
+    other->chose = 0;
+    command(c, o | DRIVER, "CHALLENGE %s%d", prefix, i);
+  } else {
+    command(c, o | DRIVER, "LIST");
+  }
+  c->busy = o;
+  c->sent = t;
+  return 0;
+}
+
+/************************************************************************
+ * Marks a player's current command as done and sends the next one (or
+ * waits for the think time first).
+ */
+static void complete(client* c) {
+  c->busy = -1;
+  if (current == PHASE_PLACE) {
+    waiting--;
+    return;
+  }
+  c->next = now() + think;
+  if (current == PHASE_RUN && think == 0) start_command(c);
+}
+
+/************************************************************************
+ * Ends the duel a player is in (as far as we know), on both sides.
+ */
+static void end_duel(client* c) {
+  if (c->opponent >= 0 && clients[c->opponent].opponent == c->index) {
+    clients[c->opponent].opponent = -1;
+  }
+  c->opponent = -1;
+}
+
+/************************************************************************
+ * Errors that the notification manager sends after the command was
+ * already answered with OK, so they do not answer anything in the fifo.
+ */
+static int late_error(const char* text) {
+  static const char* late[] = {"not in your arena", "Cannot find player",
+                               "Cannot MSG yourself", "not logged in",
+                               "does not match", "Cannot challenge yourself",
+                               "has left your arena", "not a logged in"};
+  for (size_t i = 0; i < sizeof(late) / sizeof(late[0]); i++) {
+    if (strstr(text, late[i]) != NULL) return 1;
+  }
+  return 0;
+}
+
+/************************************************************************
+ * Handles an OK or ERR line from the server.
+ */
+static void answer(client* c, int ok, const char* text) {
+  if (!ok && late_error(text)) {
+    op o = (strstr(text, "challenge") != NULL) ? OP_CHALLENGE : OP_MSG;
+    if (current == PHASE_RUN) opstats[o].errors++;
+    if (o == OP_CHALLENGE) end_duel(c);
+    return;
+  }
+  if (c->fifocount == 0) return;  // nothing we sent, so ignore it
+
+  int o = c->fifo[c->fifohead];
+  c->fifohead = (c->fifohead + 1) % BENCH_FIFO;
+  c->fifocount--;
+  int driver = o & DRIVER;
+  o &= ~DRIVER;
+
+  if (!ok) {
+    if (current == PHASE_RUN) opstats[o].errors++;
+    if (o == OP_LOGIN) {
+      fprintf(stderr, "%s%d: ERR %s\n", prefix, c->index, text);
+      exit(1);
+    }
+    if (o == OP_CHALLENGE || o == OP_ACCEPT || o == OP_CHOOSE) end_duel(c);
+  }
+  if (o == OP_LOGIN && current == PHASE_LOGIN) {
+    waiting--;
+  } else if (driver && c->busy == o) {
+    if (o == OP_LIST) record(o, c->sent);
+    complete(c);
+  }
+}
+
+/************************************************************************
+ * Handles a NOTICE line from the server.
+ */
+static void notice(client* c, const char* text) {
+  if (current == PHASE_RUN) notices++;
+
+  char name[64];
+  const char* p;
+  if (strncmp(text, "From ", 5) == 0 && (p = strstr(text, ": ")) != NULL) {
+    long long sent = strtoll(p + 3, NULL, 10);
+    if (p[2] == 'm') record(OP_MSG, sent);
+    if (p[2] == 'b') record(OP_BROADCAST, sent);
+  } else if (sscanf(text, "%63s has joined arena", name) == 1 &&
+             strstr(text, " has joined arena ") != NULL) {
+    if (lookup(name) == c->index && c->busy == OP_MOVETO) {
+      record(OP_MOVETO, c->sent);
+      complete(c);
+    }
+  } else if (sscanf(text, "%63s has challenged you", name) == 1 &&
+             strstr(text, " has challenged you") != NULL) {
+    int i = lookup(name);
+    if (i >= 0 && clients[i].opponent == c->index) {
+      record(OP_CHALLENGE, clients[i].dueled);
+    }
+    command(c, OP_ACCEPT, "ACCEPT");
+  } else if (strncmp(text, "Please CHOOSE", 13) == 0) {
+    static const char* choices[] = {"ROCK", "PAPER", "SCISSORS"};
+    c->chose = now();
+    command(c, OP_CHOOSE, "CHOOSE %s", choices[random() % 3]);
+  } else if (strncmp(text, "Result of your duel with ", 25) == 0) {
+    // Whoever hears first times the duel, from the second choice
+    int i = c->opponent;
+    if (i >= 0 && clients[i].opponent == c->index && c->chose != 0 &&
+        clients[i].chose != 0) {
+      record(OP_CHOOSE,
+             (c->chose > clients[i].chose) ? c->chose : clients[i].chose);
+    }
+    end_duel(c);
+  } else if (strstr(text, " has rejected your challenge") != NULL) {
+    end_duel(c);
+  }
+}
+
+/************************************************************************
+ * Reads whatever the server sent a player and handles every complete
+ * line. Lines longer than BENCH_INSIZE are cut short.
+ */
+static void input(client* c) {
+  while (1) {
+    ssize_t n = recv(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen, 0);
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+      fprintf(stderr, "%s%d: connection closed by the server\n", prefix,
+              c->index);
+      exit(1);
+    }
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    c->inlen += n;
+
+    char* line = c->in;
+    char* nl;
+    while ((nl = memchr(line, '\n', c->in + c->inlen - line)) != NULL) {
+      *nl = '\0';
+      if (strncmp(line, "NOTICE ", 7) == 0) {
+        notice(c, line + 7);
+      } else if (strncmp(line, "OK", 2) == 0) {
+        answer(c, 1, line[2] == ' ' ? line + 3 : "");
+      } else if (strncmp(line, "ERR ", 4) == 0) {
+        answer(c, 0, line + 4);
+      }
+      line = nl + 1;
+    }
+    c->inlen -= line - c->in;
+    memmove(c->in, line, c->inlen);
+    if (c->inlen == sizeof(c->in)) c->inlen = 0;  // throw away a huge line
+  }
+}
+
+/************************************************************************
+ * Runs the event loop until the current phase is over: until nobody is
+ * left to wait for, or until the end time has passed (if it is not 0).
+ */
+static void run(long long end) {
+  struct epoll_event events[BENCH_MAXEVENTS];
+  long long tick = 0;
+
+  while (end != 0 ? now() < end : waiting > 0) {
+    int n = epoll_wait(epoll_fd, events, BENCH_MAXEVENTS, 1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+      client* c = (client*)events[i].data.ptr;
+      if (events[i].events & EPOLLOUT) flush(c);
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) input(c);
+    }
+
+    // Start whoever is done thinking, and time out lost commands
+    long long t = now();
+    long long every = (think == 0) ? 100000000LL : 1000000LL;
+    if (current != PHASE_RUN || t - tick < every) continue;
+    tick = t;
+    for (int i = 0; i < nclients; i++) {
+      client* c = &clients[i];
+      if (c->busy >= 0 && t - c->sent > BENCH_TIMEOUT) {
+        opstats[c->busy].timeouts++;
+        if (c->busy == OP_CHALLENGE) end_duel(c);
+        c->busy = -1;
+      }
+      if (c->busy < 0 && t >= c->next) start_command(c);
+    }
+  }
+}
+
+/************************************************************************
+ * Opens all the connections and logs the players in.
+ */
+static void connect_all() {
+  struct addrinfo hints, *addr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int err = getaddrinfo(host, port, &hints, &addr);
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+    exit(1);
+  }
+
+  for (int i = 0; i < nclients; i++) {
+    client* c = &clients[i];
+    c->fd = socket(addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+      perror("socket");
+      exit(1);
+    }
+    if (connect(c->fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+      perror("connect");
+      exit(1);
+    }
+    if (fcntl(c->fd, F_SETFL, O_NONBLOCK) < 0) {
+      perror("fcntl");
+      exit(1);
+    }
+
+    c->index = i;
+    c->room = 0;
+    c->busy = -1;
+    c->opponent = -1;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+      perror("epoll_ctl add");
+      exit(1);
+    }
+    command(c, OP_LOGIN, "LOGIN %s%d", prefix, i);
+    waiting++;
+  }
+  freeaddrinfo(addr);
+}
+
+/************************************************************************
+ * Parses the -m option into cumulative weights. Returns -1 if it does
+ * not make sense.
+ */
+static int parse_mix(const char* spec) {
+  int weights[NMIX] = {0};
+  char* copy = strdup(spec);
+  char* saveptr;
+  for (char* item = strtok_r(copy, ",", &saveptr); item != NULL;
+       item = strtok_r(NULL, ",", &saveptr)) {
+    char* colon = strchr(item, ':');
+    if (colon == NULL) return -1;
+    *colon = '\0';
+    size_t m = 0;
+    while (m < NMIX && strcmp(item, mix_names[m].name) != 0) m++;
+    if (m == NMIX) return -1;
+    weights[m] = strtol(colon + 1, NULL, 10);
+    if (weights[m] < 0) return -1;
+  }
+  free(copy);
+
+  for (size_t m = 0; m < NMIX; m++) {
+    mixtotal += weights[m];
+    mix[m] = mixtotal;
+  }
+  return (mixtotal > 0) ? 0 : -1;
+}
+
+static void usage(char* progname) {
+  fprintf(stderr,
+          "Usage: %s [-s host] [-p port] [-n connections] [-a arenas] "
+          "[-d seconds] [-t think_ms] [-m mix] [-P prefix]\n"
+          "mix defaults to %s\n",
+          progname, DEF_MIX);
+  exit(1);
+}
+
+static void report(double elapsed) {
+  long total = 0;
+  printf("%-10s %10s %8s %8s %10s %10s %10s %10s\n", "command", "sent",
+         "errors", "timeouts", "samples", "p50_us", "p99_us", "p999_us");
+  for (int o = 0; o < NOPS; o++) {
+    stats* s = &opstats[o];
+    if (s->sent == 0 && s->samples == 0) continue;
+    total += s->sent;
+    printf("%-10s %10ld %8ld %8ld %10ld", op_names[o], s->sent, s->errors,
+           s->timeouts, s->samples);
+    if (s->samples > 0) {
+      printf(" %10llu %10llu %10llu\n", percentile(s, 0.5),
+             percentile(s, 0.99), percentile(s, 0.999));
+    } else {
+      printf(" %10s %10s %10s\n", "-", "-", "-");
+    }
+  }
+  printf("%ld commands in %.1f s: %.0f commands/s, %.0f notices/s\n", total,
+         elapsed, total / elapsed, notices / elapsed);
+}
+
+int main(int argc, char* argv[]) {
+  const char* mixspec = DEF_MIX;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:p:n:a:d:t:m:P:")) != -1) {
+    switch (opt) {
+      case 's':
+        host = optarg;
+        break;
+      case 'p':
+        port = optarg;
+        break;
+      case 'n':
+        nclients = strtol(optarg, NULL, 10);
+        if (nclients <= 0) usage(argv[0]);
+        break;
+      case 'a':
+        narenas = strtol(optarg, NULL, 10);
+        if (narenas <= 0) usage(argv[0]);
+        break;
+      case 'd':
+        seconds = strtol(optarg, NULL, 10);
+        if (seconds <= 0) usage(argv[0]);
+        break;
+      case 't':
+        think = strtoll(optarg, NULL, 10) * 1000000;
+        if (think < 0) usage(argv[0]);
+        break;
+      case 'm':
+        mixspec = optarg;
+        break;
+      case 'P':
+        prefix = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (parse_mix(mixspec) < 0) usage(argv[0]);
+
+  // Thousands of connections need more than the usual 1024 descriptors
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  srandom(getpid());
+
+  if ((clients = calloc(nclients, sizeof(client))) == NULL) {
+    perror("malloc clients");
+    exit(1);
+  }
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+
+  long long start = now();
+  connect_all();
+  run(0);
+  printf("%d players logged in after %.2f s\n", nclients,
+         (now() - start) / 1e9);
+
+  current = PHASE_PLACE;
+  for (int i = 0; i < nclients; i++) {
+    client* c = &clients[i];
+    c->room = 1 + i % narenas;
+    c->busy = OP_MOVETO;
+    c->sent = now();
+    command(c, -1, "MOVETO %d", c->room);
+    waiting++;
+  }
+  run(0);
+
+  current = PHASE_RUN;
+  start = now();
+  for (int i = 0; i < nclients; i++) start_command(&clients[i]);
+  run(start + seconds * 1000000000LL);
+  double elapsed = (now() - start) / 1e9;
+  current = PHASE_DONE;
+
+  printf("%d connections, %d arenas, think time %lld ms, mix %s\n", nclients,
+         narenas, think / 1000000, mixspec);
+  report(elapsed);
+
+  for (int i = 0; i < nclients; i++) close(clients[i].fd);
+  free(clients);
+  return 0;
+}
@@ -4,32 +4,164 @@
  * player (the docommand function), and has functions to send
  * responses to ensure proper and consistent formatting of these
  * messages.
+ *
+ * Clients that send BINARY switch to the binary protocol, whose frames
+ * are taken apart by dobinary and handed to the same command handlers.
+ * The response functions encode for whichever protocol the player
+ * speaks.
  */
-#define MAX_RESPONSE_LEN 256
-#define MAX_MSG_LEN 200
+#define MAX_RESPONSE_LEN 256  // must leave room in CONN_BUFSIZE for the type
 
 #include "arena_protocol.h"
 
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "cluster.h"
+#include "conn.h"
+#include "ladder.h"
 #include "player.h"
 #include "playerlist.h"
 #include "queue.h"
+#include "records.h"
+#include "roomlist.h"
+#include "stats.h"
 #include "util.h"
 
+/************************************************************************
+ * Helper function to format a response line with a specified type and
+ * format string with optional args, straight into an output buffer.
+ */
+static outbuf* format_response(const char* type, const char* format,
+                               va_list args) {
+  outbuf* b = conn_buf_new();
+  int len = snprintf(b->data, CONN_BUFSIZE, "%s ", type);
+  int n = vsnprintf(b->data + len, MAX_RESPONSE_LEN, format, args);
+  if (n >= MAX_RESPONSE_LEN) n = MAX_RESPONSE_LEN - 1;  // it got truncated
+  if (n > 0) len += n;
+  b->data[len++] = '\n';
+  b->len = len;
+  return b;
+}
+
+/************************************************************************
+ * Appends as much of the n bytes at data to a frame as fits in its
+ * buffer.
+ */
+static void frame_put(outbuf* b, const void* data, size_t n) {
+  if (n > CONN_BUFSIZE - b->len) n = CONN_BUFSIZE - b->len;
+  memcpy(b->data + b->len, data, n);
+  b->len += n;
+}
+
+/************************************************************************
+ * Appends one field for each character in layout to a frame, taken from
+ * args (see make_frame), and updates the frame's length.
+ */
+static void frame_fields(outbuf* b, const char* layout, va_list args) {
+  for (const char* f = layout; *f != '\0'; f++) {
+    if (*f == 'b') {
+      uint8_t v = va_arg(args, int);
+      frame_put(b, &v, 1);
+    } else if (*f == 'h') {
+      uint16_t v = htons(va_arg(args, int));
+      frame_put(b, &v, 2);
+    } else if (*f == 'i') {
+      uint32_t v = htonl(va_arg(args, unsigned int));
+      frame_put(b, &v, 4);
+    } else if (*f == 's') {
+      const char* s = va_arg(args, const char*);
+      size_t n = strlen(s);
+      if (n > UINT8_MAX) n = UINT8_MAX;
+      if (b->len + 1 + n > CONN_BUFSIZE) n = CONN_BUFSIZE - b->len - 1;
+      uint8_t len = n;
+      frame_put(b, &len, 1);
+      frame_put(b, s, n);
+    } else if (*f == 't') {
+      const char* s = va_arg(args, const char*);
+      frame_put(b, s, strlen(s));
+    }
+  }
+  b->data[0] = (b->len - 2) >> 8;
+  b->data[1] = (b->len - 2) & 0xff;
+}
+
+/************************************************************************
+ * Builds a frame of the binary protocol with the given type, followed by
+ * one field for each character in layout, taken from the args: 'b', 'h'
+ * and 'i' are 8, 16 and 32 bit numbers (in network byte order), 's' is a
+ * string preceded by its length in one byte, and 't' is a string taking
+ * up the rest of the frame. Whatever does not fit in one output buffer
+ * is cut off. The caller must conn_buf_put the buffer when done.
+ */
+outbuf* make_frame(int type, const char* layout, ...) {
+  outbuf* b = conn_buf_new();
+  b->len = 2;  // the length goes here once it is known
+  uint8_t t = type;
+  frame_put(b, &t, 1);
+
+  va_list args;
+  va_start(args, layout);
+  frame_fields(b, layout, args);
+  va_end(args);
+  return b;
+}
+
+/************************************************************************
+ * Appends more fields to a frame made by make_frame, for frames with a
+ * varying number of them.
+ */
+static void frame_add(outbuf* b, const char* layout, ...) {
+  va_list args;
+  va_start(args, layout);
+  frame_fields(b, layout, args);
+  va_end(args);
+}
+
+/************************************************************************
+ * Sends a frame made by make_frame, giving up the caller's reference.
+ */
+void send_frame(player_info* player, outbuf* frame) {
+  conn_send_buf(player->conn, frame);
+  conn_buf_put(frame);
+}
+
 /************************************************************************
  * Helper function to send a response with a specified type and format string
- * with optional args.
+ * with optional args. Binary clients get the bintype frame instead, where
+ * an OK only names the request it answers.
  */
-static void send_response(player_info* player, const char* type,
+static void send_response(player_info* player, const char* type, int bintype,
                           const char* format, va_list args) {
-  char response[MAX_RESPONSE_LEN];
-  vsnprintf(response, MAX_RESPONSE_LEN, format, args);
-  fprintf(player->fp_send, "%s %s\n", type, response);
+  outbuf* b;
+  if (!player->conn->binary) {
+    b = format_response(type, format, args);
+  } else if (bintype == BIN_OK) {
+    b = make_frame(BIN_OK, "b", player->conn->binop);
+  } else {
+    char text[MAX_RESPONSE_LEN];
+    vsnprintf(text, sizeof(text), format, args);
+    b = make_frame(bintype, "t", text);
+  }
+  conn_send_buf(player->conn, b);
+  conn_buf_put(b);
+}
+
+/************************************************************************
+ * Formats a NOTICE once so that it can be sent to many players with
+ * conn_send_buf. The caller must conn_buf_put the buffer when done.
+ */
+outbuf* make_notice(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  outbuf* b = format_response("NOTICE", format, args);
+  va_end(args);
+  return b;
 }
 
 /************************************************************************
@@ -39,7 +171,7 @@ static void send_response(player_info* player, const char* type,
 void send_err(player_info* player, const char* format, ...) {
   va_list args;
   va_start(args, format);
-  send_response(player, "ERR", format, args);
+  send_response(player, "ERR", BIN_ERR, format, args);
   va_end(args);
 }
 
@@ -50,7 +182,7 @@ void send_err(player_info* player, const char* format, ...) {
 void send_ok(player_info* player, const char* format, ...) {
   va_list args;
   va_start(args, format);
-  send_response(player, "OK", format, args);
+  send_response(player, "OK", BIN_OK, format, args);
   va_end(args);
 }
 
@@ -61,7 +193,7 @@ void send_ok(player_info* player, const char* format, ...) {
 void send_notice(player_info* player, const char* format, ...) {
   va_list args;
   va_start(args, format);
-  send_response(player, "NOTICE", format, args);
+  send_response(player, "NOTICE", BIN_NOTICE, format, args);
   va_end(args);
 }
 
@@ -84,15 +216,25 @@ static void cmd_login(player_info* player, char* newname, char* rest) {
   } else if (rest != NULL) {
     send_err(player, "LOGIN should have one argument");
   } else {  // name valid format, but need to check if in use
-    if (playerlist_changeplayername(player, newname) < 0) {  // duplicate name
+    int reserved = cluster_reserve(newname);  // on any node of the cluster
+    if (reserved == -2) {
+      send_err(player, "Too many players logged in, try again later");
+    } else if (reserved < 0 ||
+               playerlist_changeplayername(player, newname) < 0) {
       send_err(player, "Another player already logged in as %s", newname);
     } else {  // finally all good
       player->state = PLAYER_REG;
-      send_ok(player, "Logged in as %s", newname);
+      record_lookup(player);
+      roomlist_add(player, ROOM_LOBBY);
+      if (player->conn->binary) {
+        send_frame(player, make_frame(BIN_OK, "bi", BIN_LOGIN, player->id));
+      } else {
+        send_ok(player, "Logged in as %s", newname);
+      }
 
       /* Notify everyone in the lobby that player just joined. */
       int lobby = 0;
-      job* job = newjob(JOB_JOIN, &lobby, NULL, player);
+      job* job = newjob(JOB_JOIN, &lobby, player->name, player);
       queue_enqueue(job);
     }
   }
@@ -100,9 +242,12 @@ static void cmd_login(player_info* player, char* newname, char* rest) {
 
 /************************************************************************
  * Handle the "MOVETO" command. Takes one argument, the arena to move to.
- * Sends an ERR on invalid input.
+ * Sends an ERR on invalid input, or while the player has a challenge
+ * pending or a duel going.
  * Also notifies all players in arena that player left, and players in
- * arena that player joined.
+ * arena that player joined. If the new arena belongs to another node of
+ * the cluster, the player's connection is handed over to it once this
+ * command returns, and that node sends the join notices.
  */
 static void cmd_moveto(player_info* player, char* room, char* rest) {
   char* endptr;
@@ -113,17 +258,27 @@ static void cmd_moveto(player_info* player, char* room, char* rest) {
     send_err(player, "Already in arena %d", newroom);
   } else if (room == NULL || rest != NULL) {  // need 1 arg
     send_err(player, "MOVETO should have one argument");
-  } else if (*endptr != '\0' || newroom < 0 || newroom > 4) {  // need valid arg
+  } else if (*endptr != '\0' || newroom < 0 || newroom >= NUM_ROOMS) {  // need valid arg
     send_err(player, "Invalid arena number");
+  } else if (player->duel_status != DUEL_NONE) {
+    // Duel jobs go to the worker of the duelists' arena, so they stay put
+    send_err(player, "Cannot leave the arena during a duel or challenge");
+  } else if (cluster_owner(newroom) != cluster_node) {
+    int oldroom = player->in_room;
+    roomlist_remove(player);
+    cluster_moved(player, newroom);
+    queue_enqueue(newjob(JOB_LEAVE, &oldroom, player->name, player));
+    player->conn->move_to = newroom;
   } else {
     int oldroom = player->in_room;  // save old room before changing it
-    player->in_room = newroom;
+    roomlist_move(player, newroom);
+    cluster_moved(player, newroom);
 
-    job* job1 = newjob(JOB_JOIN, &newroom, NULL, player);
-    job* job2 = newjob(JOB_LEAVE, &oldroom, NULL, player);
+    job* jobs[2];
+    jobs[0] = newjob(JOB_JOIN, &newroom, player->name, player);
+    jobs[1] = newjob(JOB_LEAVE, &oldroom, player->name, player);
 
-    queue_enqueue(job1);
-    queue_enqueue(job2);
+    queue_enqueue_batch(jobs, 2);
   }
 }
 
@@ -136,6 +291,8 @@ static void cmd_stat(player_info* player, char* arg1, char* rest) {
     send_err(player, "Player must be logged in before STAT");
   } else if (arg1 != NULL) {  // need no args
     send_err(player, "STAT should have no arguments");
+  } else if (player->conn->binary) {
+    send_frame(player, make_frame(BIN_OK, "bb", BIN_STAT, player->in_room));
   } else {  // all good
     if (player->in_room == ROOM_LOBBY) {
       send_ok(player, "lobby");
@@ -145,6 +302,81 @@ static void cmd_stat(player_info* player, char* arg1, char* rest) {
   }
 }
 
+// The LIST response as it is being built up by list_append
+typedef struct list_response {
+  char* response;
+  size_t size;  // allocated size of response
+} list_response;
+
+/************************************************************************
+ * Appends the name of a player (and a comma) to a LIST response.
+ */
+static void list_append(player_info* player, void* arg) {
+  list_response* list = (list_response*)arg;
+  size_t name_len = strlen(player->name);
+  list->size += name_len + 1;  // +1 for the comma
+  if ((list->response = realloc(list->response, list->size)) == NULL) {
+    perror("realloc LIST");
+    exit(1);
+  }
+  strcat(list->response, player->name);
+  strcat(list->response, ",");
+}
+
+// The binary LIST response as it is being built up by list_append_binary
+typedef struct list_frame {
+  char* data;
+  size_t len;
+  size_t size;  // allocated size of data
+  int count;
+} list_frame;
+
+/************************************************************************
+ * Appends the id and name of a player to a binary LIST response, unless
+ * the frame is full.
+ */
+static void list_append_binary(player_info* player, void* arg) {
+  list_frame* list = (list_frame*)arg;
+  size_t name_len = strlen(player->name);
+  if (list->len + 5 + name_len > 2 + UINT16_MAX) return;
+  if (list->len + 5 + name_len > list->size) {
+    list->size *= 2;
+    if ((list->data = realloc(list->data, list->size)) == NULL) {
+      perror("realloc LIST");
+      exit(1);
+    }
+  }
+  uint32_t id = htonl(player->id);
+  memcpy(list->data + list->len, &id, 4);
+  list->data[list->len + 4] = name_len;
+  memcpy(list->data + list->len + 5, player->name, name_len);
+  list->len += 5 + name_len;
+  list->count++;
+}
+
+/************************************************************************
+ * Sends the binary LIST response: an OK frame holding the number of
+ * players in the arena, followed by each one's id and name. Can be much
+ * longer than an output buffer, so it is sent as plain bytes.
+ */
+static void send_list_binary(player_info* player) {
+  list_frame list = {NULL, 6, 256, 0};  // 6 bytes of header
+  if ((list.data = malloc(list.size)) == NULL) {
+    perror("malloc LIST");
+    exit(1);
+  }
+  roomlist_foreach(player->in_room, list_append_binary, &list);
+
+  list.data[0] = (list.len - 2) >> 8;
+  list.data[1] = (list.len - 2) & 0xff;
+  list.data[2] = BIN_OK;
+  list.data[3] = BIN_LIST;
+  list.data[4] = list.count >> 8;
+  list.data[5] = list.count & 0xff;
+  conn_send(player->conn, list.data, list.len);
+  free(list.data);
+}
+
 /************************************************************************
  * Handle the "LIST" command. Takes no arguments. Sends OK with list of
  * players in the current arena.
@@ -154,33 +386,19 @@ static void cmd_list(player_info* player, char* arg1, char* rest) {
     send_err(player, "Player must be logged in before LIST");
   } else if (arg1 != NULL) {  // need no args
     send_err(player, "LIST should have no arguments");
+  } else if (player->conn->binary) {
+    send_list_binary(player);
   } else {  // all good
-    int size = playerlist_getsize();
-    size_t response_size = 1;  // start with 1 for the null terminator
-    char* response =
-        malloc(response_size);  // initialize response with an empty string
-    if (response == NULL) {
+    list_response list = {NULL, 1};
+    if ((list.response = malloc(list.size)) == NULL) {  // start out empty
       perror("malloc LIST");
       return;
     }
+    list.response[0] = '\0';
 
-    response[0] = '\0';  // initialize as empty string
-
-    /* for each player in list, if in same room, append to response string */
-    for (size_t i = 0; i < size; i++) {
-      player_info* curr = playerlist_get(i);
-      if (curr->in_room == player->in_room) {
-        size_t name_len = strlen(curr->name);
-        response_size += name_len + 1;  // +1 for the comma
-        response = realloc(response, response_size);
-        if (response == NULL) {
-          perror("realloc LIST");
-          return;
-        }
-        strcat(response, curr->name);
-        strcat(response, ",");
-      }
-    }
+    /* for each player in the same room, append to response string */
+    roomlist_foreach(player->in_room, list_append, &list);
+    char* response = list.response;
 
     if (response[0] != '\0') {
       response[strlen(response) - 1] = '\0';  // remove trailing comma
@@ -203,6 +421,8 @@ static void cmd_msg(player_info* player, char* target, char* msg) {
     send_err(player, "MSG should have 2 arguments");
   } else if (strlen(msg) > MAX_MSG_LEN) {
     send_err(player, "Message too long. Max length is %d", MAX_MSG_LEN);
+  } else if (strlen(target) > PLAYER_MAXNAME) {
+    send_err(player, "Cannot find player %s.", target);
   } else {
     send_ok(player, "");
     job* job = newjob(JOB_MSG, target, msg, player);
@@ -229,19 +449,13 @@ static void cmd_broadcast(player_info* player, char* msg, char* rest) {
         (rest != NULL) ? strlen(rest) + 1  // +1 for space between msg and rest
                        : 0;
     size_t newmsg_len = strlen(msg) + rest_len + 1;  // +1 for null terminator
+    char newmsg[MAX_MSG_LEN + 1];
 
     if (newmsg_len > MAX_MSG_LEN) {
       send_err(player, "Message too long. Max length is %d", MAX_MSG_LEN);
       return;
     }
 
-    // Allocate memory for the new message
-    char* newmsg = malloc(newmsg_len);
-    if (newmsg == NULL) {
-      perror("malloc");
-      return;
-    }
-
     // Copy msg to newmsg and concatenate rest if it is not NULL
     strcpy(newmsg, msg);
     if (rest != NULL) {
@@ -251,8 +465,6 @@ static void cmd_broadcast(player_info* player, char* msg, char* rest) {
 
     send_ok(player, "");
     queue_enqueue(newjob(JOB_BROADCAST, NULL, newmsg, player));
-
-    free(newmsg);
   }
 }
 
@@ -267,17 +479,35 @@ static void cmd_bye(player_info* player, char* arg1, char* rest) {
   player->state = PLAYER_DONE;
 }
 
+/************************************************************************
+ * Handle the "BINARY" command. Takes no arguments. Sends OK, and from then
+ * on the client and the server only exchange binary frames.
+ */
+static void cmd_binary(player_info* player, char* arg1, char* rest) {
+  if (arg1 != NULL) {
+    send_err(player, "BINARY should have no arguments");
+  } else {
+    send_ok(player, "BINARY");
+    player->conn->binary = 1;
+  }
+}
+
 /************************************************************************
  * Handle the "WHOAMI" command. Takes no arguments. Sends OK with the
- * player's name.
+ * player's name and duel record.
  */
 static void cmd_whoami(player_info* player, char* arg1, char* rest) {
   if (player->state != PLAYER_REG) {
     send_err(player, "Player must be logged in before WHOAMI");
   } else if (arg1 != NULL) {  // need no args
     send_err(player, "WHOAMI should have no arguments");
+  } else if (player->conn->binary) {
+    send_frame(player, make_frame(BIN_OK, "bisiiih", BIN_WHOAMI, player->id,
+                                  player->name, player->wins, player->losses,
+                                  player->draws, player->rating));
   } else {  // all good
-    send_ok(player, "%s", player->name);
+    send_ok(player, "%s wins %d losses %d draws %d rating %d", player->name,
+            player->wins, player->losses, player->draws, player->rating);
   }
 }
 
@@ -290,7 +520,8 @@ static void cmd_help(player_info* player, char* cmd, char* rest) {
   if (cmd == NULL) {
     send_notice(player,
                 "Commands: LOGIN, MOVETO, BYE, MSG, STAT, FIND, LIST, BROADCAST, "
-                "HELP, WHOAMI, CHALLENGE, ACCEPT, REJECT, CHOOSE");
+                "HELP, WHOAMI, CHALLENGE, ACCEPT, REJECT, CHOOSE, QUEUE, "
+                "UNQUEUE, TOP, RANK, BINARY");
   } else {
     if (strcmp(cmd, "LOGIN") == 0) {
       send_notice(player, "LOGIN <name> - log in with a name");
@@ -316,7 +547,7 @@ static void cmd_help(player_info* player, char* cmd, char* rest) {
           player,
           "HELP [command] - get help on a command, or list all commands");
     } else if (strcmp(cmd, "WHOAMI") == 0) {
-      send_notice(player, "WHOAMI - get your own name");
+      send_notice(player, "WHOAMI - get your own name and duel record");
     } else if (strcmp(cmd, "CHALLENGE") == 0) {
       send_notice(player,
                   "CHALLENGE <player> - challenge another player to a duel");
@@ -326,10 +557,30 @@ static void cmd_help(player_info* player, char* cmd, char* rest) {
     } else if (strcmp(cmd, "REJECT") == 0) {
       send_notice(player,
                   "REJECT - reject an incoming challenge from another player");
+    } else if (strcmp(cmd, "BINARY") == 0) {
+      send_notice(player,
+                  "BINARY - switch to the binary protocol (see the README)");
     } else if (strcmp(cmd, "CHOOSE") == 0) {
       send_notice(
           player,
           "CHOOSE <ROCK, PAPER, SCISSORS> - choose your move during a duel.");
+    } else if (strcmp(cmd, "QUEUE") == 0) {
+      send_notice(player,
+                  "QUEUE - wait for a duel with a player of about your "
+                  "rating");
+    } else if (strcmp(cmd, "UNQUEUE") == 0) {
+      send_notice(player, "UNQUEUE - stop waiting for a duel");
+    } else if (strcmp(cmd, "TOP") == 0) {
+      send_notice(player,
+                  "TOP [count] [ARENA] - show the best rated players, of "
+                  "everybody or of your arena");
+    } else if (strcmp(cmd, "RANK") == 0) {
+      send_notice(player,
+                  "RANK <player> [ARENA] - get the rank of a player, among "
+                  "everybody or in your arena");
+    } else if (strcmp(cmd, "STATS") == 0) {
+      send_notice(player,
+                  "STATS - server statistics, only on the admin socket");
     } else {
       send_err(player, "Unknown command");
     }
@@ -342,15 +593,20 @@ static void cmd_help(player_info* player, char* cmd, char* rest) {
  * target player does not exist.
  */
 static void cmd_challenge(player_info* player, char* target, char* rest) {
+  player_info* opponent;
   if (player->state != PLAYER_REG) {
     send_err(player, "Player must be logged in before CHALLENGE");
   } else if (target == NULL || rest != NULL) {
     send_err(player, "CHALLENGE should have one argument");
-  } else if (player->duel_status == DUEL_PENDING) {
+  } else if (player->duel_status == DUEL_PENDING &&
+             (opponent = player_get(player->opponent)) != NULL) {
     send_err(player, "Already have pending challenge with %s",
-             player->opponent->name);
+             opponent->name);
   } else if (player->in_room == ROOM_LOBBY) {
     send_err(player, "No fighting in the lobby!");
+  } else if (strlen(target) > PLAYER_MAXNAME) {
+    send_err(player, "%s does not match the name of a logged in player.",
+             target);
   } else {
     send_ok(player, "");
     job* job = newjob(JOB_CHALLENGE, target, NULL, player);
@@ -394,16 +650,18 @@ static void cmd_reject(player_info* player, char* arg1, char* rest) {
   }
 }
 
+// Names of the duel choices, indexed by duel_choice
+static const char* choice_names[] = {NULL, "ROCK", "PAPER", "SCISSORS"};
+
 /*********************************************************
- * Helper function to validate the choice made by the player
- * in the CHOOSE cmd.
+ * Helper function to turn the choice made by the player in the CHOOSE
+ * cmd into a duel_choice. Returns CHOICE_NONE if it is not valid.
  */
-static int validate_choice(const char* choice) {
-  if ((strcmp(choice, "ROCK") == 0) || (strcmp(choice, "PAPER") == 0) ||
-      (strcmp(choice, "SCISSORS") == 0))
-    return 1;
-  else
-    return 0;
+static duel_choice parse_choice(const char* choice) {
+  for (duel_choice c = CHOICE_ROCK; c <= CHOICE_SCISSORS; c++) {
+    if (strcmp(choice, choice_names[c]) == 0) return c;
+  }
+  return CHOICE_NONE;
 }
 
 /***************************************************
@@ -421,23 +679,161 @@ static void cmd_choose(player_info* player, char* choice, char* rest) {
              "You do not have an active duel. If you have a pending duel, they "
              "must ACCEPT.");
   } else {
-    if (!validate_choice(choice)) {
+    duel_choice c = parse_choice(choice);
+    if (c == CHOICE_NONE) {
       send_err(player, "Invalid choice. Choose from ROCK, PAPER, or SCISSORS.");
       return;
     }
-    send_ok(player, "%s", choice);
-    player->choice = choice;
+    send_ok(player, "%s", choice_names[c]);
+    player->choice = c;
 
     job* job = newjob(JOB_CHOICE, NULL, NULL, player);
     queue_enqueue(job);
   }
 }
 
+/************************************************************************
+ * Handle the "QUEUE" command. Takes no arguments. Sends OK with the
+ * player's rating, and puts them in the matchmaking pool of their arena,
+ * from which they are matched with someone of about their rating and
+ * the duel starts right away.
+ */
+static void cmd_queue(player_info* player, char* arg1, char* rest) {
+  if (player->state != PLAYER_REG) {
+    send_err(player, "Player must be logged in before QUEUE");
+  } else if (arg1 != NULL) {
+    send_err(player, "QUEUE should have no arguments");
+  } else if (player->in_room == ROOM_LOBBY) {
+    send_err(player, "No fighting in the lobby!");
+  } else if (player->duel_status == DUEL_ACTIVE) {
+    send_err(player, "Already in a duel");
+  } else {
+    if (player->conn->binary) {
+      send_frame(player, make_frame(BIN_OK, "bh", BIN_QUEUE, player->rating));
+    } else {
+      send_ok(player, "Queued with rating %d", player->rating);
+    }
+    queue_enqueue(newjob(JOB_QUEUE, NULL, NULL, player));
+  }
+}
+
+/************************************************************************
+ * Handle the "UNQUEUE" command. Takes no arguments. Sends OK, and takes
+ * the player out of the matchmaking pool.
+ */
+static void cmd_unqueue(player_info* player, char* arg1, char* rest) {
+  if (player->state != PLAYER_REG) {
+    send_err(player, "Player must be logged in before UNQUEUE");
+  } else if (arg1 != NULL) {
+    send_err(player, "UNQUEUE should have no arguments");
+  } else {
+    send_ok(player, "");
+    queue_enqueue(newjob(JOB_UNQUEUE, NULL, NULL, player));
+  }
+}
+
+/************************************************************************
+ * Sends the TOP response: the number of players ranked and the n best
+ * of them, with their ranks and ratings, on the global leaderboard or,
+ * if arena is set, on that of the player's arena.
+ */
+static void send_top(player_info* player, int n, int arena) {
+  ladder_row rows[LADDER_TOP_MAX];
+  unsigned int ranked;
+  n = arena ? roomlist_top(player->in_room, n, rows, &ranked)
+            : record_top(n, rows, &ranked);
+  if (player->conn->binary) {
+    outbuf* b = make_frame(BIN_OK, "bib", BIN_TOP, ranked, n);
+    for (int i = 0; i < n; i++) {
+      frame_add(b, "ish", rows[i].rank, rows[i].name, rows[i].rating);
+    }
+    send_frame(player, b);
+    return;
+  }
+
+  char text[MAX_RESPONSE_LEN];
+  int len = snprintf(text, sizeof(text), "%u ranked", ranked);
+  for (int i = 0; i < n && len < (int)sizeof(text); i++) {
+    len += snprintf(text + len, sizeof(text) - len, "%s %u %s %d",
+                    (i == 0) ? ":" : ",", rows[i].rank, rows[i].name,
+                    rows[i].rating);
+  }
+  send_ok(player, "%s", text);
+}
+
+/************************************************************************
+ * Handle the "TOP" command. Takes two optional arguments, how many
+ * players to show (LADDER_TOP unless given, at most LADDER_TOP_MAX) and
+ * ARENA, to show the best in the player's arena instead of everybody on
+ * record.
+ */
+static void cmd_top(player_info* player, char* count, char* scope) {
+  if (count != NULL && scope == NULL && strcmp(count, "ARENA") == 0) {
+    scope = count;  // ARENA on its own
+    count = NULL;
+  }
+  char* endptr = "";
+  long n = (count != NULL) ? strtol(count, &endptr, 10) : LADDER_TOP;
+  if (player->state != PLAYER_REG) {
+    send_err(player, "Player must be logged in before TOP");
+  } else if (scope != NULL && strcmp(scope, "ARENA") != 0) {
+    send_err(player, "TOP should have a count and/or ARENA");
+  } else if (*endptr != '\0' || n < 1 || n > LADDER_TOP_MAX) {
+    send_err(player, "Invalid count -- must be 1 to %d", LADDER_TOP_MAX);
+  } else {
+    send_top(player, (int)n, scope != NULL);
+  }
+}
+
+/************************************************************************
+ * Handle the "RANK" command. Takes the name of a player and optionally
+ * ARENA. Sends OK with their rank, the number of players ranked and
+ * their rating, among everybody on record or, with ARENA, among the
+ * players in the player's arena.
+ */
+static void cmd_rank(player_info* player, char* name, char* scope) {
+  if (player->state != PLAYER_REG) {
+    send_err(player, "Player must be logged in before RANK");
+  } else if (name == NULL) {
+    send_err(player, "RANK needs the name of a player");
+  } else if (scope != NULL && strcmp(scope, "ARENA") != 0) {
+    send_err(player, "RANK should have a name and optionally ARENA");
+  } else {
+    int rating;
+    unsigned int ranked;
+    unsigned int rank =
+        (scope != NULL)
+            ? roomlist_rank(player->in_room, name, &rating, &ranked)
+            : record_rank(name, &rating, &ranked);
+    if (rank == 0 && scope != NULL) {
+      send_err(player, "%s is not in your arena", name);
+    } else if (rank == 0) {
+      send_err(player, "%s is not ranked", name);
+    } else if (player->conn->binary) {
+      send_frame(player, make_frame(BIN_OK, "biih", BIN_RANK, rank, ranked,
+                                    rating));
+    } else {
+      send_ok(player, "%s rank %u of %u rating %d", name, rank, ranked,
+              rating);
+    }
+  }
+}
+
+/************************************************************************
+ * Handle the "STATS" command, which only works on the admin socket (see
+ * admin.c). Players just get an ERR.
+ */
+static void cmd_stats(player_info* player, char* arg1, char* rest) {
+  send_err(player, "STATS is only available on the admin socket");
+}
+
 static void cmd_find(player_info* player, char* target, char* rest) {
   if (player->state != PLAYER_REG) {
     send_err(player, "Player must be logged in before CHOOSE");
   } else if (target == NULL) {
     send_err(player, "FIND needs one argument.");
+  } else if (strlen(target) > PLAYER_MAXNAME) {
+    send_err(player, "%s is not a logged in player.", target);
   } else {
     send_ok(player, "");
     job* job = newjob(JOB_FIND, target, NULL, player);
@@ -445,70 +841,216 @@ static void cmd_find(player_info* player, char* target, char* rest) {
   }
 }
 
+typedef void (*command_handler)(player_info* player, char* arg1, char* rest);
+
+#define COMMAND(name, handler) {name, sizeof(name) - 1, handler}
+
+// The commands of the text protocol, indexed by command_id
+static const struct {
+  const char* name;
+  size_t len;
+  command_handler handler;
+} commands[NUM_COMMANDS] = {
+    [CMD_LOGIN] = COMMAND("LOGIN", cmd_login),
+    [CMD_MOVETO] = COMMAND("MOVETO", cmd_moveto),
+    [CMD_BYE] = COMMAND("BYE", cmd_bye),
+    [CMD_MSG] = COMMAND("MSG", cmd_msg),
+    [CMD_STAT] = COMMAND("STAT", cmd_stat),
+    [CMD_FIND] = COMMAND("FIND", cmd_find),
+    [CMD_LIST] = COMMAND("LIST", cmd_list),
+    [CMD_BROADCAST] = COMMAND("BROADCAST", cmd_broadcast),
+    [CMD_WHOAMI] = COMMAND("WHOAMI", cmd_whoami),
+    [CMD_CHALLENGE] = COMMAND("CHALLENGE", cmd_challenge),
+    [CMD_ACCEPT] = COMMAND("ACCEPT", cmd_accept),
+    [CMD_REJECT] = COMMAND("REJECT", cmd_reject),
+    [CMD_CHOOSE] = COMMAND("CHOOSE", cmd_choose),
+    [CMD_QUEUE] = COMMAND("QUEUE", cmd_queue),
+    [CMD_UNQUEUE] = COMMAND("UNQUEUE", cmd_unqueue),
+    [CMD_TOP] = COMMAND("TOP", cmd_top),
+    [CMD_RANK] = COMMAND("RANK", cmd_rank),
+    [CMD_HELP] = COMMAND("HELP", cmd_help),
+    [CMD_BINARY] = COMMAND("BINARY", cmd_binary),
+    [CMD_STATS] = COMMAND("STATS", cmd_stats),
+};
+
+/* Returns the name of a command */
+const char* command_name(command_id cmd) { return commands[cmd].name; }
+
+// A command line taken apart by parse_command. Every part points into
+// the line itself and is null terminated (or NULL if not present).
+typedef struct command_line {
+  char* cmd;
+  size_t cmdlen;
+  char* arg1;  // the next word after cmd
+  char* rest;  // the rest of the line after arg1, trimmed
+} command_line;
+
 /************************************************************************
- * Parses and performs the actions in the line of text (command and
- * optionally arguments) passed in as "command".
+ * Returns the next token at *pos delimited by any of the characters in
+ * delims, or NULL if there is none, like strtok_r. The token is null
+ * terminated in place, its length stored in *len, and *pos moved past
+ * it.
  */
-void docommand(player_info* player, char* command) {
-  char* saveptr;
-  char* cmd = strtok_r(command, " \t\r\n", &saveptr);
-  if (cmd == NULL) {  // Empty line (no command) -- just ignore line
-    return;
+static char* next_token(char** pos, const char* delims, size_t* len) {
+  char* token = *pos + strspn(*pos, delims);
+  if (*token == '\0') {
+    *pos = token;
+    return NULL;
   }
 
-  // Get first argument (if there is one)
-  char* arg1 = strtok_r(NULL, " \r\n", &saveptr);
-  if (arg1 != NULL) {
+  *len = strcspn(token, delims);
+  *pos = token + *len;
+  if (**pos != '\0') *(*pos)++ = '\0';
+  return token;
+}
+
+/************************************************************************
+ * Takes apart the len bytes of a line (ending with its newline) in a
+ * single pass, without copying anything. Returns 0 on success, or -1 if
+ * the line is empty.
+ */
+static int parse_command(char* line, size_t len, command_line* cl) {
+  // Everything after a null byte is ignored, like it always was
+  char* end = memchr(line, '\0', len);
+  if (end == NULL) end = line + len - 1;  // the newline
+  *end = '\0';
+
+  char* pos = line;
+  cl->cmd = next_token(&pos, " \t\r\n", &cl->cmdlen);
+  if (cl->cmd == NULL) return -1;
+
+  size_t n;
+  cl->arg1 = next_token(&pos, " \r\n", &n);
+  cl->rest = (cl->arg1 != NULL) ? next_token(&pos, "\r\n", &n) : NULL;
+  if (cl->rest != NULL) {
+    // Trim it, knowing where it ends
+    while (n > 0 && isspace((unsigned char)cl->rest[n - 1])) n--;
+    cl->rest[n] = '\0';
+    while (isspace((unsigned char)*cl->rest)) cl->rest++;
     // Don't consider an empty string an argument....
-    if (arg1[0] == '\0') arg1 = NULL;
+    if (cl->rest[0] == '\0') cl->rest = NULL;
   }
+  return 0;
+}
 
-  // Get the rest (if present -- trimmed)
-  char* rest = NULL;
-  if (arg1 != NULL) {
-    rest = strtok_r(NULL, "\r\n", &saveptr);
-    if (rest != NULL) {
-      rest = trim(rest);
-      // Don't consider an empty string an argument....
-      if (rest[0] == '\0') rest = NULL;
+/************************************************************************
+ * Parses and performs the actions in the line of text (command and
+ * optionally arguments) passed in as "line", which holds len bytes
+ * ending with the newline. The line is taken apart in place, so it has
+ * to be writable, and none of it is used once this returns: anything
+ * that has to outlive the command (like the target and text of a MSG)
+ * is copied into its job.
+ */
+void docommand(player_info* player, char* line, size_t len) {
+  command_line cl;
+  if (parse_command(line, len, &cl) < 0) {
+    return;  // Empty line (no command) -- just ignore line
+  }
+
+  for (command_id i = 0; i < NUM_COMMANDS; i++) {
+    if (commands[i].len == cl.cmdlen &&
+        memcmp(commands[i].name, cl.cmd, cl.cmdlen) == 0) {
+      long long start = stats_now();
+      commands[i].handler(player, cl.arg1, cl.rest);
+      stats_command(i, stats_now() - start);
+      return;
     }
   }
+  send_err(player, "Unknown command");
+}
 
-  /* Parsing result: "cmd" has the command string, "arg1" has the
-   * next word after "cmd" if it exists (NULL if not), and "rest"
-   * has the rest of line after the first argument (NULL if not
-   * present).
-   */
-
-  if (strcmp(cmd, "LOGIN") == 0) {
-    cmd_login(player, arg1, rest);
-  } else if (strcmp(cmd, "MOVETO") == 0) {
-    cmd_moveto(player, arg1, rest);
-  } else if (strcmp(cmd, "BYE") == 0) {
-    cmd_bye(player, arg1, rest);
-  } else if (strcmp(cmd, "MSG") == 0) {
-    cmd_msg(player, arg1, rest);
-  } else if (strcmp(cmd, "STAT") == 0) {
-    cmd_stat(player, arg1, rest);
-  } else if (strcmp(cmd, "LIST") == 0) {
-    cmd_list(player, arg1, rest);
-  } else if (strcmp(cmd, "BROADCAST") == 0) {
-    cmd_broadcast(player, arg1, rest);
-  } else if (strcmp(cmd, "HELP") == 0) {
-    cmd_help(player, arg1, rest);
-  } else if (strcmp(cmd, "WHOAMI") == 0) {
-    cmd_whoami(player, arg1, rest);
-  } else if (strcmp(cmd, "CHALLENGE") == 0) {
-    cmd_challenge(player, arg1, rest);
-  } else if (strcmp(cmd, "ACCEPT") == 0) {
-    cmd_accept(player, arg1, rest);
-  } else if (strcmp(cmd, "REJECT") == 0) {
-    cmd_reject(player, arg1, rest);
-  } else if (strcmp(cmd, "CHOOSE") == 0) {
-    cmd_choose(player, arg1, rest);
-  } else if (strcmp(cmd, "FIND") == 0) {
-    cmd_find(player, arg1, rest);
+/************************************************************************
+ * Copies a string field of n bytes out of a frame and null terminates
+ * it. Returns NULL if the field is empty or has a null byte in it.
+ */
+static char* frame_string(char* dest, const char* field, size_t n) {
+  if (n == 0 || memchr(field, '\0', n) != NULL) return NULL;
+  memcpy(dest, field, n);
+  dest[n] = '\0';
+  return dest;
+}
+
+/************************************************************************
+ * Performs the request in a frame of the binary protocol (without its
+ * length), by turning its fields back into the arguments of the matching
+ * command handler. Players are named by their id in MSG and CHALLENGE,
+ * CHOOSE takes 0, 1 or 2 for ROCK, PAPER or SCISSORS, and TOP and RANK
+ * take 1 where the text protocol has ARENA.
+ */
+static void run_binary(player_info* player, const char* frame, size_t len) {
+  int op = (unsigned char)frame[0];
+  const char* field = frame + 1;
+  size_t n = len - 1;
+  char text[CONN_MAXLINE + 1];  // a string field, null terminated
+  player->conn->binop = op;
+
+  player_info* target = NULL;
+  if ((op == BIN_MSG || op == BIN_CHALLENGE) && n >= 4) {
+    uint32_t id;
+    memcpy(&id, field, 4);
+    target = playerlist_findid(ntohl(id));
+    if (target == NULL) {
+      send_err(player, "Cannot find player %u.", ntohl(id));
+      return;
+    }
+  }
+
+  if (op == BIN_LOGIN) {
+    cmd_login(player, frame_string(text, field, n), NULL);
+  } else if (op == BIN_MOVETO && n == 1) {
+    snprintf(text, sizeof(text), "%d", (unsigned char)field[0]);
+    cmd_moveto(player, text, NULL);
+  } else if (op == BIN_BYE && n == 0) {
+    cmd_bye(player, NULL, NULL);
+  } else if (op == BIN_MSG && n >= 4) {
+    cmd_msg(player, target->name, frame_string(text, field + 4, n - 4));
+  } else if (op == BIN_STAT && n == 0) {
+    cmd_stat(player, NULL, NULL);
+  } else if (op == BIN_FIND) {
+    cmd_find(player, frame_string(text, field, n), NULL);
+  } else if (op == BIN_LIST && n == 0) {
+    cmd_list(player, NULL, NULL);
+  } else if (op == BIN_BROADCAST) {
+    cmd_broadcast(player, frame_string(text, field, n), NULL);
+  } else if (op == BIN_WHOAMI && n == 0) {
+    cmd_whoami(player, NULL, NULL);
+  } else if (op == BIN_CHALLENGE && n == 4) {
+    cmd_challenge(player, target->name, NULL);
+  } else if (op == BIN_ACCEPT && n == 0) {
+    cmd_accept(player, NULL, NULL);
+  } else if (op == BIN_REJECT && n == 0) {
+    cmd_reject(player, NULL, NULL);
+  } else if (op == BIN_CHOOSE && n == 1) {
+    unsigned char choice = field[0];
+    cmd_choose(player, choice < 3 ? (char*)choice_names[choice + 1] : "",
+               NULL);
+  } else if (op == BIN_QUEUE && n == 0) {
+    cmd_queue(player, NULL, NULL);
+  } else if (op == BIN_UNQUEUE && n == 0) {
+    cmd_unqueue(player, NULL, NULL);
+  } else if (op == BIN_TOP && n == 2) {
+    snprintf(text, sizeof(text), "%d",
+             field[0] ? (unsigned char)field[0] : LADDER_TOP);
+    cmd_top(player, text, field[1] ? "ARENA" : NULL);
+  } else if (op == BIN_RANK && n >= 1) {
+    cmd_rank(player, frame_string(text, field + 1, n - 1),
+             field[0] ? "ARENA" : NULL);
+  } else if (op >= BIN_LOGIN && op <= BIN_RANK) {
+    send_err(player, "Malformed request");
   } else {
     send_err(player, "Unknown command");
   }
 }
+
+/************************************************************************
+ * Performs the request in a frame of the binary protocol (without its
+ * length), and times it like docommand does.
+ */
+void dobinary(player_info* player, const char* frame, size_t len) {
+  int op = (unsigned char)frame[0];
+  long long start = stats_now();
+  run_binary(player, frame, len);
+  if (op >= BIN_LOGIN && op <= BIN_RANK) {
+    stats_command(op - BIN_LOGIN, stats_now() - start);
+  }
+}
@@ -4,11 +4,83 @@
 #define _ARENA_COMMANDS_H
 
 #define ROOM_LOBBY 0
+#define NUM_ROOMS 5  // the lobby plus arenas 1 through 4
+#define MAX_MSG_LEN 200
 
+#include "conn.h"
 #include "player.h"
 
+// Frame types of the binary protocol (see README). Requests from the
+// client mirror the text commands; frames from the server have the top
+// bit set.
+typedef enum bin_op {
+  BIN_LOGIN = 1,
+  BIN_MOVETO,
+  BIN_BYE,
+  BIN_MSG,
+  BIN_STAT,
+  BIN_FIND,
+  BIN_LIST,
+  BIN_BROADCAST,
+  BIN_WHOAMI,
+  BIN_CHALLENGE,
+  BIN_ACCEPT,
+  BIN_REJECT,
+  BIN_CHOOSE,
+  BIN_QUEUE,
+  BIN_UNQUEUE,
+  BIN_TOP,
+  BIN_RANK,
+
+  BIN_OK = 0x80,     // b request, then whatever that request returns
+  BIN_ERR,           // t message
+  BIN_NOTICE,        // t message, for notices without a layout of their own
+  BIN_JOINED,        // i player, b arena, s name
+  BIN_LEFT,          // i player, b arena, s name
+  BIN_MSG_FROM,      // i player, t message
+  BIN_BROADCAST_FROM,  // i player, t message
+  BIN_FOUND,         // b arena
+  BIN_CHALLENGED,    // i player, s name
+  BIN_REJECTED,      // i player
+  BIN_DUEL,          // i opponent
+  BIN_RESULT,        // i opponent, i winner (0 for a draw)
+  BIN_EXPIRED,       // i player the challenge was with (0 if gone)
+  BIN_MATCHED,       // i opponent, h their rating
+} bin_op;
+
+// Commands of the text protocol. The ones with a binary request come
+// first, in the same order as their opcodes.
+typedef enum command_id {
+  CMD_LOGIN,
+  CMD_MOVETO,
+  CMD_BYE,
+  CMD_MSG,
+  CMD_STAT,
+  CMD_FIND,
+  CMD_LIST,
+  CMD_BROADCAST,
+  CMD_WHOAMI,
+  CMD_CHALLENGE,
+  CMD_ACCEPT,
+  CMD_REJECT,
+  CMD_CHOOSE,
+  CMD_QUEUE,
+  CMD_UNQUEUE,
+  CMD_TOP,
+  CMD_RANK,
+  CMD_HELP,
+  CMD_BINARY,
+  CMD_STATS,
+  NUM_COMMANDS,
+} command_id;
+
+const char* command_name(command_id cmd);
+outbuf* make_notice(const char* format, ...);
+outbuf* make_frame(int type, const char* layout, ...);
+void send_frame(player_info* player, outbuf* frame);
 void send_notice(player_info* player, const char* format, ...);
 void send_err(player_info* player, const char* format, ...);
-void docommand(player_info* player, char* command);
+void docommand(player_info* player, char* line, size_t len);
+void dobinary(player_info* player, const char* frame, size_t len);
 
 #endif  // _ARENA_COMMANDS_H
@@ -0,0 +1,376 @@
+/* Support for running several arena processes ("nodes") as one server.
+ * The arenas are split into contiguous ranges, one per node, and a
+ * player's connection always lives on the node that owns the arena
+ * they are in (the lobby belongs to node 0). Since everything that
+ * happens inside an arena only involves players in it, all of that
+ * stays on a single node just like before.
+ *
+ * What does cross nodes:
+ * - Names. Every node registers its logged in players in a shared
+ *   directory (see directory.c), so names are unique in the whole
+ *   cluster, and FIND (as well as the errors for MSG and CHALLENGE)
+ *   can see players on other nodes.
+ * - Connections. When a player moves to an arena owned by another
+ *   node, their socket is passed to that node over a Unix domain
+ *   datagram socket (SCM_RIGHTS), together with their name, any input
+ *   that was read but not processed yet and any output that has not
+ *   been written yet. Connections accepted by a node that does not own
+ *   the lobby are passed on to node 0 right away. The client sees the
+ *   same TCP connection throughout.
+ *
+ * All nodes listen on the same TCP port with SO_REUSEPORT, so they can
+ * be started on one machine with the same command line apart from -c.
+ */
+#define _GNU_SOURCE
+
+#include "cluster.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "arena_protocol.h"
+#include "directory.h"
+#include "playerlist.h"
+#include "queue.h"
+#include "roomlist.h"
+
+int cluster_node = 0;
+int cluster_nnodes = 1;
+
+// Header of every message between nodes
+typedef struct cluster_msg {
+  int room;                        // arena the player goes to
+  char name[PLAYER_MAXNAME + 1];   // empty if the player is not logged in
+  int binary;                      // client speaks the binary protocol
+  int wins, losses, draws;         // the player's duel record
+  int rating;
+  uint32_t inlen;   // bytes of unprocessed input following the header
+  uint32_t outlen;  // bytes of unsent output following the input
+} cluster_msg;
+
+static char cluster_name[64];
+static int link_fd = -1;  // our datagram socket, for sending and receiving
+static void (*adopt_conn)(conn* c) = NULL;
+static pthread_t link_thread;
+
+/************************************************************************
+ * Fills in the (abstract) address of node's link socket.
+ */
+static socklen_t cluster_addr(int node, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                     "%s.%d", cluster_name, node);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/************************************************************************
+ * Returns the node that owns room.
+ */
+int cluster_owner(int room) { return room * cluster_nnodes / NUM_ROOMS; }
+
+/************************************************************************
+ * Sends a connection (fd) to node, along with the header and the bytes
+ * in data (m->inlen + m->outlen of them). Returns 0 on success, -1 if
+ * the node could not be reached.
+ */
+static int cluster_send(int node, cluster_msg* m, int fd, const char* data) {
+  struct sockaddr_un addr;
+  socklen_t addrlen = cluster_addr(node, &addr);
+
+  struct iovec iov[2] = {{m, sizeof(*m)},
+                         {(void*)data, m->inlen + m->outlen}};
+  union {  // aligned space for one fd's worth of control message
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } ctl;
+  struct msghdr msg = {.msg_name = &addr,
+                       .msg_namelen = addrlen,
+                       .msg_iov = iov,
+                       .msg_iovlen = (data != NULL) ? 2 : 1,
+                       .msg_control = ctl.buf,
+                       .msg_controllen = sizeof(ctl.buf)};
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  while (sendmsg(link_fd, &msg, MSG_NOSIGNAL) < 0) {
+    if (errno == EINTR) continue;
+    fprintf(stderr, "cluster: cannot reach node %d: %s\n", node,
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/************************************************************************
+ * Passes a connection that was just accepted to the node owning the
+ * lobby. Our copy of the socket is closed either way.
+ */
+void cluster_handoff_fd(int fd) {
+  cluster_msg m;
+  memset(&m, 0, sizeof(m));
+  m.room = ROOM_LOBBY;
+  cluster_send(cluster_owner(ROOM_LOBBY), &m, fd, NULL);
+  close(fd);
+}
+
+/************************************************************************
+ * Passes a player's connection on to the node owning the arena they are
+ * moving to (c->move_to), and frees our side of it. Must only be called
+ * by the connection's I/O engine, once it has stopped watching the
+ * socket. All unprocessed input (at most a receive ring's worth) and all
+ * unsent output (at most conn_outcap) go along, so the client's stream
+ * never has a gap in it. If the node cannot be reached, or input had to
+ * be thrown away (see conn_input), the output is written as far as the
+ * socket takes it, followed by an ERR, and the connection is closed.
+ */
+void cluster_handoff(conn* c) {
+  char input[CONN_RINGSIZE];
+  cluster_msg m;
+  memset(&m, 0, sizeof(m));
+  m.room = c->move_to;
+  strcpy(m.name, c->player->name);
+  m.binary = c->binary;
+  m.wins = c->player->wins;
+  m.losses = c->player->losses;
+  m.draws = c->player->draws;
+  m.rating = c->player->rating;
+  m.inlen = conn_take_input(c, input, sizeof(input));
+
+  // Write what the socket still takes, and take the rest along
+  conn_flush(c);
+  pthread_mutex_lock(&c->outlock);
+  c->dead = 1;
+  char* data = NULL;
+  if ((data = malloc(m.inlen + c->outlen + 1)) == NULL) {
+    perror("malloc handoff");
+    exit(1);
+  }
+  memcpy(data, input, m.inlen);
+  size_t off;
+  outbuf* b;
+  while ((b = conn_out_pop(c, &off)) != NULL) {
+    memcpy(data + m.inlen + m.outlen, b->data + off, b->len - off);
+    m.outlen += b->len - off;
+    conn_buf_put(b);
+  }
+  pthread_mutex_unlock(&c->outlock);
+
+  const char* why = c->overrun ? "Too much input while changing arenas"
+                               : "Arena is unavailable";
+  if (c->overrun || cluster_send(cluster_owner(m.room), &m, c->fd, data) < 0) {
+    // Nowhere to go; the client finds out as the connection closes
+    send(c->fd, data + m.inlen, m.outlen, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (m.binary) {
+      b = make_frame(BIN_ERR, "t", why);
+    } else {
+      b = conn_buf_new();
+      b->len = snprintf(b->data, CONN_BUFSIZE, "ERR %s\n", why);
+    }
+    send(c->fd, b->data, b->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    conn_buf_put(b);
+    directory_remove(m.name, cluster_owner(m.room));
+  }
+  free(data);
+  conn_close(c);
+}
+
+/************************************************************************
+ * Takes over a connection sent to us by another node, then hands it to
+ * our I/O engine.
+ */
+static void cluster_adopt(cluster_msg* m, int fd, const char* data) {
+  conn* c = conn_new(fd);
+  player_info* player = c->player;
+  c->binary = m->binary;
+
+  // Output the old node had not written yet goes out before anything else
+  if (m->outlen > 0) conn_send(c, data + m->inlen, m->outlen);
+
+  if (m->name[0] != '\0' && playerlist_changeplayername(player, m->name) < 0) {
+    // Cannot happen while the directory keeps names unique, but just in case
+    send_err(player, "Another player already logged in as %s", m->name);
+    conn_close(c);
+    return;
+  }
+  if (m->name[0] != '\0') {
+    player->state = PLAYER_REG;
+    player->wins = m->wins;
+    player->losses = m->losses;
+    player->draws = m->draws;
+    player->rating = m->rating;
+    roomlist_add(player, m->room);
+    queue_enqueue(newjob(JOB_JOIN, &m->room, player->name, player));
+  }
+
+  if (m->inlen > 0 && conn_input(c, data, m->inlen) < 0) {
+    if (c->move_to >= 0) {
+      cluster_handoff(c);
+    } else {
+      conn_close(c);
+    }
+    return;
+  }
+  adopt_conn(c);
+}
+
+/************************************************************************
+ * Code run by the link thread. Receives connections from other nodes.
+ */
+static void* cluster_main(void* arg) {
+  char* buf = NULL;
+  size_t bufsize = 0;
+
+  while (1) {
+    // Handoffs vary in size, so find out how big the next one is first
+    ssize_t want = recv(link_fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+    if (want < 0) {
+      if (errno == EINTR) continue;
+      perror("recv link");
+      exit(1);
+    }
+    if (want > bufsize) {
+      bufsize = want;
+      if ((buf = realloc(buf, bufsize)) == NULL) {
+        perror("malloc link buffer");
+        exit(1);
+      }
+    }
+
+    union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+    } ctl;
+    struct iovec iov = {buf, bufsize};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = ctl.buf,
+                         .msg_controllen = sizeof(ctl.buf)};
+    ssize_t n = recvmsg(link_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("recvmsg link");
+      exit(1);
+    }
+
+    int fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    cluster_msg* m = (cluster_msg*)buf;
+    if (fd < 0 || n < sizeof(cluster_msg) ||
+        n != sizeof(cluster_msg) + m->inlen + m->outlen || m->room < 0 ||
+        m->room >= NUM_ROOMS || cluster_owner(m->room) != cluster_node) {
+      fprintf(stderr, "cluster: dropping malformed handoff\n");
+      if (fd >= 0) close(fd);
+      continue;
+    }
+    m->name[PLAYER_MAXNAME] = '\0';
+    cluster_adopt(m, fd, buf + sizeof(cluster_msg));
+  }
+  return NULL;
+}
+
+/************************************************************************
+ * Joins the cluster called name as node number node of nnodes: attaches
+ * to the shared directory and sets up our link socket. Connections sent
+ * to us wait on the socket until cluster_start is called. Returns 0 on
+ * success, -1 on error.
+ */
+int cluster_init(const char* name, int node, int nnodes) {
+  snprintf(cluster_name, sizeof(cluster_name), "%s", name);
+  cluster_node = node;
+  cluster_nnodes = nnodes;
+
+  if (directory_init(cluster_name, node, nnodes) < 0) return -1;
+
+  if ((link_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+    perror("socket link");
+    return -1;
+  }
+  struct sockaddr_un addr;
+  socklen_t addrlen = cluster_addr(node, &addr);
+  if (bind(link_fd, (struct sockaddr*)&addr, addrlen) < 0) {
+    fprintf(stderr, "cluster: cannot bind node %d of %s: %s\n", node, name,
+            strerror(errno));
+    return -1;
+  }
+  // Room for a few handoffs with a full receive ring and output backlog
+  int size = 4 * (sizeof(cluster_msg) + CONN_RINGSIZE + conn_outcap);
+  setsockopt(link_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  return 0;
+}
+
+/************************************************************************
+ * Starts taking connections from the other nodes. adopt is called (on
+ * the link thread) with each of them, and must hand it to the I/O
+ * engine. Returns 0 on success, -1 on error.
+ */
+int cluster_start(void (*adopt)(conn* c)) {
+  if (cluster_nnodes == 1) return 0;
+  adopt_conn = adopt;
+  if (pthread_create(&link_thread, NULL, &cluster_main, NULL) != 0) {
+    perror("pthread_create link");
+    return -1;
+  }
+  pthread_detach(link_thread);
+  return 0;
+}
+
+/************************************************************************
+ * Claims a name for a player logging in on this node. Returns 0 on
+ * success, -1 if a player anywhere in the cluster has it, or -2 if
+ * the directory is full.
+ */
+int cluster_reserve(const char* name) {
+  if (cluster_nnodes == 1) return 0;
+  return directory_reserve(name, cluster_node, ROOM_LOBBY);
+}
+
+/************************************************************************
+ * Releases the name of a player who disconnected from this node.
+ */
+void cluster_logout(player_info* player) {
+  if (cluster_nnodes == 1 || player->name[0] == '\0') return;
+  directory_remove(player->name, cluster_node);
+}
+
+/************************************************************************
+ * Records that a player moved to room (which may be on another node).
+ */
+void cluster_moved(player_info* player, int room) {
+  if (cluster_nnodes == 1) return;
+  directory_move(player->name, cluster_owner(room), room);
+}
+
+/************************************************************************
+ * Looks for a logged in player on any node. Returns 0 and sets *room if
+ * one is found, or -1.
+ */
+int cluster_find(const char* name, int* room) {
+  if (cluster_nnodes == 1) return -1;
+  int node;
+  return directory_lookup(name, &node, room);
+}
+
+/************************************************************************
+ * Releases the names of all our players, when the node shuts down.
+ */
+void cluster_shutdown() {
+  if (cluster_nnodes == 1) return;
+  directory_clear_node(cluster_node);
+}
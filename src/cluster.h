@@ -0,0 +1,24 @@
+// Function prototypes for running several arena processes as a cluster
+#ifndef _CLUSTER_H
+#define _CLUSTER_H
+
+#include "conn.h"
+#include "player.h"
+
+#define CLUSTER_DEF_NAME "arena"  // default name of the cluster
+
+extern int cluster_node;    // this process's node number
+extern int cluster_nnodes;  // number of nodes, 1 when not in a cluster
+
+int cluster_init(const char* name, int node, int nnodes);
+int cluster_start(void (*adopt)(conn* c));
+int cluster_owner(int room);
+int cluster_reserve(const char* name);
+void cluster_logout(player_info* player);
+void cluster_moved(player_info* player, int room);
+int cluster_find(const char* name, int* room);
+void cluster_handoff(conn* c);
+void cluster_handoff_fd(int fd);
+void cluster_shutdown();
+
+#endif  // _CLUSTER_H
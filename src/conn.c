@@ -0,0 +1,575 @@
+/* Module for client connections. The I/O engines receive bytes from a
+ * socket straight into the connection's receive ring (see
+ * conn_recv_space) whenever they are available, and conn_received then
+ * runs every complete line in it through docommand. Lines are parsed in
+ * place, however many arrived in one read; only a line that wraps
+ * around the end of the ring is copied first. The ring comes from a
+ * slab and goes back to it whenever it is empty, so an idle player
+ * holds no input buffer at all.
+ *
+ * A client that sent BINARY speaks the binary protocol from then on, in
+ * which each request is a frame starting with its length (two bytes,
+ * network byte order). Those go to dobinary instead.
+ *
+ * Output goes the other way through conn_send, which never blocks:
+ * whatever the socket does not take right away is kept in a bounded
+ * per-connection queue that the engine drains once the socket becomes
+ * writable again. A player who stops reading therefore only holds up
+ * their own output, and once their backlog passes conn_outcap the
+ * conn_slow_policy decides whether we drop output or hang up on them.
+ *
+ * The queue holds references to outbufs rather than copies of the
+ * bytes, so a notice going to a whole room is formatted once and the
+ * same buffer is queued on every member's connection.
+ */
+
+#include "conn.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "arena_protocol.h"
+#include "cluster.h"
+#include "epoch.h"
+#include "notif_manager.h"
+#include "playerlist.h"
+#include "roomlist.h"
+#include "slab.h"
+#include "stats.h"
+#include "timer.h"
+#include "trace.h"
+
+size_t conn_outcap = CONN_DEF_OUTCAP;
+slow_policy conn_slow_policy = SLOW_DROP;
+
+static slab outbuf_slab;
+static slab ring_slab;
+
+static int conn_parse_frames(conn* c);
+
+/************************************************************************
+ * Sets up the allocators for output buffers and receive rings. Must be
+ * called before any connection is created.
+ */
+void conn_init() {
+  slab_init(&outbuf_slab, sizeof(outbuf));
+  slab_init(&ring_slab, CONN_RINGSIZE);
+}
+
+/************************************************************************
+ * Returns an empty output buffer, holding one reference to it. Fill in
+ * data and len before queueing it anywhere.
+ */
+outbuf* conn_buf_new() {
+  outbuf* b = slab_alloc(&outbuf_slab);
+  b->refs = 1;
+  b->len = 0;
+  return b;
+}
+
+/************************************************************************
+ * Drops a reference to an output buffer, freeing it with the last one.
+ */
+void conn_buf_put(outbuf* b) {
+  if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    slab_free(&outbuf_slab, b);
+  }
+}
+
+/************************************************************************
+ * Creates a new connection for the accepted socket fd, along with
+ * the player that goes with it, and registers the player in the global
+ * playerlist.
+ */
+conn* conn_new(int fd) {
+  conn* c = NULL;
+  if ((c = malloc(sizeof(conn))) == NULL) {
+    perror("conn malloc");
+    exit(1);
+  }
+
+  c->fd = fd;
+  c->player = new_player();
+  c->ring = NULL;
+  c->rhead = 0;
+  c->rtail = 0;
+  c->skipping = 0;
+
+  pthread_mutex_init(&c->outlock, NULL);
+  c->outq = NULL;
+  c->outqcap = 0;
+  c->outhead = 0;
+  c->outcount = 0;
+  c->outoff = 0;
+  c->outlen = 0;
+  c->outflight = 0;
+  c->dropped = 0;
+  c->outarmed = 0;
+  c->dead = 0;
+
+  c->move_to = -1;
+  c->overrun = 0;
+  c->binary = 0;
+  c->binop = 0;
+  c->last_input = timer_clock();
+
+  c->kick = NULL;
+  c->direct = 1;
+  c->io = NULL;
+  c->player->conn = c;
+
+  playerlist_addplayer(c->player);
+  notif_watch_idle(c->player);
+  stats_add(STATS_CONNS_OPENED, 1);
+  return c;
+}
+
+/************************************************************************
+ * Returns a pointer to the len bytes that start off bytes past the head
+ * of the receive ring. If they wrap around the end of the ring they are
+ * copied to scratch (which must have room for len bytes) first.
+ */
+static char* conn_ring_get(conn* c, size_t off, size_t len, char* scratch) {
+  size_t pos = (c->rhead + off) & (CONN_RINGSIZE - 1);
+  if (pos + len <= CONN_RINGSIZE) return c->ring + pos;
+
+  size_t first = CONN_RINGSIZE - pos;
+  memcpy(scratch, c->ring + pos, first);
+  memcpy(scratch + first, c->ring, len - first);
+  return scratch;
+}
+
+/************************************************************************
+ * Returns the number of bytes from the head of the receive ring up to
+ * and including the first newline, or 0 if there is no newline.
+ */
+static size_t conn_ring_line(conn* c) {
+  size_t avail = c->rtail - c->rhead;
+  size_t pos = c->rhead & (CONN_RINGSIZE - 1);
+  size_t first = (pos + avail <= CONN_RINGSIZE) ? avail : CONN_RINGSIZE - pos;
+
+  const char* nl = memchr(c->ring + pos, '\n', first);
+  if (nl != NULL) return (size_t)(nl - (c->ring + pos)) + 1;
+  if (first < avail && (nl = memchr(c->ring, '\n', avail - first)) != NULL) {
+    return first + (size_t)(nl - c->ring) + 1;
+  }
+  return 0;
+}
+
+/************************************************************************
+ * Runs every complete line in the receive ring through docommand. Lines
+ * are parsed right where they are in the ring; only a line that wraps
+ * around the end of the ring is copied first. Returns -1 if the
+ * connection is done, or 0 otherwise.
+ */
+static int conn_parse_lines(conn* c) {
+  char scratch[CONN_MAXLINE];
+  while (c->rhead != c->rtail) {
+    size_t len = conn_ring_line(c);
+    if (len == 0) {
+      if (c->rtail - c->rhead >= CONN_MAXLINE) {
+        // Nobody sends lines this long on purpose, so throw it away
+        if (!c->skipping) {
+          send_err(c->player, "Line too long (max length %d)", CONN_MAXLINE);
+        }
+        c->rhead = c->rtail;
+        c->skipping = 1;
+      }
+      break;
+    }
+
+    char* line = NULL;
+    if (c->skipping) {
+      c->skipping = 0;  // the end of a line that was too long
+    } else if (len > CONN_MAXLINE) {
+      send_err(c->player, "Line too long (max length %d)", CONN_MAXLINE);
+    } else {
+      line = conn_ring_get(c, 0, len, scratch);
+    }
+    c->rhead += len;
+    if (line == NULL) continue;
+
+    docommand(c->player, line, len);
+    if (c->player->state == PLAYER_DONE || c->move_to >= 0) return -1;
+    if (c->binary) return conn_parse_frames(c);
+  }
+  return 0;
+}
+
+/************************************************************************
+ * Runs every complete frame in the receive ring through dobinary, for
+ * connections in binary mode. Returns -1 if the connection is done, or
+ * 0 otherwise.
+ */
+static int conn_parse_frames(conn* c) {
+  char scratch[CONN_MAXLINE];
+  while (c->rtail - c->rhead >= 2) {
+    const unsigned char* hdr =
+        (const unsigned char*)conn_ring_get(c, 0, 2, scratch);
+    size_t len = ((size_t)hdr[0] << 8) | hdr[1];
+    if (len == 0 || len > CONN_MAXLINE) {
+      // There is no telling where the next frame starts, so give up
+      send_err(c->player, "Invalid frame length %zu (max length %d)", len,
+               CONN_MAXLINE);
+      return -1;
+    }
+    if (c->rtail - c->rhead < 2 + len) break;
+
+    const char* frame = conn_ring_get(c, 2, len, scratch);
+    c->rhead += 2 + len;
+    dobinary(c->player, frame, len);
+    if (c->player->state == PLAYER_DONE || c->move_to >= 0) return -1;
+  }
+  return 0;
+}
+
+/************************************************************************
+ * Returns how many bytes can be received straight into the connection's
+ * receive ring, and sets *buf to where they go. The engine then calls
+ * conn_received with the number of bytes it put there.
+ */
+size_t conn_recv_space(conn* c, char** buf) {
+  if (c->ring == NULL) c->ring = slab_alloc(&ring_slab);
+  size_t pos = c->rtail & (CONN_RINGSIZE - 1);
+  size_t space = CONN_RINGSIZE - (c->rtail - c->rhead);
+  *buf = c->ring + pos;
+  return (pos + space <= CONN_RINGSIZE) ? space : CONN_RINGSIZE - pos;
+}
+
+/************************************************************************
+ * Processes n bytes just received into the space handed out by
+ * conn_recv_space. Every complete line is passed to docommand (or every
+ * frame to dobinary, for binary clients), and a partial one stays in
+ * the ring until the rest of it arrives. Returns -1 if the connection
+ * should be closed (the player said BYE) or handed to another node, or
+ * 0 otherwise.
+ *
+ * Once the player is moving to another node (move_to is set), input is
+ * kept in the ring as it is, to be processed over there.
+ */
+int conn_received(conn* c, size_t n) {
+  stats_add(STATS_BYTES_IN, n);
+  __atomic_store_n(&c->last_input, timer_clock(), __ATOMIC_RELAXED);
+  c->rtail += n;
+  if (c->move_to >= 0) return -1;
+
+  // Commands look at other players (LIST, duels), who may be leaving
+  epoch_enter();
+  trace_arrive();
+  int ret = c->binary ? conn_parse_frames(c) : conn_parse_lines(c);
+  trace_arrival = 0;
+  epoch_exit();
+  if (c->rhead == c->rtail && c->move_to < 0) {
+    // Nothing left over, so an idle player holds no ring
+    slab_free(&ring_slab, c->ring);
+    c->ring = NULL;
+    c->rhead = c->rtail = 0;
+  }
+  return ret;
+}
+
+/************************************************************************
+ * Feeds len bytes of data received on the connection, for engines that
+ * cannot receive straight into the ring. See conn_received.
+ */
+int conn_input(conn* c, const char* data, size_t len) {
+  while (len > 0) {
+    char* buf;
+    size_t n = conn_recv_space(c, &buf);
+    if (n == 0) {  // only when moving, with the ring full
+      c->overrun = 1;
+      return -1;
+    }
+    if (n > len) n = len;
+    memcpy(buf, data, n);
+    if (conn_received(c, n) < 0 && c->move_to < 0) return -1;
+    data += n;
+    len -= n;
+  }
+  return (c->move_to >= 0) ? -1 : 0;
+}
+
+/************************************************************************
+ * Takes up to max bytes of input that has not been processed yet out of
+ * the receive ring, copying them to buf. Returns how many there were.
+ */
+size_t conn_take_input(conn* c, char* buf, size_t max) {
+  size_t n = c->rtail - c->rhead;
+  if (n > max) n = max;
+  if (n > 0) {
+    const char* data = conn_ring_get(c, 0, n, buf);
+    if (data != buf) memcpy(buf, data, n);
+    c->rhead += n;
+  }
+  return n;
+}
+
+/************************************************************************
+ * Writes as much of data to the socket as it takes without blocking.
+ * Returns the number of bytes written, or -1 if the connection is
+ * broken.
+ */
+static ssize_t conn_write(conn* c, const char* data, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n =
+        send(c->fd, data + done, len - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n >= 0) {
+      done += n;
+      stats_add(STATS_BYTES_OUT, n);
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else {
+      return -1;
+    }
+  }
+  return done;
+}
+
+/************************************************************************
+ * Adds a reference to b to the end of the output queue, of which the
+ * first off bytes have already been written. Must be called with
+ * outlock held.
+ */
+static void conn_enqueue(conn* c, outbuf* b, size_t off) {
+  if (c->outcount == c->outqcap) {
+    size_t newcap = (c->outqcap == 0) ? 16 : 2 * c->outqcap;
+    outbuf** newq = malloc(newcap * sizeof(outbuf*));
+    if (newq == NULL) {
+      perror("conn_enqueue");
+      exit(1);
+    }
+    for (size_t i = 0; i < c->outcount; i++) {
+      newq[i] = c->outq[(c->outhead + i) & (c->outqcap - 1)];
+    }
+    free(c->outq);
+    c->outq = newq;
+    c->outqcap = newcap;
+    c->outhead = 0;
+  }
+
+  __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+  if (c->outcount == 0) c->outoff = off;
+  c->outq[(c->outhead + c->outcount) & (c->outqcap - 1)] = b;
+  c->outcount++;
+  c->outlen += b->len - off;
+}
+
+/************************************************************************
+ * Takes the oldest buffer off the output queue, and stores in *off how
+ * much of it has already been written. The caller gets the queue's
+ * reference to the buffer. Returns NULL if the queue is empty. Must be
+ * called with outlock held.
+ */
+outbuf* conn_out_pop(conn* c, size_t* off) {
+  if (c->outcount == 0) return NULL;
+  outbuf* b = c->outq[c->outhead];
+  *off = c->outoff;
+  c->outlen -= b->len - c->outoff;
+  c->outhead = (c->outhead + 1) & (c->outqcap - 1);
+  c->outcount--;
+  c->outoff = 0;
+  return b;
+}
+
+/************************************************************************
+ * Marks the connection dead and hangs up on the client. The engine sees
+ * the hangup as a disconnect and cleans up as usual. Must be called
+ * with outlock held.
+ */
+static void conn_kill(conn* c) {
+  c->dead = 1;
+  size_t off;
+  outbuf* b;
+  while ((b = conn_out_pop(c, &off)) != NULL) conn_buf_put(b);
+  shutdown(c->fd, SHUT_RDWR);
+}
+
+/************************************************************************
+ * Sends len bytes of data to the client without ever blocking. If
+ * nothing is backed up, the data is written straight to the socket (for
+ * engines that allow it); otherwise the rest is queued for the engine to
+ * write later, subject to the conn_outcap limit, which is checked once
+ * for all of it so a message is only ever dropped whole. If from is not
+ * NULL, data is its contents and a reference to it is queued; otherwise
+ * the data is copied into as many buffers as it takes.
+ */
+static void conn_send_bytes(conn* c, outbuf* from, const char* data,
+                            size_t len) {
+  pthread_mutex_lock(&c->outlock);
+  if (c->dead) {
+    pthread_mutex_unlock(&c->outlock);
+    return;
+  }
+
+  size_t written = 0;
+  if (c->direct && c->outcount == 0 && c->outflight == 0) {
+    ssize_t n = conn_write(c, data, len);
+    if (n < 0) {  // broken connection, the engine will notice the hangup
+      conn_kill(c);
+      pthread_mutex_unlock(&c->outlock);
+      return;
+    }
+    written = n;
+  }
+
+  if (written < len) {
+    if (c->outlen + c->outflight + len - written > conn_outcap) {
+      if (conn_slow_policy == SLOW_DISCONNECT) {
+        conn_kill(c);
+        pthread_mutex_unlock(&c->outlock);
+        return;
+      } else if (written == 0) {
+        // Only drop whole messages so the client never sees half a line
+        c->dropped++;
+        pthread_mutex_unlock(&c->outlock);
+        return;
+      }
+    }
+
+    if (from != NULL) {
+      conn_enqueue(c, from, written);
+    } else {
+      while (written < len) {
+        size_t chunk = len - written;
+        if (chunk > CONN_BUFSIZE) chunk = CONN_BUFSIZE;
+        outbuf* b = conn_buf_new();
+        memcpy(b->data, data + written, chunk);
+        b->len = chunk;
+        conn_enqueue(c, b, 0);
+        conn_buf_put(b);
+        written += chunk;
+      }
+    }
+    if (!c->outarmed) {
+      c->outarmed = 1;
+      if (c->kick != NULL) c->kick(c);
+    }
+  }
+  pthread_mutex_unlock(&c->outlock);
+}
+
+/************************************************************************
+ * Sends the contents of b to the client, like conn_send_bytes. Safe to
+ * call from any thread, and the same buffer may be sent to any number
+ * of connections; the caller keeps its own reference to b.
+ */
+void conn_send_buf(conn* c, outbuf* b) {
+  conn_send_bytes(c, b, b->data, b->len);
+}
+
+/************************************************************************
+ * Sends len bytes of data to the client, like conn_send_buf, however
+ * many output buffers they take.
+ */
+void conn_send(conn* c, const char* data, size_t len) {
+  conn_send_bytes(c, NULL, data, len);
+}
+
+/************************************************************************
+ * Called by an engine when the socket is writable. Writes as much of the
+ * queued output as the socket takes, up to CONN_IOVMAX buffers per
+ * system call. Returns 1 if output is still waiting, or 0 once
+ * everything has been written.
+ */
+int conn_flush(conn* c) {
+  pthread_mutex_lock(&c->outlock);
+  while (c->outcount > 0 && !c->dead) {
+    struct iovec iov[CONN_IOVMAX];
+    int niov = 0;
+    size_t want = 0;
+    for (size_t i = 0; i < c->outcount && niov < CONN_IOVMAX; i++) {
+      outbuf* b = c->outq[(c->outhead + i) & (c->outqcap - 1)];
+      size_t off = (i == 0) ? c->outoff : 0;
+      iov[niov].iov_base = b->data + off;
+      iov[niov].iov_len = b->len - off;
+      want += b->len - off;
+      niov++;
+    }
+
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = niov};
+    ssize_t n = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) conn_kill(c);
+      break;
+    }
+    stats_add(STATS_BYTES_OUT, n);
+
+    // Let go of every buffer that has been written completely
+    size_t left = n;
+    while (left > 0) {
+      outbuf* b = c->outq[c->outhead];
+      size_t rest = b->len - c->outoff;
+      if (left < rest) {
+        c->outoff += left;
+        c->outlen -= left;
+        break;
+      }
+      size_t off;
+      conn_buf_put(conn_out_pop(c, &off));
+      left -= rest;
+    }
+    if ((size_t)n < want) break;  // the socket is full
+  }
+  if (c->outcount == 0) {
+    c->outarmed = 0;
+  }
+  int pending = (c->outcount > 0);
+  pthread_mutex_unlock(&c->outlock);
+  return pending;
+}
+
+/************************************************************************
+ * Hangs up on the client, letting output already queued (like an ERR
+ * saying why) go out first: with the read side shut down the engine
+ * sees a disconnect and cleans up as usual. Safe to call from any
+ * thread, as long as the connection's player has not gone.
+ */
+void conn_hangup(conn* c) {
+  if (c->move_to < 0) shutdown(c->fd, SHUT_RD);
+}
+
+/* Frees a closed connection once nobody can see it anymore */
+static void conn_release(void* arg) {
+  conn* c = (conn*)arg;
+  pthread_mutex_destroy(&c->outlock);
+  free(c);
+}
+
+/************************************************************************
+ * Unregisters the player and frees all resources used by the connection.
+ * Output still queued gets one last nonblocking chance to go out (so a
+ * BYE still gets its OK). The socket is closed once the conn is dead and
+ * the player unregistered. The conn itself is freed only once no
+ * notifier can still be sending to it through the player.
+ */
+void conn_close(conn* c) {
+  stats_add(STATS_CONNS_CLOSED, 1);
+  conn_flush(c);
+  pthread_mutex_lock(&c->outlock);
+  c->dead = 1;
+  pthread_mutex_unlock(&c->outlock);
+
+  if (c->move_to < 0) cluster_logout(c->player);
+  roomlist_remove(c->player);
+  playerlist_removeplayer(c->player);
+  player_free(c->player);
+  close(c->fd);
+  size_t off;
+  outbuf* b;
+  while ((b = conn_out_pop(c, &off)) != NULL) conn_buf_put(b);
+  if (c->ring != NULL) {
+    slab_free(&ring_slab, c->ring);
+  }
+  free(c->outq);
+  c->outq = NULL;
+  epoch_retire(c, conn_release);
+}
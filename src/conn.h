@@ -0,0 +1,96 @@
+// Connection abstraction shared by the I/O engines
+#ifndef _CONN_H
+#define _CONN_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "player.h"
+
+// Longest command line we are willing to buffer for one connection
+#define CONN_MAXLINE 1024
+
+// Size of a connection's receive ring. Must be a power of two with room
+// for a whole line (or frame) plus more input behind it.
+#define CONN_RINGSIZE 2048
+
+// Default cap on the bytes waiting to be written to one connection
+#define CONN_DEF_OUTCAP (64 * 1024)
+
+// Size of an output buffer, enough for any single protocol line
+#define CONN_BUFSIZE 320
+
+// Most buffers handed to the kernel in one write
+#define CONN_IOVMAX 64
+
+// What to do with a player whose outgoing backlog passes the cap
+typedef enum slow_policy {
+  SLOW_DROP,        // drop new output until the backlog drains
+  SLOW_DISCONNECT,  // hang up on the player
+} slow_policy;
+
+extern size_t conn_outcap;
+extern slow_policy conn_slow_policy;
+
+// A piece of output, usually one line. Once filled in it is never changed,
+// so the same buffer can be queued on any number of connections; it goes
+// back to the allocator when the last of them has written it.
+typedef struct outbuf {
+  int refs;
+  size_t len;
+  char data[CONN_BUFSIZE];
+} outbuf;
+
+// Everything an I/O engine needs to know about one client connection
+typedef struct conn conn;
+
+struct conn {
+  int fd;
+  player_info* player;
+  char* ring;    // receive ring of CONN_RINGSIZE bytes, NULL while empty
+  size_t rhead;  // position of the first unprocessed byte (free-running)
+  size_t rtail;  // position just past the last received byte
+  int skipping;  // dropping the rest of a line that was too long
+  int move_to;   // arena on another node the player is moving to, or -1
+  int overrun;   // input was lost while moving, so the move cannot go on
+  int binary;    // client switched to the binary protocol
+  int binop;     // opcode of the binary request being handled
+  long long last_input;  // timer_clock() when the client last sent data
+
+  pthread_mutex_t outlock;  // protects everything below
+  outbuf** outq;            // ring of buffers waiting to be written
+  size_t outqcap;           // size of outq, a power of two
+  size_t outhead;           // index in outq of the oldest buffer
+  size_t outcount;          // number of buffers in outq
+  size_t outoff;            // bytes of the oldest buffer already written
+  size_t outlen;            // bytes in outq still to be written
+  size_t outflight;  // bytes taken by the engine but not written yet
+  size_t dropped;    // messages thrown away by the slow consumer policy
+  int outarmed;      // engine has been kicked and has not drained out yet
+  int dead;          // connection is going away, output is discarded
+
+  // Engine hooks. kick is called with outlock held when output becomes
+  // pending. If direct is set, conn_send first tries to write straight
+  // to the (nonblocking) socket from the calling thread.
+  void (*kick)(conn* c);
+  int direct;
+  void* io;  // engine-private per-connection state
+};
+
+void conn_init();
+outbuf* conn_buf_new();
+void conn_buf_put(outbuf* b);
+
+conn* conn_new(int fd);
+size_t conn_recv_space(conn* c, char** buf);
+int conn_received(conn* c, size_t n);
+int conn_input(conn* c, const char* data, size_t len);
+size_t conn_take_input(conn* c, char* buf, size_t max);
+void conn_send(conn* c, const char* data, size_t len);
+void conn_send_buf(conn* c, outbuf* b);
+outbuf* conn_out_pop(conn* c, size_t* off);
+int conn_flush(conn* c);
+void conn_hangup(conn* c);
+void conn_close(conn* c);
+
+#endif  // _CONN_H
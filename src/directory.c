@@ -0,0 +1,285 @@
+/* The player directory shared by all the nodes (processes) of a
+ * cluster. It lives in a POSIX shared memory segment that every node
+ * maps, and records for every logged in player which node their
+ * connection is on and which room they are in. Nodes use it to keep
+ * names unique across the cluster and to find players hosted by other
+ * nodes.
+ *
+ * The table is an open addressing hash table split into DIR_SHARDS
+ * shards, each protected by a process-shared mutex. The mutexes are
+ * robust, so a node that dies while holding one does not take the rest
+ * of the cluster down with it. The first node to start sizes it for
+ * DIR_NODE_PLAYERS players per node, at most three quarters full, and
+ * a name is only ever put within DIR_MAX_PROBE slots of where it hashes
+ * to, so no lookup holds a lock for long however full the table is.
+ */
+#define _GNU_SOURCE
+
+#include "directory.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static dir_table* table = NULL;
+static uint32_t shard_slots;  // copied from the table, which never changes it
+
+/* FNV-1a hash of a name */
+static uint32_t directory_hash(const char* name) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* Locks a shard, repairing it if its last owner died holding the lock.
+ * The shard's data is never left half-updated, so it is still good. */
+static void directory_lock(dir_shard* s) {
+  if (pthread_mutex_lock(&s->lock) == EOWNERDEAD) {
+    pthread_mutex_consistent(&s->lock);
+  }
+}
+
+// Returns slot i of shard s
+static dir_slot* directory_slot(dir_shard* s, uint32_t i) {
+  size_t shard = s - table->shards;
+  return &table->slots[shard * shard_slots + (i & (shard_slots - 1))];
+}
+
+/* Returns the slot of the player called name in shard s, or NULL. If
+ * free is not NULL, it is set to the first slot the name could be put
+ * in, or NULL if there is none within DIR_MAX_PROBE slots. Caller holds
+ * the shard's lock. */
+static dir_slot* directory_find(dir_shard* s, uint32_t hash, const char* name,
+                                dir_slot** free) {
+  if (free != NULL) *free = NULL;
+  for (uint32_t n = 0; n < DIR_MAX_PROBE && n < shard_slots; n++) {
+    dir_slot* slot = directory_slot(s, hash + n);
+    if (slot->used == 0) {
+      if (free != NULL && *free == NULL) *free = slot;
+      return NULL;
+    }
+    if (slot->used < 0) {
+      if (free != NULL && *free == NULL) *free = slot;
+    } else if (!strcmp(slot->name, name)) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/* Empties a slot. If nothing was ever probed past it, it and any
+ * removed slots just before it go back to never used, so that removed
+ * slots do not pile up and make every lookup long. Caller holds the
+ * shard's lock. */
+static void directory_free_slot(dir_shard* s, dir_slot* slot) {
+  uint32_t i = (slot - table->slots) & (shard_slots - 1);
+  slot->used = -1;
+  s->nplayers--;
+  if (directory_slot(s, i + 1)->used != 0) return;
+  while (directory_slot(s, i)->used < 0) {
+    directory_slot(s, i)->used = 0;
+    i--;
+  }
+}
+
+static dir_shard* directory_shard(uint32_t hash) {
+  return &table->shards[hash >> 28 & (DIR_SHARDS - 1)];
+}
+
+// Returns the slots per shard a cluster of nnodes nodes needs
+static uint32_t directory_shard_slots(int nnodes) {
+  uint64_t players = (uint64_t)nnodes * DIR_NODE_PLAYERS / DIR_SHARDS;
+  uint32_t slots = DIR_MAX_PROBE;
+  while (slots / 4 * 3 < players) slots *= 2;
+  return slots;
+}
+
+/************************************************************************
+ * Maps the directory called name, creating it sized for a cluster of
+ * nnodes nodes if this is the first node to start (the others go by the
+ * size it picked). Entries left behind by an earlier run of this node
+ * are removed. Returns 0 on success, -1 on error.
+ */
+int directory_init(const char* name, int node, int nnodes) {
+  char path[64];
+  snprintf(path, sizeof(path), "/%s", name);
+  shard_slots = directory_shard_slots(nnodes);
+  size_t size = sizeof(dir_table) +
+                (size_t)DIR_SHARDS * shard_slots * sizeof(dir_slot);
+
+  int creator = 1;
+  int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    creator = 0;
+    fd = shm_open(path, O_RDWR, 0600);
+  }
+  if (fd < 0) {
+    perror("shm_open directory");
+    return -1;
+  }
+  if (creator && ftruncate(fd, size) < 0) {
+    perror("ftruncate directory");
+    close(fd);
+    return -1;
+  }
+
+  // Wait for whoever created the segment to size it
+  struct stat st;
+  for (int tries = 0; fstat(fd, &st) == 0 && st.st_size < sizeof(dir_table);
+       tries++) {
+    if (tries == 1000) {
+      fprintf(stderr, "Directory %s has the wrong size\n", path);
+      close(fd);
+      return -1;
+    }
+    usleep(1000);
+  }
+  if (!creator) size = st.st_size;  // the size it was made for wins
+
+  table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (table == MAP_FAILED) {
+    perror("mmap directory");
+    return -1;
+  }
+
+  if (creator) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (int i = 0; i < DIR_SHARDS; i++) {
+      pthread_mutex_init(&table->shards[i].lock, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    table->shard_slots = shard_slots;
+    table->size = size;
+    __atomic_store_n(&table->magic, DIR_MAGIC, __ATOMIC_RELEASE);
+  } else {
+    for (int tries = 0;
+         __atomic_load_n(&table->magic, __ATOMIC_ACQUIRE) != DIR_MAGIC;
+         tries++) {
+      if (tries == 1000) {
+        fprintf(stderr,
+                "Directory %s is not an arena directory (or is from an "
+                "incompatible version); remove /dev/shm%s\n",
+                path, path);
+        return -1;
+      }
+      usleep(1000);
+    }
+    shard_slots = table->shard_slots;
+    if (table->size != size || shard_slots < DIR_MAX_PROBE ||
+        (shard_slots & (shard_slots - 1)) != 0 ||
+        sizeof(dir_table) +
+                (uint64_t)DIR_SHARDS * shard_slots * sizeof(dir_slot) !=
+            size) {
+      fprintf(stderr, "Directory %s has the wrong layout; remove /dev/shm%s\n",
+              path, path);
+      return -1;
+    }
+  }
+
+  directory_clear_node(node);
+  return 0;
+}
+
+/************************************************************************
+ * Claims name for a player on the given node and room, as long as no
+ * player in the cluster has it. Returns 0 on success, -1 if the name is
+ * taken, or -2 if the directory is full: its shard is three quarters
+ * full, or there is no room near where the name hashes to.
+ */
+int directory_reserve(const char* name, int node, int room) {
+  uint32_t hash = directory_hash(name);
+  dir_shard* s = directory_shard(hash);
+  dir_slot* free;
+
+  directory_lock(s);
+  int ret = 0;
+  if (directory_find(s, hash, name, &free) != NULL) {
+    ret = -1;
+  } else if (free == NULL || s->nplayers >= shard_slots / 4 * 3) {
+    ret = -2;
+  } else {
+    strcpy(free->name, name);
+    free->node = node;
+    free->room = room;
+    free->used = 1;
+    s->nplayers++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return ret;
+}
+
+/************************************************************************
+ * Looks up the player called name. Returns 0 and fills in *node and
+ * *room if there is one, or returns -1.
+ */
+int directory_lookup(const char* name, int* node, int* room) {
+  uint32_t hash = directory_hash(name);
+  dir_shard* s = directory_shard(hash);
+
+  directory_lock(s);
+  dir_slot* slot = directory_find(s, hash, name, NULL);
+  if (slot != NULL) {
+    *node = slot->node;
+    *room = slot->room;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return (slot != NULL) ? 0 : -1;
+}
+
+/************************************************************************
+ * Records that the player called name is now in room, on node.
+ */
+void directory_move(const char* name, int node, int room) {
+  uint32_t hash = directory_hash(name);
+  dir_shard* s = directory_shard(hash);
+
+  directory_lock(s);
+  dir_slot* slot = directory_find(s, hash, name, NULL);
+  if (slot != NULL) {
+    slot->node = node;
+    slot->room = room;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+/************************************************************************
+ * Releases name, as long as it is held by a player on the given node.
+ */
+void directory_remove(const char* name, int node) {
+  uint32_t hash = directory_hash(name);
+  dir_shard* s = directory_shard(hash);
+
+  directory_lock(s);
+  dir_slot* slot = directory_find(s, hash, name, NULL);
+  if (slot != NULL && slot->node == node) {
+    directory_free_slot(s, slot);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+/************************************************************************
+ * Releases the names of all players on the given node.
+ */
+void directory_clear_node(int node) {
+  for (int i = 0; i < DIR_SHARDS; i++) {
+    dir_shard* s = &table->shards[i];
+    directory_lock(s);
+    for (uint32_t j = 0; j < shard_slots; j++) {
+      dir_slot* slot = directory_slot(s, j);
+      if (slot->used > 0 && slot->node == node) directory_free_slot(s, slot);
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+}
@@ -0,0 +1,45 @@
+// Function prototypes for the shared player directory of a cluster
+#ifndef _DIRECTORY_H
+#define _DIRECTORY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "player.h"
+
+#define DIR_SHARDS 16             // independently locked parts of the table
+#define DIR_NODE_PLAYERS 131072   // players the directory holds per node
+#define DIR_MAX_PROBE 128         // most slots a lookup looks at
+#define DIR_MAGIC 0x61726e32      // "arn2", bump when the layout changes
+
+// One entry of the directory
+typedef struct {
+  char name[PLAYER_MAXNAME + 1];
+  int8_t used;   // 0 never used, 1 holds a player, -1 player was removed
+  int16_t node;  // node the player's connection lives on
+  int16_t room;
+} dir_slot;
+
+typedef struct {
+  pthread_mutex_t lock;  // process-shared and robust
+  uint32_t nplayers;
+} dir_shard;
+
+// Layout of the shared memory segment: the shards, then the slots of
+// each shard in turn
+typedef struct {
+  uint32_t magic;        // set last, once everything else is initialized
+  uint32_t shard_slots;  // slots per shard (a power of two)
+  uint64_t size;         // of the whole segment
+  dir_shard shards[DIR_SHARDS];
+  dir_slot slots[];
+} dir_table;
+
+int directory_init(const char* name, int node, int nnodes);
+int directory_reserve(const char* name, int node, int room);
+int directory_lookup(const char* name, int* node, int* room);
+void directory_move(const char* name, int node, int room);
+void directory_remove(const char* name, int node);
+void directory_clear_node(int node);
+
+#endif  // _DIRECTORY_H
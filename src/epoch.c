@@ -0,0 +1,193 @@
+/* Epoch based reclamation. Lets threads read shared structures (the
+ * players, the name index) without taking a lock, while whoever removes
+ * something from them still gets to free it safely.
+ *
+ * Readers bracket every access with epoch_enter and epoch_exit, which
+ * only publish the global epoch in a record of the calling thread's own.
+ * A writer that has unlinked an object hands it to epoch_retire instead
+ * of freeing it. The object is tagged with the current epoch and only
+ * released once the epoch has moved on twice: the epoch only moves on
+ * when every thread inside a read section has seen the current one, so
+ * by then no reader can still hold a pointer it found before the object
+ * was unlinked.
+ *
+ * Read sections must be short and must never block (a reader stuck in
+ * one holds up all reclamation). Retiring is rare (players leaving,
+ * tables growing), so the retired objects are kept on one list under a
+ * mutex, and the epoch is moved on whenever something is retired or
+ * epoch_reclaim is called.
+ */
+
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+#define EPOCH_ACTIVE 1UL  // low bit of a thread's epoch: in a read section
+#define EPOCH_STEP 2UL
+
+// What one thread is doing
+typedef struct epoch_thread {
+  unsigned long epoch;  // global epoch when it entered, plus EPOCH_ACTIVE
+  int nesting;          // depth of nested read sections, only for the owner
+  int in_use;           // owned by a live thread
+  struct epoch_thread* next;
+} epoch_thread;
+
+// An object waiting to be released
+typedef struct retired {
+  void* ptr;
+  void (*release)(void* ptr);
+  unsigned long epoch;  // global epoch when it was retired
+  struct retired* next;
+} retired;
+
+static unsigned long global_epoch = 0;
+static epoch_thread* threads = NULL;  // never shrinks, so readers need no lock
+static retired* limbo = NULL;         // oldest first
+static retired** limbo_tail = &limbo;
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static slab retired_slab;
+static __thread epoch_thread* self = NULL;
+
+/************************************************************************
+ * Runs when a thread that has a record exits, and frees it up for the
+ * next thread.
+ */
+static void epoch_thread_exit(void* arg) {
+  epoch_thread* t = (epoch_thread*)arg;
+  pthread_mutex_lock(&epoch_lock);
+  t->in_use = 0;
+  pthread_mutex_unlock(&epoch_lock);
+}
+
+static void epoch_setup() {
+  if (pthread_key_create(&thread_key, epoch_thread_exit) != 0) {
+    perror("pthread_key_create epoch");
+    exit(1);
+  }
+  slab_init(&retired_slab, sizeof(retired));
+}
+
+/************************************************************************
+ * Gives the calling thread a record, either one left behind by a thread
+ * that exited or a new one.
+ */
+static epoch_thread* epoch_register() {
+  pthread_once(&epoch_once, epoch_setup);
+
+  pthread_mutex_lock(&epoch_lock);
+  epoch_thread* t = threads;
+  while (t != NULL && t->in_use) t = t->next;
+  if (t == NULL) {
+    if ((t = calloc(1, sizeof(epoch_thread))) == NULL) {
+      perror("malloc epoch_thread");
+      exit(1);
+    }
+    t->next = threads;
+    __atomic_store_n(&threads, t, __ATOMIC_RELEASE);
+  }
+  t->in_use = 1;
+  pthread_mutex_unlock(&epoch_lock);
+
+  pthread_setspecific(thread_key, t);
+  return t;
+}
+
+/************************************************************************
+ * Starts a read section. Anything the caller finds in a shared structure
+ * from here on stays allocated until the matching epoch_exit. Sections
+ * nest.
+ */
+void epoch_enter() {
+  if (self == NULL) self = epoch_register();
+  if (self->nesting++ > 0) return;
+  unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+  __atomic_store_n(&self->epoch, e | EPOCH_ACTIVE, __ATOMIC_RELAXED);
+  // The record must be visible before any read that follows
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/************************************************************************
+ * Ends a read section.
+ */
+void epoch_exit() {
+  if (--self->nesting > 0) return;
+  __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * Moves the global epoch on if every thread in a read section has seen
+ * the current one. Caller holds epoch_lock.
+ */
+static void epoch_try_advance() {
+  unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (epoch_thread* t = threads; t != NULL; t = t->next) {
+    unsigned long te = __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE);
+    if ((te & EPOCH_ACTIVE) && te != (e | EPOCH_ACTIVE)) return;
+  }
+  __atomic_store_n(&global_epoch, e + EPOCH_STEP, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * Moves the epoch on where possible and releases every retired object no
+ * reader can see anymore. The release functions run without any lock.
+ */
+static void epoch_collect(retired* fresh) {
+  pthread_mutex_lock(&epoch_lock);
+  if (fresh != NULL) {
+    fresh->epoch = global_epoch;
+    fresh->next = NULL;
+    *limbo_tail = fresh;
+    limbo_tail = &fresh->next;
+  }
+  epoch_try_advance();
+
+  // Readers that entered before the object was retired are gone once the
+  // epoch has moved on twice past it
+  retired* ready = NULL;
+  retired** last = &ready;
+  while (limbo != NULL && global_epoch - limbo->epoch >= 2 * EPOCH_STEP) {
+    *last = limbo;
+    last = &limbo->next;
+    limbo = limbo->next;
+  }
+  *last = NULL;
+  if (limbo == NULL) limbo_tail = &limbo;
+  pthread_mutex_unlock(&epoch_lock);
+
+  while (ready != NULL) {
+    retired* r = ready;
+    ready = r->next;
+    r->release(r->ptr);
+    slab_free(&retired_slab, r);
+  }
+}
+
+/************************************************************************
+ * Hands an object that has been unlinked from every shared structure to
+ * release (typically a free function) once no reader can still see it.
+ */
+void epoch_retire(void* ptr, void (*release)(void* ptr)) {
+  pthread_once(&epoch_once, epoch_setup);
+  retired* r = slab_alloc(&retired_slab);
+  r->ptr = ptr;
+  r->release = release;
+  epoch_collect(r);
+}
+
+/************************************************************************
+ * Releases whatever retired objects can be released by now, without
+ * retiring anything new. Cheap when nothing is waiting, so it can be
+ * called often.
+ */
+void epoch_reclaim() {
+  if (__atomic_load_n(&limbo, __ATOMIC_RELAXED) == NULL) return;
+  epoch_collect(NULL);
+}
@@ -0,0 +1,10 @@
+// Function prototypes for epoch based reclamation
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void* ptr, void (*release)(void* ptr));
+void epoch_reclaim();
+
+#endif  // _EPOCH_H
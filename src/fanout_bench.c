@@ -0,0 +1,142 @@
+/* Benchmark for notice fan-out, the work the notification manager does
+ * for every BROADCAST and JOIN/LEAVE. One room is filled with players
+ * and the same notice is sent to all of them, either formatted again
+ * for every recipient (send_notice) or formatted once and queued by
+ * reference (make_notice + conn_send_buf). Reports the cost per
+ * recipient for a range of room sizes.
+ *
+ * The connections do not write directly to their sockets (like with
+ * the io_uring engine), so only the fan-out itself is measured and not
+ * the system calls that later write the output.
+ *
+ * Usage: fanout_bench [rounds]
+ */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena_protocol.h"
+#include "conn.h"
+#include "playerlist.h"
+#include "roomlist.h"
+
+#define DEF_ROUNDS 200
+#define BENCH_ROOM 1
+
+static long rounds = DEF_ROUNDS;
+static const char* message =
+    "the quick brown fox jumps over the lazy dog, again and again and again";
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void notice_each(player_info* curr, void* arg) {
+  send_notice(curr, "From %s: %s", "sender", message);
+}
+
+static void notice_shared(player_info* curr, void* arg) {
+  conn_send_buf(curr->conn, (outbuf*)arg);
+}
+
+/************************************************************************
+ * Throws away everything queued on the connections, so the next round
+ * starts with empty queues.
+ */
+static void drain(conn** conns, int n) {
+  for (int i = 0; i < n; i++) {
+    pthread_mutex_lock(&conns[i]->outlock);
+    size_t off;
+    outbuf* b;
+    while ((b = conn_out_pop(conns[i], &off)) != NULL) conn_buf_put(b);
+    conns[i]->outarmed = 0;
+    pthread_mutex_unlock(&conns[i]->outlock);
+  }
+}
+
+/************************************************************************
+ * Runs both kinds of fan-out to a room of nplayers and prints the
+ * results.
+ */
+static void run(int nplayers) {
+  conn** conns = calloc(nplayers, sizeof(conn*));
+  int* peers = calloc(nplayers, sizeof(int));
+  if (conns == NULL || peers == NULL) {
+    perror("malloc conns");
+    exit(1);
+  }
+  for (int i = 0; i < nplayers; i++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    peers[i] = sv[1];
+    conns[i] = conn_new(sv[0]);
+    conns[i]->direct = 0;
+    player_info* player = conns[i]->player;
+    snprintf(player->name, sizeof(player->name), "p%d", i);
+    player->state = PLAYER_REG;
+    roomlist_add(player, BENCH_ROOM);
+  }
+
+  double each = 0, shared = 0;
+  for (long r = 0; r < rounds; r++) {
+    double start = now();
+    roomlist_foreach(BENCH_ROOM, notice_each, NULL);
+    each += now() - start;
+    drain(conns, nplayers);
+
+    start = now();
+    outbuf* notice = make_notice("From %s: %s", "sender", message);
+    roomlist_foreach(BENCH_ROOM, notice_shared, notice);
+    conn_buf_put(notice);
+    shared += now() - start;
+    drain(conns, nplayers);
+  }
+
+  for (int i = 0; i < nplayers; i++) {
+    conn_close(conns[i]);
+    close(peers[i]);
+  }
+  free(conns);
+  free(peers);
+
+  double total = (double)rounds * nplayers;
+  printf("%10d %16.1f %16.1f %8.2fx\n", nplayers, each * 1e9 / total,
+         shared * 1e9 / total, each / shared);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1) {
+    rounds = strtol(argv[1], NULL, 10);
+    if (rounds <= 0) {
+      fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  conn_outcap = SIZE_MAX;  // never drop anything
+  playerlist_init();
+  roomlist_init();
+  conn_init();
+
+  printf("%10s %16s %16s %9s\n", "recipients", "ns/rcpt each", "ns/rcpt shared",
+         "speedup");
+  int counts[] = {10, 100, 500, 1000, 2000};
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    run(counts[i]);
+  }
+
+  roomlist_destroy();
+  playerlist_destroy();
+  return 0;
+}
@@ -0,0 +1,379 @@
+/* Leaderboards. A ladder ranks players by rating, best first, with
+ * players of the same rating ordered by name (and sharing a rank).
+ *
+ * It is a skip list (Pugh) whose links also count how many places down
+ * the ladder they reach, so a player's rank is the sum of the links
+ * taken on the way to them. Putting a player on, taking one off, moving
+ * one after their rating changed and finding a rank all take O(log n)
+ * steps, and the top n are the first n nodes of the bottom level. A hash
+ * index of the nodes by name finds a player without knowing their
+ * rating.
+ *
+ * Each node gets a random number of levels, one more with probability
+ * 1/4 each, and keeps it for as long as it is on the ladder. A whole
+ * ladder can also be built at once from a sorted array, in O(n) after
+ * the sort, which is how the records of every player are ranked at
+ * startup (see records.c).
+ */
+
+#include "ladder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* FNV-1a hash of a name */
+static uint32_t ladder_hash(const char* name) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static ladder_node** ladder_alloc_buckets(unsigned int nbuckets) {
+  ladder_node** buckets = calloc(nbuckets, sizeof(ladder_node*));
+  if (buckets == NULL) {
+    perror("malloc ladder");
+    exit(1);
+  }
+  return buckets;
+}
+
+/* Makes a node with the given number of levels, linked to nothing */
+static ladder_node* ladder_new_node(const char* name, int rating,
+                                    int levels) {
+  ladder_node* x = malloc(sizeof(ladder_node) + levels * sizeof(ladder_link));
+  if (x == NULL) {
+    perror("malloc ladder");
+    exit(1);
+  }
+  strncpy(x->name, name, PLAYER_MAXNAME);
+  x->name[PLAYER_MAXNAME] = '\0';
+  x->rating = rating;
+  x->stamp = 0;
+  x->chain = NULL;
+  x->levels = levels;
+  for (int i = 0; i < levels; i++) {
+    x->links[i].next = NULL;
+    x->links[i].span = 0;
+  }
+  return x;
+}
+
+/************************************************************************
+ * Sets up an empty ladder.
+ */
+void ladder_init(ladder* l) {
+  l->head = ladder_new_node("", 0, LADDER_LEVELS);
+  l->levels = 1;
+  l->count = 0;
+  l->buckets = ladder_alloc_buckets(LADDER_MINBUCKETS);
+  l->nbuckets = LADDER_MINBUCKETS;
+  l->random = 2463534242u;
+}
+
+// Picks the number of levels of a new node (xorshift32)
+static int ladder_random_levels(ladder* l) {
+  uint32_t r = l->random;
+  r ^= r << 13;
+  r ^= r >> 17;
+  r ^= r << 5;
+  l->random = r;
+  int levels = 1;
+  while (levels < LADDER_LEVELS && (r & 3) == 0) {
+    levels++;
+    r >>= 2;
+  }
+  return levels;
+}
+
+/* Returns the node of the player called name, or NULL */
+static ladder_node* ladder_find(const ladder* l, const char* name) {
+  ladder_node* x = l->buckets[ladder_hash(name) & (l->nbuckets - 1)];
+  while (x != NULL && strcmp(x->name, name) != 0) x = x->chain;
+  return x;
+}
+
+/* Puts a node in the name index, which grows to keep about one node per
+ * bucket. Call before the node is counted. */
+static void ladder_index(ladder* l, ladder_node* x) {
+  if (l->count >= l->nbuckets) {
+    unsigned int nbuckets = l->nbuckets * 2;
+    ladder_node** buckets = ladder_alloc_buckets(nbuckets);
+    for (unsigned int b = 0; b < l->nbuckets; b++) {
+      ladder_node* next;
+      for (ladder_node* y = l->buckets[b]; y != NULL; y = next) {
+        next = y->chain;
+        ladder_node** to = &buckets[ladder_hash(y->name) & (nbuckets - 1)];
+        y->chain = *to;
+        *to = y;
+      }
+    }
+    free(l->buckets);
+    l->buckets = buckets;
+    l->nbuckets = nbuckets;
+  }
+  ladder_node** b = &l->buckets[ladder_hash(x->name) & (l->nbuckets - 1)];
+  x->chain = *b;
+  *b = x;
+}
+
+/* Takes a node out of the name index */
+static void ladder_unindex(ladder* l, ladder_node* x) {
+  ladder_node** p = &l->buckets[ladder_hash(x->name) & (l->nbuckets - 1)];
+  while (*p != x) p = &(*p)->chain;
+  *p = x->chain;
+}
+
+// Whether node x goes above a player called name rated rating
+static int ladder_above(const ladder_node* x, int rating, const char* name) {
+  return x->rating > rating ||
+         (x->rating == rating && strcmp(x->name, name) < 0);
+}
+
+/************************************************************************
+ * Links a node into the skip list at the place its rating and name say.
+ */
+static void ladder_link_in(ladder* l, ladder_node* x) {
+  ladder_node* update[LADDER_LEVELS];  // last node above x on each level
+  unsigned int rank[LADDER_LEVELS];    // and its place on the ladder
+  ladder_node* p = l->head;
+  for (int i = l->levels - 1; i >= 0; i--) {
+    rank[i] = (i == l->levels - 1) ? 0 : rank[i + 1];
+    while (p->links[i].next != NULL &&
+           ladder_above(p->links[i].next, x->rating, x->name)) {
+      rank[i] += p->links[i].span;
+      p = p->links[i].next;
+    }
+    update[i] = p;
+  }
+  // Levels nobody was using start out reaching the bottom from the head
+  for (int i = l->levels; i < x->levels; i++) {
+    rank[i] = 0;
+    update[i] = l->head;
+    l->head->links[i].span = l->count;
+  }
+
+  for (int i = 0; i < x->levels; i++) {
+    x->links[i].next = update[i]->links[i].next;
+    update[i]->links[i].next = x;
+    x->links[i].span = update[i]->links[i].span - (rank[0] - rank[i]);
+    update[i]->links[i].span = rank[0] - rank[i] + 1;
+  }
+  // Links above x now reach one place further
+  for (int i = x->levels; i < l->levels; i++) update[i]->links[i].span++;
+  if (x->levels > l->levels) l->levels = x->levels;
+  l->count++;
+}
+
+/************************************************************************
+ * Unlinks a node from the skip list, keeping it.
+ */
+static void ladder_unlink(ladder* l, ladder_node* x) {
+  ladder_node* update[LADDER_LEVELS];
+  ladder_node* p = l->head;
+  for (int i = l->levels - 1; i >= 0; i--) {
+    while (p->links[i].next != NULL &&
+           ladder_above(p->links[i].next, x->rating, x->name)) {
+      p = p->links[i].next;
+    }
+    update[i] = p;
+  }
+
+  for (int i = 0; i < l->levels; i++) {
+    if (update[i]->links[i].next == x) {
+      update[i]->links[i].span += x->links[i].span - 1;
+      update[i]->links[i].next = x->links[i].next;
+    } else {
+      update[i]->links[i].span--;
+    }
+  }
+  while (l->levels > 1 && l->head->links[l->levels - 1].next == NULL) {
+    l->levels--;
+  }
+  l->count--;
+}
+
+// Orders rows the way the ladder does
+static int ladder_compare(const void* a, const void* b) {
+  const ladder_row* ra = a;
+  const ladder_row* rb = b;
+  if (ra->rating != rb->rating) return (ra->rating > rb->rating) ? -1 : 1;
+  return strcmp(ra->name, rb->name);
+}
+
+// Orders rows of the same rating
+static int ladder_compare_names(const void* a, const void* b) {
+  return strcmp(((const ladder_row*)a)->name, ((const ladder_row*)b)->name);
+}
+
+/************************************************************************
+ * Sorts n rows the way the ladder orders players. Ratings fall in a
+ * narrow range, so the rows are put in order of rating by counting
+ * them, and only the players of each rating are sorted by name, which
+ * is a lot less comparing than sorting the whole lot.
+ */
+static void ladder_sort(ladder_row* rows, size_t n) {
+  if (n == 0) return;
+  int lowest = rows[0].rating, highest = rows[0].rating;
+  for (size_t k = 1; k < n; k++) {
+    if (rows[k].rating < lowest) lowest = rows[k].rating;
+    if (rows[k].rating > highest) highest = rows[k].rating;
+  }
+  size_t range = (size_t)((long)highest - lowest) + 1;
+  if (range > n) {  // too spread out to be worth counting
+    qsort(rows, n, sizeof(ladder_row), ladder_compare);
+    return;
+  }
+
+  // first[r] is where the players rated highest - r start
+  size_t* first = calloc(range + 1, sizeof(size_t));
+  ladder_row* sorted = malloc(n * sizeof(ladder_row));
+  if (first == NULL || sorted == NULL) {
+    perror("malloc ladder");
+    exit(1);
+  }
+  for (size_t k = 0; k < n; k++) first[highest - rows[k].rating + 1]++;
+  for (size_t r = 0; r < range; r++) first[r + 1] += first[r];
+  for (size_t k = 0; k < n; k++) {
+    sorted[first[highest - rows[k].rating]++] = rows[k];
+  }
+  // Each first[r] has moved on to where the next rating starts
+  for (size_t r = 0, start = 0; r < range; start = first[r++]) {
+    qsort(sorted + start, first[r] - start, sizeof(ladder_row),
+          ladder_compare_names);
+  }
+  memcpy(rows, sorted, n * sizeof(ladder_row));
+  free(sorted);
+  free(first);
+}
+
+/************************************************************************
+ * Puts the n players of rows (no two with the same name) on an empty
+ * ladder. Sorts the rows, then appends the players in order, which
+ * needs no searching at all.
+ */
+void ladder_build(ladder* l, ladder_row* rows, size_t n) {
+  ladder_sort(rows, n);
+  // Sized for all of them up front, rather than growing step by step
+  unsigned int nbuckets = l->nbuckets;
+  while (nbuckets < n) nbuckets *= 2;
+  if (nbuckets != l->nbuckets) {
+    free(l->buckets);
+    l->buckets = ladder_alloc_buckets(nbuckets);
+    l->nbuckets = nbuckets;
+  }
+
+  ladder_node* last[LADDER_LEVELS];  // lowest node so far on each level
+  unsigned int place[LADDER_LEVELS];  // and its place
+  for (int i = 0; i < LADDER_LEVELS; i++) {
+    last[i] = l->head;
+    place[i] = 0;
+  }
+
+  for (size_t k = 0; k < n; k++) {
+    ladder_node* x = ladder_new_node(rows[k].name, rows[k].rating,
+                                     ladder_random_levels(l));
+    for (int i = 0; i < x->levels; i++) {
+      last[i]->links[i].next = x;
+      last[i]->links[i].span = k + 1 - place[i];
+      last[i] = x;
+      place[i] = k + 1;
+    }
+    if (x->levels > l->levels) l->levels = x->levels;
+    ladder_index(l, x);
+    l->count++;
+  }
+  for (int i = 0; i < LADDER_LEVELS; i++) {
+    last[i]->links[i].span = l->count - place[i];
+  }
+}
+
+/************************************************************************
+ * Puts a player on the ladder with the given rating, or moves them to
+ * where it puts them if they are on already. stamp orders the changes
+ * of a player that may arrive out of order: one with a lower stamp than
+ * the last one made is ignored. Pass 0 where that cannot happen.
+ */
+void ladder_set(ladder* l, const char* name, int rating, uint64_t stamp) {
+  ladder_node* x = ladder_find(l, name);
+  if (x == NULL) {
+    x = ladder_new_node(name, rating, ladder_random_levels(l));
+    x->stamp = stamp;
+    ladder_index(l, x);
+    ladder_link_in(l, x);
+    return;
+  }
+  if (stamp < x->stamp) return;
+  x->stamp = stamp;
+  if (x->rating == rating) return;
+  ladder_unlink(l, x);
+  x->rating = rating;
+  ladder_link_in(l, x);
+}
+
+/************************************************************************
+ * Takes a player off the ladder, if they are on it.
+ */
+void ladder_remove(ladder* l, const char* name) {
+  ladder_node* x = ladder_find(l, name);
+  if (x == NULL) return;
+  ladder_unlink(l, x);
+  ladder_unindex(l, x);
+  free(x);
+}
+
+/************************************************************************
+ * Returns the rank of a player (1 for the best), and stores their rating
+ * in *rating. Returns 0 if they are not on the ladder.
+ */
+unsigned int ladder_rank(const ladder* l, const char* name, int* rating) {
+  ladder_node* x = ladder_find(l, name);
+  if (x == NULL) return 0;
+  // Everybody rated higher is ahead of them, and nobody else
+  unsigned int ahead = 0;
+  ladder_node* p = l->head;
+  for (int i = l->levels - 1; i >= 0; i--) {
+    while (p->links[i].next != NULL && p->links[i].next->rating > x->rating) {
+      ahead += p->links[i].span;
+      p = p->links[i].next;
+    }
+  }
+  *rating = x->rating;
+  return ahead + 1;
+}
+
+/************************************************************************
+ * Fills in rows with the first n players on the ladder. Returns how many
+ * there are (fewer than n if the ladder is shorter).
+ */
+int ladder_top(const ladder* l, int n, ladder_row* rows) {
+  int i = 0;
+  for (ladder_node* x = l->head->links[0].next; x != NULL && i < n;
+       x = x->links[0].next, i++) {
+    rows[i].rank = (i > 0 && rows[i - 1].rating == x->rating)
+                       ? rows[i - 1].rank
+                       : (unsigned int)i + 1;
+    memcpy(rows[i].name, x->name, sizeof(rows[i].name));
+    rows[i].rating = x->rating;
+  }
+  return i;
+}
+
+/************************************************************************
+ * Frees everything on a ladder, and the ladder's own memory. It has to be
+ * set up again to be used.
+ */
+void ladder_destroy(ladder* l) {
+  ladder_node* next;
+  for (ladder_node* x = l->head; x != NULL; x = next) {
+    next = x->links[0].next;
+    free(x);
+  }
+  free(l->buckets);
+  l->head = NULL;
+  l->buckets = NULL;
+  l->count = 0;
+}
@@ -0,0 +1,62 @@
+// Data types and function prototypes for the leaderboards
+#ifndef _LADDER_H
+#define _LADDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "player.h"
+
+#define LADDER_LEVELS 16   // so a ladder is fast up to 4^16 players
+#define LADDER_TOP 5       // players TOP shows if not told otherwise
+#define LADDER_TOP_MAX 8   // most players TOP shows (so they fit one line)
+#define LADDER_MINBUCKETS 64  // starting size of the name index
+
+typedef struct ladder_node ladder_node;
+
+// A link of a node to the next one on some level, and how many places
+// further down the ladder that one is (for the last link of a level, how
+// far the bottom is)
+typedef struct ladder_link {
+  ladder_node* next;
+  unsigned int span;
+} ladder_link;
+
+// A player on a ladder
+struct ladder_node {
+  char name[PLAYER_MAXNAME + 1];
+  int rating;
+  uint64_t stamp;      // of the last change, see ladder_set
+  ladder_node* chain;  // next in the same bucket of the name index
+  int levels;
+  ladder_link links[];
+};
+
+// Players ranked by rating (best first, ties by name), as a skip list
+// whose links know how far they reach, plus an index of the nodes by
+// name. Not thread safe: whoever shares one keeps it under a lock.
+typedef struct ladder {
+  ladder_node* head;  // with LADDER_LEVELS links, and nobody in it
+  int levels;         // in use
+  unsigned int count;
+  ladder_node** buckets;
+  unsigned int nbuckets;  // always a power of two
+  uint32_t random;        // state of the level generator
+} ladder;
+
+// A player as seen on a ladder. Players of the same rating share a rank.
+typedef struct ladder_row {
+  unsigned int rank;
+  char name[PLAYER_MAXNAME + 1];
+  int rating;
+} ladder_row;
+
+void ladder_init(ladder* l);
+void ladder_build(ladder* l, ladder_row* rows, size_t n);
+void ladder_set(ladder* l, const char* name, int rating, uint64_t stamp);
+void ladder_remove(ladder* l, const char* name);
+unsigned int ladder_rank(const ladder* l, const char* name, int* rating);
+int ladder_top(const ladder* l, int n, ladder_row* rows);
+void ladder_destroy(ladder* l);
+
+#endif  // _LADDER_H
@@ -0,0 +1,239 @@
+/* Matchmaking. Every arena has a pool of the players in it who asked to
+ * be matched with an opponent of about their rating (QUEUE), owned by
+ * the notification manager worker of the arena, so no locks are needed.
+ *
+ * A pool keeps its entries in one list by the time they were queued, and
+ * in buckets of MATCH_BUCKET_WIDTH rating points each. A match pass goes
+ * through the pool oldest first, and pairs each player still waiting
+ * with the oldest player in the nearest bucket whose rating is within
+ * their window. The window starts at MATCH_WINDOW and widens with every
+ * second waited, so nobody waits forever, and since it only looks at
+ * the buckets within the window, a match decision takes a handful of
+ * list lookups however many players are waiting.
+ *
+ * Entries are never taken out on request. A player is in a pool for as
+ * long as player->queued points at their entry; leaving the queue (or
+ * the arena, or the server) just stops that being so, and the next pass
+ * drops the entry. This keeps threads other than the owner out of the
+ * pool altogether.
+ */
+
+#include "match.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+static slab entry_slab;
+static pthread_once_t entry_once = PTHREAD_ONCE_INIT;
+
+static void match_setup() { slab_init(&entry_slab, sizeof(match_entry)); }
+
+/************************************************************************
+ * Sets up an empty pool for an arena.
+ */
+void match_pool_init(match_pool* pool, int room) {
+  pthread_once(&entry_once, match_setup);
+  pool->room = room;
+  pool->count = 0;
+  pool->oldest = pool->newest = NULL;
+  for (int b = 0; b < MATCH_BUCKETS; b++) {
+    pool->first[b] = pool->last[b] = NULL;
+  }
+}
+
+// Returns the bucket for a rating
+static int match_bucket(int rating) {
+  int b = rating / MATCH_BUCKET_WIDTH;
+  if (b < 0) return 0;
+  return (b < MATCH_BUCKETS) ? b : MATCH_BUCKETS - 1;
+}
+
+/************************************************************************
+ * Returns 1 if a player is waiting in the pool, 0 if not. Only the owner
+ * of the pool may call this.
+ */
+int match_queued(match_pool* pool, player_info* player) {
+  match_entry* e = __atomic_load_n(&player->queued, __ATOMIC_ACQUIRE);
+  // An entry of another pool may be recycled under us, but never into
+  // this one, as only we make entries for it
+  return e != NULL && e->room == pool->room;
+}
+
+/************************************************************************
+ * Puts a player in the pool, taking them out of any other they were in.
+ * Only the owner of the pool may call this, with now the clock in ms.
+ */
+void match_add(match_pool* pool, player_info* player, long long now) {
+  match_entry* e = slab_alloc(&entry_slab);
+  e->player = player->self;
+  e->rating = player->rating;
+  e->bucket = match_bucket(player->rating);
+  e->room = pool->room;
+  e->since = now;
+
+  e->older = pool->newest;
+  e->newer = NULL;
+  if (pool->newest != NULL) {
+    pool->newest->newer = e;
+  } else {
+    pool->oldest = e;
+  }
+  pool->newest = e;
+
+  e->prev = pool->last[e->bucket];
+  e->next = NULL;
+  if (pool->last[e->bucket] != NULL) {
+    pool->last[e->bucket]->next = e;
+  } else {
+    pool->first[e->bucket] = e;
+  }
+  pool->last[e->bucket] = e;
+  pool->count++;
+
+  __atomic_store_n(&player->queued, e, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * Takes a player out of whatever pool they are waiting in. Safe to call
+ * from any thread.
+ */
+void match_leave(player_info* player) {
+  __atomic_store_n(&player->queued, NULL, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * Unlinks an entry from its pool and frees it.
+ */
+static void match_remove(match_pool* pool, match_entry* e) {
+  if (e->older != NULL) {
+    e->older->newer = e->newer;
+  } else {
+    pool->oldest = e->newer;
+  }
+  if (e->newer != NULL) {
+    e->newer->older = e->older;
+  } else {
+    pool->newest = e->older;
+  }
+
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    pool->first[e->bucket] = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    pool->last[e->bucket] = e->prev;
+  }
+  pool->count--;
+  slab_free(&entry_slab, e);
+}
+
+// What became of the player of an entry
+typedef enum match_state {
+  MATCH_GONE,     // not waiting here anymore
+  MATCH_BUSY,     // waiting, but has a challenge pending
+  MATCH_WAITING,  // can be matched
+} match_state;
+
+static match_state match_check(match_pool* pool, match_entry* e,
+                               player_info** player) {
+  player_info* p = player_get(e->player);
+  *player = p;
+  if (p == NULL || __atomic_load_n(&p->queued, __ATOMIC_ACQUIRE) != e) {
+    return MATCH_GONE;
+  }
+  if (p->in_room != pool->room || p->duel_status == DUEL_ACTIVE) {
+    // Still points at the entry, unless they queued again meanwhile
+    __atomic_compare_exchange_n(&p->queued, &e, NULL, 0, __ATOMIC_ACQ_REL,
+                                __ATOMIC_ACQUIRE);
+    return MATCH_GONE;
+  }
+  return (p->duel_status == DUEL_PENDING) ? MATCH_BUSY : MATCH_WAITING;
+}
+
+/************************************************************************
+ * Finds the best opponent for the player of entry e, who may wait for
+ * one within window rating points: the oldest waiting player in the
+ * nearest bucket that has one in the window. Returns NULL if there is
+ * none.
+ */
+static match_entry* match_find(match_pool* pool, match_entry* e, long window,
+                               player_info** opponent) {
+  match_entry* best = NULL;
+  long best_diff = window + 1;
+  for (int d = 0; d < MATCH_BUCKETS; d++) {
+    // Every rating in buckets this far off differs by more than the window
+    if ((long)(d - 1) * MATCH_BUCKET_WIDTH >= best_diff) break;
+    int buckets[2] = {e->bucket - d, e->bucket + d};
+    for (int i = 0; i < (d == 0 ? 1 : 2); i++) {
+      int b = buckets[i];
+      if (b < 0 || b >= MATCH_BUCKETS) continue;
+      for (match_entry* c = pool->first[b]; c != NULL; c = c->next) {
+        player_info* p;
+        if (c == e || match_check(pool, c, &p) != MATCH_WAITING) continue;
+        long diff = labs((long)c->rating - e->rating);
+        if (diff > window) continue;  // a newer one may still be in reach
+        if (diff < best_diff) {
+          best = c;
+          best_diff = diff;
+          *opponent = p;
+        }
+        break;  // the others in the bucket waited less
+      }
+    }
+  }
+  return best;
+}
+
+/************************************************************************
+ * Runs a match pass over the pool, with now the clock in ms: pairs up as
+ * many waiting players as it can, takes them out of the pool and calls
+ * pair with each pair (the one who waited longer first). Drops the
+ * entries nobody wants anymore along the way. Returns the number of
+ * pairs made. Only the owner of the pool may call this.
+ */
+int match_run(match_pool* pool, long long now,
+              void (*pair)(player_info* p1, player_info* p2)) {
+  int pairs = 0;
+  match_entry* next;
+  for (match_entry* e = pool->oldest; e != NULL; e = next) {
+    next = e->newer;
+    player_info *p1, *p2;
+    match_state state = match_check(pool, e, &p1);
+    if (state == MATCH_GONE) {
+      match_remove(pool, e);
+      continue;
+    } else if (state == MATCH_BUSY) {
+      continue;
+    }
+
+    long window = MATCH_WINDOW + MATCH_WIDEN * (now - e->since) / 1000;
+    match_entry* other = match_find(pool, e, window, &p2);
+    if (other == NULL) continue;
+    if (other == next) next = other->newer;
+    match_remove(pool, e);
+    match_remove(pool, other);
+    match_leave(p1);
+    match_leave(p2);
+    pair(p1, p2);
+    pairs++;
+  }
+  return pairs;
+}
+
+/************************************************************************
+ * Updates the ratings of two players after a duel between them, which
+ * winner won (NULL for a draw), by the Elo system.
+ */
+void match_rate(player_info* p1, player_info* p2, player_info* winner) {
+  double expected = 1 / (1 + pow(10, (p2->rating - p1->rating) / 400.0));
+  double score = (winner == p1) ? 1 : (winner == p2) ? 0 : 0.5;
+  int change = (int)lround(MATCH_ELO_K * (score - expected));
+  p1->rating += change;
+  p2->rating -= change;
+}
@@ -0,0 +1,46 @@
+// Data types and function prototypes for the matchmaking pools
+#ifndef _MATCH_H
+#define _MATCH_H
+
+#include "player.h"
+
+#define MATCH_RATING_START 1000  // rating of a new player
+#define MATCH_ELO_K 32           // most a rating moves in one duel
+
+#define MATCH_BUCKET_WIDTH 25  // ratings per bucket
+#define MATCH_BUCKETS 160      // so ratings from 4000 up share the last one
+#define MATCH_WINDOW 50        // rating difference accepted right away
+#define MATCH_WIDEN 50         // and added for every second waited
+#define MATCH_INTERVAL_MS 200  // between two match passes over a pool
+
+// A player waiting in a pool. player->queued points back at it for as
+// long as they want to be matched from it.
+typedef struct match_entry {
+  player_handle player;
+  int rating;  // when queued
+  int bucket;
+  int room;    // of the pool
+  long long since;  // clock time queued, in ms
+  struct match_entry *older, *newer;  // in the pool, by time queued
+  struct match_entry *prev, *next;    // in the bucket, by time queued
+} match_entry;
+
+// The players waiting for a duel in one arena, owned by the notification
+// manager worker of that arena
+typedef struct match_pool {
+  int room;
+  int count;  // entries, including ones nobody wants anymore
+  match_entry *oldest, *newest;
+  match_entry* first[MATCH_BUCKETS];
+  match_entry* last[MATCH_BUCKETS];
+} match_pool;
+
+void match_pool_init(match_pool* pool, int room);
+int match_queued(match_pool* pool, player_info* player);
+void match_add(match_pool* pool, player_info* player, long long now);
+void match_leave(player_info* player);
+int match_run(match_pool* pool, long long now,
+              void (*pair)(player_info* p1, player_info* p2));
+void match_rate(player_info* p1, player_info* p2, player_info* winner);
+
+#endif  // _MATCH_H
@@ -0,0 +1,105 @@
+/* Checks of the matchmaking pools (see match.c), run by make check.
+ * Each check queues a few players in a fresh pool, runs match passes and
+ * compares the pairs made with the ones expected. Prints every check
+ * that fails and exits with status 1 if any did.
+ *
+ * Usage: match_check
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "match.h"
+#include "player.h"
+
+static int pairs_made;
+static player_info* paired[2];  // the last pair made
+
+static void record_pair(player_info* p1, player_info* p2) {
+  pairs_made++;
+  paired[0] = p1;
+  paired[1] = p2;
+}
+
+// Returns a new player waiting in an arena, with the given rating
+static player_info* waiting_player(int rating) {
+  player_info* player = player_alloc();
+  player_init(player);
+  player->state = PLAYER_REG;
+  player->in_room = 1;
+  player->rating = rating;
+  return player;
+}
+
+/************************************************************************
+ * Queues the players in order at clock time 0 and runs one match pass
+ * at now. Returns the number of pairs made, the last of which is left
+ * in paired. Everybody left in the pool leaves it before it is dropped.
+ */
+static int run_pass(player_info** players, int n, long long now) {
+  match_pool pool;
+  match_pool_init(&pool, 1);
+  epoch_enter();
+  for (int i = 0; i < n; i++) match_add(&pool, players[i], 0);
+  pairs_made = 0;
+  paired[0] = paired[1] = NULL;
+  match_run(&pool, now, record_pair);
+  for (int i = 0; i < n; i++) match_leave(players[i]);
+  match_run(&pool, now, record_pair);  // drops the entries left
+  epoch_exit();
+  return pairs_made;
+}
+
+/************************************************************************
+ * A pass has to look past the oldest player in a bucket when they are
+ * out of reach: with a, b and c queued in that order in the top bucket
+ * (which holds every rating from there on), a far above the others, b
+ * and c must be paired.
+ */
+static int check_behind_older() {
+  int top = (MATCH_BUCKETS - 1) * MATCH_BUCKET_WIDTH;
+  player_info* players[3] = {waiting_player(top + 10 * MATCH_WINDOW),
+                             waiting_player(top),
+                             waiting_player(top + MATCH_WINDOW / 2)};
+  int ok = (run_pass(players, 3, 0) == 1 && paired[0] == players[1] &&
+            paired[1] == players[2]);
+  for (int i = 0; i < 3; i++) player_free(players[i]);
+  return ok;
+}
+
+/************************************************************************
+ * Players further apart than MATCH_WINDOW are not paired right away, but
+ * are once they have waited long enough for their windows to reach.
+ */
+static int check_widening() {
+  player_info* players[2] = {
+      waiting_player(MATCH_RATING_START),
+      waiting_player(MATCH_RATING_START + 2 * MATCH_WINDOW)};
+  int secs = (MATCH_WINDOW + MATCH_WIDEN - 1) / MATCH_WIDEN;
+  int ok = (run_pass(players, 2, 0) == 0 &&
+            run_pass(players, 2, secs * 1000LL) == 1 &&
+            paired[0] == players[0] && paired[1] == players[1]);
+  for (int i = 0; i < 2; i++) player_free(players[i]);
+  return ok;
+}
+
+int main() {
+  struct {
+    const char* name;
+    int (*run)();
+  } checks[] = {
+      {"pairs players behind an older one out of their reach",
+       check_behind_older},
+      {"widens the window with the time waited", check_widening},
+  };
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+    if (!checks[i].run()) {
+      fprintf(stderr, "match_check: FAILED: %s\n", checks[i].name);
+      failed++;
+    }
+  }
+  if (failed > 0) return 1;
+  printf("match_check: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,170 @@
+// Module which maps player names to players, so looking up a player by
+// name does not depend on how many players are online. It is an open
+// addressing (linear probing) hash table split into NAMEHASH_SHARDS
+// shards, each with its own lock, so lookups of different names rarely
+// touch the same lock. The players' own name fields are the keys.
+//
+// Lookups take no lock. Slots are filled by storing the hash before the
+// player, and emptied by marking them NAMEHASH_GONE, so a reader never
+// sees a half written slot. A shard that needs to grow gets a new table,
+// and the old one is retired (see epoch.c) rather than freed, as readers
+// may still be probing it. The players found are protected the same way:
+// callers must be in a read section for as long as they use them.
+
+#include "namehash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+
+#define NAMEHASH_GONE ((player_info*)1)
+
+static namehash_shard shards[NAMEHASH_SHARDS];
+
+/* FNV-1a hash of a name */
+static uint32_t namehash_hash(const char* name) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* The shard a hash belongs to. Uses the top bits, the slot uses the bottom
+ * ones. */
+static namehash_shard* namehash_shard_of(uint32_t hash) {
+  return &shards[hash >> 28 & (NAMEHASH_SHARDS - 1)];
+}
+
+static namehash_table* namehash_alloc_table(uint32_t nslots) {
+  namehash_table* t =
+      calloc(1, sizeof(namehash_table) + nslots * sizeof(namehash_slot));
+  if (t == NULL) {
+    perror("malloc namehash");
+    exit(1);
+  }
+  t->nslots = nslots;
+  return t;
+}
+
+/* Initializes the (empty) index */
+void namehash_init() {
+  for (int i = 0; i < NAMEHASH_SHARDS; i++) {
+    shards[i].table = namehash_alloc_table(NAMEHASH_MINSLOTS);
+    shards[i].nused = 0;
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+}
+
+/* Returns the slot holding the player named name in table t, or NULL if
+ * there is none. Safe without the lock, inside a read section. */
+static namehash_slot* namehash_lookup(namehash_table* t, uint32_t hash,
+                                      const char* name) {
+  uint32_t mask = t->nslots - 1;
+  for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+    namehash_slot* slot = &t->slots[i];
+    player_info* player = __atomic_load_n(&slot->player, __ATOMIC_ACQUIRE);
+    if (player == NULL) return NULL;
+    if (player != NAMEHASH_GONE && slot->hash == hash &&
+        !strcmp(player->name, name))
+      return slot;
+  }
+}
+
+/* Puts a player into the first free slot for hash. Caller holds the
+ * shard's lock and has made sure there is room. Returns 1 if the slot was
+ * never used before, else 0. */
+static int namehash_place(namehash_table* t, uint32_t hash,
+                          player_info* player) {
+  uint32_t mask = t->nslots - 1;
+  uint32_t i = hash & mask;
+  while (t->slots[i].player != NULL && t->slots[i].player != NAMEHASH_GONE)
+    i = (i + 1) & mask;
+  int fresh = (t->slots[i].player == NULL);
+  t->slots[i].hash = hash;
+  __atomic_store_n(&t->slots[i].player, player, __ATOMIC_RELEASE);
+  return fresh;
+}
+
+/* Gives shard s a new table without removed slots, twice as big if it is
+ * more than half full of players. Caller holds s's lock. */
+static void namehash_rehash(namehash_shard* s) {
+  namehash_table* old = s->table;
+  uint32_t nplayers = 0;
+  for (uint32_t i = 0; i < old->nslots; i++)
+    if (old->slots[i].player != NULL && old->slots[i].player != NAMEHASH_GONE)
+      nplayers++;
+
+  uint32_t newn = old->nslots;
+  while (nplayers * 2 >= newn) newn *= 2;
+  namehash_table* t = namehash_alloc_table(newn);
+  s->nused = 0;
+  for (uint32_t i = 0; i < old->nslots; i++)
+    if (old->slots[i].player != NULL && old->slots[i].player != NAMEHASH_GONE)
+      s->nused += namehash_place(t, old->slots[i].hash, old->slots[i].player);
+  __atomic_store_n(&s->table, t, __ATOMIC_RELEASE);
+  epoch_retire(old, free);
+}
+
+/* Gives player the name, as long as no other player has it. Checking for
+ * the name and taking it happen under one lock, so two players can never
+ * both get the same name. Returns -1 if the name is taken, else 0. */
+int namehash_reserve(player_info* player, const char* name) {
+  uint32_t hash = namehash_hash(name);
+  namehash_shard* s = namehash_shard_of(hash);
+
+  pthread_mutex_lock(&s->lock);
+  if (namehash_lookup(s->table, hash, name) != NULL) {
+    pthread_mutex_unlock(&s->lock);
+    return -1;
+  }
+  if ((s->nused + 1) * 4 > s->table->nslots * 3) {  // keep load under 3/4
+    namehash_rehash(s);
+  }
+  strcpy(player->name, name);
+  s->nused += namehash_place(s->table, hash, player);
+  pthread_mutex_unlock(&s->lock);
+  return 0;
+}
+
+/* Returns the player with the given name, or NULL if there is none. Takes
+ * no lock. The caller must be in a read section (epoch_enter) for as long
+ * as it uses the player. */
+player_info* namehash_find(const char* name) {
+  uint32_t hash = namehash_hash(name);
+  namehash_shard* s = namehash_shard_of(hash);
+
+  epoch_enter();
+  namehash_table* t = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+  namehash_slot* slot = namehash_lookup(t, hash, name);
+  player_info* player =
+      (slot != NULL) ? __atomic_load_n(&slot->player, __ATOMIC_ACQUIRE) : NULL;
+  epoch_exit();
+  return (player == NAMEHASH_GONE) ? NULL : player;
+}
+
+/* Releases the player's name. Does nothing if the player never got one. */
+void namehash_remove(player_info* player) {
+  if (player->name[0] == '\0') return;
+  uint32_t hash = namehash_hash(player->name);
+  namehash_shard* s = namehash_shard_of(hash);
+
+  pthread_mutex_lock(&s->lock);
+  namehash_slot* slot = namehash_lookup(s->table, hash, player->name);
+  if (slot != NULL && slot->player == player) {
+    __atomic_store_n(&slot->player, NAMEHASH_GONE, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* Frees all resources used by the index */
+void namehash_destroy() {
+  for (int i = 0; i < NAMEHASH_SHARDS; i++) {
+    free(shards[i].table);
+    shards[i].table = NULL;
+    pthread_mutex_destroy(&shards[i].lock);
+  }
+}
@@ -0,0 +1,41 @@
+// Function prototypes and typedefs for the player name index
+#ifndef _NAMEHASH_H
+#define _NAMEHASH_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "player.h"
+
+#define NAMEHASH_SHARDS 16    // must be a power of two
+#define NAMEHASH_MINSLOTS 64  // starting size of each shard, a power of two
+
+// One slot of a shard. player is NULL if the slot was never used, or
+// NAMEHASH_GONE if its player was removed.
+typedef struct {
+  uint32_t hash;
+  player_info* player;
+} namehash_slot;
+
+// The slots of a shard. Growing a shard replaces its table as a whole,
+// so a reader always sees a table and its size together.
+typedef struct {
+  uint32_t nslots;  // always a power of two
+  namehash_slot slots[];
+} namehash_table;
+
+// A part of the name index. Lookups take no lock at all; the lock only
+// keeps changes to the shard apart.
+typedef struct {
+  namehash_table* table;
+  uint32_t nused;  // slots holding a player or NAMEHASH_GONE
+  pthread_mutex_t lock;
+} namehash_shard;
+
+void namehash_init();
+int namehash_reserve(player_info* player, const char* name);
+player_info* namehash_find(const char* name);
+void namehash_remove(player_info* player);
+void namehash_destroy();
+
+#endif  // _NAMEHASH_H
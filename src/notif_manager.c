@@ -1,10 +1,70 @@
+/* The notification manager. It is made up of one or more worker threads,
+ * each draining its own job queue and so handling the jobs for the
+ * arenas routed to that queue (see queue.c).
+ *
+ * Every notice is sent either as text or as a binary frame, depending
+ * on which protocol the recipient speaks.
+ *
+ * Each worker also keeps a timer wheel (see timer.c) for the timeouts:
+ * challenges nobody answers, duels somebody never makes a choice in,
+ * and connections that have gone quiet. The worker runs whatever timers
+ * are due after each batch of jobs, and never sleeps past the next one.
+ * Timeouts are not cancelled when a duel ends early. Every challenge
+ * bumps the duel_serial of both players, and a duel timeout only acts on
+ * the players whose serial and duel status are still what they were
+ * when it was armed.
+ *
+ * The worker of an arena also owns its matchmaking pool (see match.c),
+ * and runs a match pass over it every MATCH_INTERVAL_MS for as long as
+ * anybody is waiting in it. Matched players go straight into a duel, as
+ * if one had challenged the other and they had accepted.
+ */
 #include "notif_manager.h"
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "arena_protocol.h"
+#include "cluster.h"
+#include "epoch.h"
+#include "match.h"
 #include "playerlist.h"
+#include "records.h"
+#include "roomlist.h"
+#include "slab.h"
+#include "stats.h"
+#include "timer.h"
+#include "trace.h"
+
+#define NOTIF_BATCH 64  // most jobs taken off the queue at once
+
+// A timeout about one player, or about both sides of a duel
+typedef struct notif_timer {
+  timer t;  // must come first
+  player_handle player;  // the challenger, for duel timeouts
+  player_handle other;   // the challenged
+  unsigned int serial;   // their duel_serials when it was armed
+  unsigned int other_serial;
+} notif_timer;
+
+// The matchmaking pool of an arena, and the timer of its match passes
+typedef struct notif_pool {
+  timer t;  // must come first
+  match_pool pool;
+  int armed;
+} notif_pool;
+
+// Timeouts in ms, 0 where there is none
+static long challenge_ms = 0;
+static long duel_ms = 0;
+static long idle_ms = 0;
+
+static timer_wheel* wheels = NULL;  // one per worker, indexed like the queues
+static __thread timer_wheel* my_wheel = NULL;
+static slab timer_slab;
+static notif_pool pools[NUM_ROOMS];  // each only touched by its worker
 
 // Forward declarations of functions to handle each job type
 static void handle_job_msg(job* job);
@@ -16,39 +76,93 @@ static void handle_job_reject(job* job);
 static void handle_job_choice(job* job);
 static void handle_job_broadcast(job* job);
 static void handle_job_find(job* job);
+static void handle_job_queue(job* job);
+static void handle_job_unqueue(job* job);
+
+// and the timeouts
+static void fire_challenge(timer_wheel* w, timer* t, long long now);
+static void fire_duel(timer_wheel* w, timer* t, long long now);
+static void fire_idle(timer_wheel* w, timer* t, long long now);
+static void fire_match(timer_wheel* w, timer* t, long long now);
 
 // Array of function pointers from above
 static void (*job_handlers[])(job*) = {
     handle_job_msg,       handle_job_join,      handle_job_leave,
     handle_job_challenge, handle_job_accept,    handle_job_reject,
     handle_job_choice,    handle_job_broadcast, handle_job_find,
+    handle_job_queue,     handle_job_unqueue,
 };
 
 /************************************
- * Read a job off the queue when it arrives and call the appropriate handler
- * function.
+ * Read jobs off queue q as they arrive, taking everything that is pending
+ * (up to NOTIF_BATCH jobs) at once, and call the appropriate handler
+ * function for each of them in order.
  */
-static void notif_loop() {
-  while (1) {
-    job* job = queue_dequeue_wait();
-
-    if (job->type > 0 &&
-        job->type <= sizeof(job_handlers) / sizeof(job_handlers[0])) {
-      job_handlers[job->type - 1](job);  // -1 because job_done would be in slot
-                                         // 0, but it needs no handler
-    } else if (job->type == JOB_DONE) {
+static void notif_loop(int q) {
+  job* jobs[NOTIF_BATCH];
+  int done = 0;
+  stats_set_notifier(q);
+  my_wheel = &wheels[q];
+  while (!done) {
+    long long wait = timer_next(my_wheel, timer_clock());
+    int n = queue_dequeue_batch(q, jobs, NOTIF_BATCH, (int)wait);
+
+    long long start = stats_now();
+    // The players the handlers look up stay valid for the whole batch
+    epoch_enter();
+    for (int i = 0; i < n; i++) {
+      job* job = jobs[i];
+      stats_job(job->type);
+      trace_stamp(&job->dequeued);
+      if (job->type > 0 &&
+          job->type <= sizeof(job_handlers) / sizeof(job_handlers[0])) {
+        job_handlers[job->type - 1](job);  // -1 because job_done would be in
+                                           // slot 0, but it needs no handler
+      } else if (job->type == JOB_DONE) {
+        done = 1;
+      }
+      if (trace_on) trace_job(job);
       destroyjob(job);
-      return;
     }
-
-    destroyjob(job);
+    timer_advance(my_wheel, timer_clock());
+    epoch_exit();
+    epoch_reclaim();
+    stats_add(STATS_JOBS_DONE, n);
+    stats_add(STATS_NOTIF_BUSY_NS, stats_now() - start);
   }
 }
 
+// Jobs hold a handle to the player who issued them, who may have gone
+// since. Handlers that need that player get NULL then and drop the job.
+static player_info* job_origin(job* job) { return player_get(job->origin); }
+
+/************************************************************************
+ * Arms a duel timeout on the calling worker's wheel, to fire ms from now
+ * (unless ms is 0), about the duel challenger and challenged are in.
+ */
+static void arm_duel_timer(player_info* challenger, player_info* challenged,
+                           void (*fire)(timer_wheel*, timer*, long long),
+                           long ms) {
+  if (ms == 0) return;
+  notif_timer* nt = slab_alloc(&timer_slab);
+  nt->t.fire = fire;
+  nt->player = challenger->self;
+  nt->serial = challenger->duel_serial;
+  nt->other = challenged->self;
+  nt->other_serial = challenged->duel_serial;
+  timer_arm(my_wheel, &nt->t, timer_clock() + ms);
+}
+
 static void handle_job_msg(job* job) {
-  player_info* from = job->origin;
+  player_info* from = job_origin(job);
+  if (from == NULL) return;
   player_info* to = playerlist_findplayer(job->to.player_name);
-  if (to == NULL) {
+  int room;
+  if (to == NULL && cluster_find(job->to.player_name, &room) == 0) {
+    // Logged in on another node, so certainly not in our arena
+    send_err(from, "%s is not in your arena, cannot send message.",
+             job->to.player_name);
+  } else if (to == NULL) {
     send_err(from, "Cannot find player %s.", job->to.player_name);
   } else if (from == to) {
     send_err(from, "Cannot MSG yourself. Stop.");
@@ -56,38 +170,66 @@ static void handle_job_msg(job* job) {
     send_err(from, "%s is not logged in.", to->name);  // should be impossible?
   } else if (to->in_room != from->in_room) {
     send_err(from, "%s is not in your arena, cannot send message.", to->name);
+  } else if (to->conn->binary) {
+    send_frame(to, make_frame(BIN_MSG_FROM, "it", from->id, job->content));
   } else {
-    send_notice(to, "From %s: %s", job->origin->name, job->content);
+    send_notice(to, "From %s: %s", from->name, job->content);
   }
 }
 
-static void join_leave_helper(int room, const char* mover_name,
-                              const char* join_leave) {
-  int size = playerlist_getsize();
-  for (size_t i = 0; i < size; i++) {
-    player_info* curr = playerlist_get(i);
-    if (curr->in_room != room || curr->state != PLAYER_REG) continue;
-    if (room == ROOM_LOBBY)
-      send_notice(curr, "%s has %s the lobby.", mover_name, join_leave);
-    else
-      send_notice(curr, "%s has %s arena %d.", mover_name, join_leave, room);
+// A notice going to many players, in both protocols. Each is formatted
+// once and the same buffer is handed to everyone speaking that protocol.
+typedef struct notice {
+  player_info* skip;  // player who does not get it, or NULL
+  outbuf* text;
+  outbuf* frame;
+} notice;
+
+static void notice_to(player_info* curr, void* arg) {
+  notice* n = (notice*)arg;
+  if (curr != n->skip) {
+    conn_send_buf(curr->conn, curr->conn->binary ? n->frame : n->text);
   }
 }
 
+static void notice_put(notice* n) {
+  conn_buf_put(n->text);
+  conn_buf_put(n->frame);
+}
+
+static void join_leave_helper(job* job, int type, const char* join_leave) {
+  // The mover's name and id travel in the job, since by the time a LEAVE
+  // is handled the player may already have moved on to another node
+  int room = job->to.room;
+  notice n = {NULL, NULL,
+              make_frame(type, "ibs", job->origin_id, room, job->content)};
+  if (room == ROOM_LOBBY)
+    n.text = make_notice("%s has %s the lobby.", job->content, join_leave);
+  else
+    n.text = make_notice("%s has %s arena %d.", job->content, join_leave, room);
+  roomlist_foreach(room, notice_to, &n);
+  notice_put(&n);
+}
+
 static void handle_job_join(job* job) {
-  join_leave_helper(job->to.room, job->origin->name, "joined");
+  join_leave_helper(job, BIN_JOINED, "joined");
 }
 
 static void handle_job_leave(job* job) {
-  join_leave_helper(job->to.room, job->origin->name, "left");
+  join_leave_helper(job, BIN_LEFT, "left");
 }
 
 static void handle_job_challenge(job* job) {
-  player_info* challenger = job->origin;
+  player_info* challenger = job_origin(job);
+  if (challenger == NULL) return;
   player_info* target = playerlist_findplayer(job->to.player_name);
-  if (target == NULL) {
-    fprintf(stderr, "Malformed job on queue, type CHALLENGE. Origin: %s",
-            challenger->name);
+  int room;
+  if (target == NULL && cluster_find(job->to.player_name, &room) == 0) {
+    send_err(challenger, "%s is not in your arena, cannot send challenge.",
+             job->to.player_name);
+  } else if (target == NULL) {
+    send_err(challenger, "%s does not match the name of a logged in player.",
+             job->to.player_name);
   } else if (target == challenger) {
     send_err(challenger, "Cannot challenge yourself. Stop.");
   } else if (target->state != PLAYER_REG) {
@@ -97,111 +239,191 @@ static void handle_job_challenge(job* job) {
     send_err(challenger, "%s is not in your arena, cannot send challenge.",
              target->name);
   } else {
-    send_notice(target,
-                "%s has challenged you to a duel. Please ACCEPT or REJECT",
-                job->origin->name);
+    if (target->conn->binary) {
+      send_frame(target, make_frame(BIN_CHALLENGED, "is", challenger->id,
+                                    challenger->name));
+    } else {
+      send_notice(target,
+                  "%s has challenged you to a duel. Please ACCEPT or REJECT",
+                  challenger->name);
+    }
     target->duel_status = DUEL_PENDING;
-    target->opponent = challenger;
+    target->opponent = challenger->self;
+    target->duel_serial++;
     challenger->duel_status = DUEL_PENDING;
-    challenger->opponent = target;
+    challenger->opponent = target->self;
+    challenger->duel_serial++;
+    arm_duel_timer(challenger, target, fire_challenge, challenge_ms);
+  }
+}
+
+/************************************************************************
+ * Starts a duel between two players in the same arena, and takes them
+ * out of the matchmaking pool. Done before either is told, so that a
+ * CHOOSE sent as soon as they are finds the duel on.
+ */
+static void start_duel(player_info* challenger, player_info* accepter) {
+  challenger->opponent = accepter->self;
+  challenger->duel_serial++;
+  challenger->duel_status = DUEL_ACTIVE;
+  accepter->opponent = challenger->self;
+  accepter->duel_serial++;
+  accepter->duel_status = DUEL_ACTIVE;
+  match_leave(challenger);
+  match_leave(accepter);
+  arm_duel_timer(challenger, accepter, fire_duel, duel_ms);
+}
+
+// Asks a duelist for their choice; binary clients know to from the frame
+static void send_choose(player_info* p) {
+  if (!p->conn->binary) {
+    send_notice(p, "Please CHOOSE from ROCK, PAPER, or SCISSORS.");
   }
 }
 
 static void handle_job_accept(job* job) {
-  player_info* accepter = job->origin;
-  player_info* challenger = accepter->opponent;
+  player_info* accepter = job_origin(job);
+  if (accepter == NULL) return;
+  player_info* challenger = player_get(accepter->opponent);
   if (challenger == NULL) {
-    fprintf(stderr, "Malformed job on queue, type ACCEPT. Origin: %s",
-            accepter->name);
+    send_err(accepter, "Your challenger has left the server.");
+    accepter->duel_status = DUEL_NONE;
   } else if (challenger->in_room != accepter->in_room) {
     send_err(accepter,
              "%s has left your arena! Cannot accept their challenge. Move "
-             "to their arena and try again");
+             "to their arena and try again",
+             challenger->name);
   } else {
-    send_notice(
-        accepter,
-        "You have accepted the challenge from %s. Let the battle begin!",
-        challenger->name);
-    send_notice(challenger,
-                "%s has accepted your challenge. Let the battle begin!",
-                accepter->name);
-
-    accepter->duel_status = DUEL_ACTIVE;
-    send_notice(accepter, "Please CHOOSE from ROCK, PAPER, or SCISSORS.");
-    challenger->duel_status = DUEL_ACTIVE;
-    send_notice(challenger, "Please CHOOSE from ROCK, PAPER, or SCISSORS.");
+    start_duel(challenger, accepter);
+    if (accepter->conn->binary) {
+      send_frame(accepter, make_frame(BIN_DUEL, "i", challenger->id));
+    } else {
+      send_notice(
+          accepter,
+          "You have accepted the challenge from %s. Let the battle begin!",
+          challenger->name);
+    }
+    if (challenger->conn->binary) {
+      send_frame(challenger, make_frame(BIN_DUEL, "i", accepter->id));
+    } else {
+      send_notice(challenger,
+                  "%s has accepted your challenge. Let the battle begin!",
+                  accepter->name);
+    }
+    send_choose(accepter);
+    send_choose(challenger);
   }
 }
 
 static void handle_job_reject(job* job) {
-  player_info* rejecter = job->origin;
-  player_info* challenger = rejecter->opponent;
+  player_info* rejecter = job_origin(job);
+  if (rejecter == NULL) return;
+  player_info* challenger = player_get(rejecter->opponent);
   if (challenger == NULL) {
-    fprintf(stderr, "Malformed job on queue, type REJECT. Origin: %s",
-            rejecter->name);
+    rejecter->duel_status = DUEL_NONE;  // nobody left to tell
   } else {
-    send_notice(challenger, "%s has rejected your challenge.", rejecter->name);
+    if (challenger->conn->binary) {
+      send_frame(challenger, make_frame(BIN_REJECTED, "i", rejecter->id));
+    } else {
+      send_notice(challenger, "%s has rejected your challenge.",
+                  rejecter->name);
+    }
     rejecter->duel_status = DUEL_NONE;
     challenger->duel_status = DUEL_NONE;
   }
 }
 
 const char* determine_winner(player_info* p1, player_info* p2) {
-  const char* choice1 = p1->choice;
-  const char* choice2 = p2->choice;
-
-  if (strcmp(choice1, choice2) == 0) {
+  if (p1->choice == p2->choice) {
     return "Nobody";  // TODO: I hate this
   }
 
-  if ((strcmp(choice1, "ROCK") == 0 && strcmp(choice2, "SCISSORS") == 0) ||
-      (strcmp(choice1, "PAPER") == 0 && strcmp(choice2, "ROCK") == 0) ||
-      (strcmp(choice1, "SCISSORS") == 0 && strcmp(choice2, "PAPER") == 0)) {
+  // Each choice beats the one before it, and ROCK beats SCISSORS
+  if ((p1->choice - p2->choice + 3) % 3 == 1) {
     return p1->name;
   } else {
     return p2->name;
   }
 }
 
+/************************************************************************
+ * Tells both duelists who won (NULL for nobody) and ends the duel. how
+ * goes after the winner's name in the text notice. Their ratings and
+ * records change, and they move on the leaderboards, unless the duel ran
+ * out of time before either of them chose.
+ */
+static void finish_duel(player_info* p1, player_info* p2, player_info* winner,
+                        const char* how) {
+  if (winner != NULL || p1->choice != CHOICE_NONE) {
+    match_rate(p1, p2, winner);
+    record_result(p1, p2, winner);
+    roomlist_rerank(p1);
+    roomlist_rerank(p2);
+  }
+  unsigned int winner_id = (winner != NULL) ? winner->id : 0;
+  const char* winner_name = (winner != NULL) ? winner->name : "Nobody";
+  player_info* players[] = {p1, p2};
+  for (int i = 0; i < 2; i++) {
+    player_info* p = players[i];
+    player_info* other = players[1 - i];
+    if (p->conn->binary) {
+      send_frame(p, make_frame(BIN_RESULT, "ii", other->id, winner_id));
+    } else {
+      send_notice(p, "Result of your duel with %s: %s wins%s!", other->name,
+                  winner_name, how);
+    }
+  }
+  p1->choice = CHOICE_NONE;
+  p1->duel_status = DUEL_NONE;
+  p2->choice = CHOICE_NONE;
+  p2->duel_status = DUEL_NONE;
+}
+
 static void handle_job_choice(job* job) {
-  player_info* p1 = job->origin;
-  player_info* p2 = p1->opponent;
+  player_info* p1 = job_origin(job);
+  if (p1 == NULL) return;
+  player_info* p2 = player_get(p1->opponent);
+  if (p2 == NULL) {
+    send_err(p1, "Your opponent has left the server. The duel is off.");
+    p1->choice = CHOICE_NONE;
+    p1->duel_status = DUEL_NONE;
+    return;
+  }
 
-  if (p1->choice == NULL || p2->choice == NULL) {
+  if (p1->choice == CHOICE_NONE || p2->choice == CHOICE_NONE) {
     return;  // only one player has submitted a choice, so leave
   }
 
   const char* winner = determine_winner(p1, p2);
-  send_notice(p1, "Result of your duel with %s: %s wins!", p1->opponent,
-              winner);
-  send_notice(p2, "Result of your duel with %s: %s wins!", p2->opponent,
-              winner);
-  p1->choice = NULL;
-  p1->duel_status = DUEL_NONE;
-  p2->choice = NULL;
-  p2->duel_status = DUEL_NONE;
+  finish_duel(p1, p2,
+              (winner == p1->name)   ? p1
+              : (winner == p2->name) ? p2
+                                     : NULL,
+              "");
 }
 
 static void handle_job_broadcast(job* job) {
-  // iterate over all players. if they are in the same arena, send a MSG
-  player_info* from = job->origin;
-  int size = playerlist_getsize();
-  for (size_t i = 0; i < size; i++) {
-    player_info* curr = playerlist_get(i);
-    if (curr->in_room == from->in_room && from != curr) {
-      send_notice(curr, "From %s: %s", from->name, job->content);
-    }
-  }
+  // send a MSG to every other player in the same arena
+  player_info* from = job_origin(job);
+  if (from == NULL) return;
+  notice n = {from, make_notice("From %s: %s", from->name, job->content),
+              make_frame(BIN_BROADCAST_FROM, "it", from->id, job->content)};
+  roomlist_foreach(from->in_room, notice_to, &n);
+  notice_put(&n);
 }
 
 static void handle_job_find(job* job) {
-  player_info* from = job->origin;
+  player_info* from = job_origin(job);
+  if (from == NULL) return;
   player_info* target = playerlist_findplayer(job->to.player_name);
-  if (target == NULL) {
+  int room;
+  if (target == NULL && cluster_find(job->to.player_name, &room) < 0) {
     send_err(from, "%s is not a logged in player.", job->to.player_name);
   } else {
-    int room = target->in_room;
-    if (room == ROOM_LOBBY) {
+    if (target != NULL) room = target->in_room;
+    if (from->conn->binary) {
+      send_frame(from, make_frame(BIN_FOUND, "b", room));
+    } else if (room == ROOM_LOBBY) {
       send_notice(from, "lobby");
     } else {
       send_notice(from, "%d", room);
@@ -209,25 +431,239 @@ static void handle_job_find(job* job) {
   }
 }
 
-/************************
- * End the notification manager.
+/************************************************************************
+ * Puts a player in the matchmaking pool of their arena, and sets off the
+ * match passes over it if nobody was waiting yet.
  */
-static void notif_destroy() {
-  int pret = 0;
-  if ((pret = pthread_detach(pthread_self())) != 0) {
-    perror("pthread detach notif manager");
-    exit(1);
+static void handle_job_queue(job* job) {
+  player_info* player = job_origin(job);
+  if (player == NULL) return;
+  notif_pool* np = &pools[job->origin_room];
+  if (player->in_room != job->origin_room) {
+    send_err(player, "You left arena %d before you could be queued.",
+             job->origin_room);
+  } else if (player->duel_status == DUEL_ACTIVE) {
+    send_err(player, "Already in a duel, not queued.");
+  } else if (match_queued(&np->pool, player)) {
+    send_err(player, "Already waiting for a duel.");
+  } else {
+    match_add(&np->pool, player, timer_clock());
+    if (!np->armed) {
+      np->armed = 1;
+      timer_arm(my_wheel, &np->t, timer_clock() + MATCH_INTERVAL_MS);
+    }
   }
+}
+
+static void handle_job_unqueue(job* job) {
+  player_info* player = job_origin(job);
+  if (player == NULL) return;
+  if (__atomic_load_n(&player->queued, __ATOMIC_ACQUIRE) == NULL) {
+    send_err(player, "You are not waiting for a duel.");
+  } else {
+    match_leave(player);
+  }
+}
+
+// Tells a matched player who they are up against
+static void send_matched(player_info* p, player_info* other) {
+  if (p->conn->binary) {
+    send_frame(p, make_frame(BIN_MATCHED, "ih", other->id, other->rating));
+  } else {
+    send_notice(p, "You have been matched with %s (rating %d). Let the "
+                "battle begin!", other->name, other->rating);
+  }
+}
+
+// Starts the duel between two players the matchmaking has paired up
+static void start_match(player_info* p1, player_info* p2) {
+  start_duel(p1, p2);
+  send_matched(p1, p2);
+  send_matched(p2, p1);
+  send_choose(p1);
+  send_choose(p2);
+  stats_add(STATS_MATCHES, 1);
+}
+
+/************************************************************************
+ * Runs a match pass over an arena's pool, and the next one in
+ * MATCH_INTERVAL_MS if anybody is left waiting.
+ */
+static void fire_match(timer_wheel* w, timer* t, long long now) {
+  notif_pool* np = (notif_pool*)t;
+  match_run(&np->pool, now, start_match);
+  if (np->pool.count > 0) {
+    timer_arm(w, t, now + MATCH_INTERVAL_MS);
+  } else {
+    np->armed = 0;
+  }
+}
+
+// Returns one side of the duel a timeout was armed for, or NULL if they
+// are gone or have moved on (to the next stage, or another duel)
+static player_info* duelist(player_handle handle, unsigned int serial,
+                            duel_status status) {
+  player_info* p = player_get(handle);
+  if (p == NULL || p->duel_status != status || p->duel_serial != serial) {
+    return NULL;
+  }
+  return p;
+}
+
+/************************************************************************
+ * Looks up both sides of the duel a timeout is about. Returns 0 if there
+ * is nothing left to do, and frees the timer. MOVETO is refused during
+ * a duel, but a move can still race with the challenge that starts one;
+ * if the duelists are then in an arena another worker handles, the duel
+ * is that worker's business now: the timer is handed over, and 0
+ * returned too.
+ */
+static int duel_timer_players(timer_wheel* w, notif_timer* nt,
+                              duel_status status, player_info** p1,
+                              player_info** p2, long long now) {
+  *p1 = duelist(nt->player, nt->serial, status);
+  *p2 = duelist(nt->other, nt->other_serial, status);
+  if (*p1 == NULL && *p2 == NULL) {
+    slab_free(&timer_slab, nt);
+    return 0;
+  }
+  int q = queue_of_room((*p1 != NULL) ? (*p1)->in_room : (*p2)->in_room);
+  if (&wheels[q] != w) {
+    if (timer_post(&wheels[q], &nt->t, now)) queue_wake(q);
+    return 0;
+  }
+  return 1;
+}
+
+static void send_expired(player_info* p, player_info* other) {
+  if (p->conn->binary) {
+    send_frame(p, make_frame(BIN_EXPIRED, "i", other ? other->id : 0));
+  } else if (other != NULL) {
+    send_notice(p, "Your challenge with %s has expired.", other->name);
+  } else {
+    send_notice(p, "Your challenge has expired.");
+  }
+}
+
+/************************************************************************
+ * Nobody answered a challenge in time, so it is off.
+ */
+static void fire_challenge(timer_wheel* w, timer* t, long long now) {
+  notif_timer* nt = (notif_timer*)t;
+  player_info *challenger, *target;
+  if (!duel_timer_players(w, nt, DUEL_PENDING, &challenger, &target, now)) {
+    return;
+  }
+  if (challenger != NULL) {
+    send_expired(challenger, target);
+    challenger->duel_status = DUEL_NONE;
+  }
+  if (target != NULL) {
+    send_expired(target, challenger);
+    target->duel_status = DUEL_NONE;
+  }
+  stats_add(STATS_CHALLENGES_EXPIRED, 1);
+  slab_free(&timer_slab, nt);
+}
+
+/************************************************************************
+ * A duel has gone on too long. Whoever made a choice wins by forfeit; if
+ * neither did, nobody wins.
+ */
+static void fire_duel(timer_wheel* w, timer* t, long long now) {
+  notif_timer* nt = (notif_timer*)t;
+  player_info *p1, *p2;
+  if (!duel_timer_players(w, nt, DUEL_ACTIVE, &p1, &p2, now)) return;
+  if (p1 == NULL || p2 == NULL) {  // the other one has left
+    player_info* p = (p1 != NULL) ? p1 : p2;
+    send_notice(p, "Your duel has timed out.");
+    p->choice = CHOICE_NONE;
+    p->duel_status = DUEL_NONE;
+  } else if (p1->choice != CHOICE_NONE && p2->choice != CHOICE_NONE) {
+    // Both chose just now, before the second CHOICE job got here
+    const char* winner = determine_winner(p1, p2);
+    finish_duel(p1, p2,
+                (winner == p1->name)   ? p1
+                : (winner == p2->name) ? p2
+                                       : NULL,
+                "");
+  } else if (p1->choice != CHOICE_NONE) {
+    finish_duel(p1, p2, p1, " by forfeit");
+  } else if (p2->choice != CHOICE_NONE) {
+    finish_duel(p1, p2, p2, " by forfeit");
+  } else {
+    finish_duel(p1, p2, NULL, ", time ran out");
+  }
+  stats_add(STATS_DUELS_TIMED_OUT, 1);
+  slab_free(&timer_slab, nt);
+}
 
-  pthread_exit(NULL);
+/************************************************************************
+ * Checks whether a player has sent anything within the idle timeout,
+ * and hangs up on them if not. Otherwise the timer is armed again for
+ * when they will have been quiet for that long.
+ */
+static void fire_idle(timer_wheel* w, timer* t, long long now) {
+  notif_timer* nt = (notif_timer*)t;
+  player_info* player = player_get(nt->player);
+  if (player == NULL) {
+    slab_free(&timer_slab, nt);
+    return;
+  }
+  long long last = __atomic_load_n(&player->conn->last_input, __ATOMIC_RELAXED);
+  if (now - last < idle_ms) {
+    timer_arm(w, t, last + idle_ms);
+    return;
+  }
+  send_err(player, "Idle for too long, disconnecting.");
+  conn_hangup(player->conn);
+  stats_add(STATS_IDLE_HANGUPS, 1);
+  slab_free(&timer_slab, nt);
+}
+
+/************************************************************************
+ * Starts watching a new connection's player for going idle. Safe to call
+ * from any thread. Does nothing if there is no idle timeout.
+ */
+void notif_watch_idle(player_info* player) {
+  if (idle_ms == 0) return;
+  notif_timer* nt = slab_alloc(&timer_slab);
+  nt->t.fire = fire_idle;
+  nt->player = player->self;
+  int q = player->self % queue_count();
+  if (timer_post(&wheels[q], &nt->t, timer_clock() + idle_ms)) queue_wake(q);
+}
+
+/************************************************************************
+ * Sets up the timer wheels of nworkers workers and the timeouts, in
+ * seconds (0 for none). Must be called after queue_init and before any
+ * worker or connection is started.
+ */
+void notif_init(int nworkers, long challenge_secs, long duel_secs,
+                long idle_secs) {
+  if ((wheels = malloc(nworkers * sizeof(timer_wheel))) == NULL) {
+    perror("malloc wheels");
+    exit(1);
+  }
+  long long now = timer_clock();
+  for (int i = 0; i < nworkers; i++) timer_wheel_init(&wheels[i], now);
+  slab_init(&timer_slab, sizeof(notif_timer));
+  for (int r = 0; r < NUM_ROOMS; r++) {
+    match_pool_init(&pools[r].pool, r);
+    pools[r].t.fire = fire_match;
+    pools[r].armed = 0;
+  }
+  challenge_ms = challenge_secs * 1000;
+  duel_ms = duel_secs * 1000;
+  idle_ms = idle_secs * 1000;
 }
 
 /****************************
- * Start up the notification manager. Assumes jobqueue has already been
- * initialized.
+ * Start up a notification manager worker, which serves the job queue whose
+ * index is passed in as arg. Assumes the job queues have already been
+ * initialized. Returns once the worker receives JOB_DONE.
  */
-void* notif_main(void*) {
-  notif_loop();
-  notif_destroy();
-  return NULL;  // so compiler doesn't complain. unreachable.
+void* notif_main(void* arg) {
+  notif_loop((int)(intptr_t)arg);
+  return NULL;
 }
\ No newline at end of file
@@ -3,6 +3,14 @@
 
 #include "queue.h"
 
+// Default timeouts, in seconds
+#define NOTIF_DEF_CHALLENGE_SECS 60  // for a challenge to be answered
+#define NOTIF_DEF_DUEL_SECS 60       // for both duelists to choose
+#define NOTIF_DEF_IDLE_SECS 900      // for a client to send anything
+
+void notif_init(int nworkers, long challenge_secs, long duel_secs,
+                long idle_secs);
+void notif_watch_idle(player_info* player);
 void *notif_main(void*);
 
 #endif // !NOTIF_MANAGER_H
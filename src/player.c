@@ -1,57 +1,196 @@
-// The player module contains the player data type and management functions
+// The player module contains the player data type and management functions,
+// and the pool all players live in.
+//
+// The pool is an array of slots, grown a chunk at a time and never shrunk,
+// so a slot's memory stays put for as long as the server runs and the
+// players sit next to each other rather than scattered over the heap.
+// Anything that refers to a player for longer than a command takes (a job
+// in a queue, a duel opponent) keeps a player_handle instead of a pointer,
+// and player_get turns it back into the player only while the slot still
+// holds the same generation, i.e. the same player.
+//
+// A freed slot is only reused once no thread can still be looking at the
+// player through a pointer it got earlier (see epoch.c), so code inside
+// a read section may keep using a player it found even if that player
+// disconnects in the meantime.
 
 #include "player.h"
 
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+
+#include "epoch.h"
+#include "match.h"
+
+typedef struct player_slot {
+  player_info player;
+  unsigned int gen;        // bumped whenever the slot is freed, never 0
+  unsigned int next_free;  // next slot on the free list, plus one
+} player_slot;
+
+static player_slot *chunks[PLAYER_POOL_MAXCHUNKS];
+static unsigned int nslots = 0;     // slots in the chunks so far
+static unsigned int free_head = 0;  // first free slot plus one, 0 if none
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static player_slot *pool_slot(unsigned int i) {
+  return &chunks[i / PLAYER_POOL_CHUNK][i % PLAYER_POOL_CHUNK];
+}
+
+/************************************************************************
+ * Adds a chunk of slots to the pool and puts them on the free list.
+ * Caller holds pool_lock.
+ */
+static void pool_grow() {
+  unsigned int c = nslots / PLAYER_POOL_CHUNK;
+  if (c == PLAYER_POOL_MAXCHUNKS) {
+    fprintf(stderr, "Player pool exhausted\n");
+    exit(1);
+  }
+  if ((chunks[c] = aligned_alloc(64, PLAYER_POOL_CHUNK *
+                                         sizeof(player_slot))) == NULL) {
+    perror("malloc player pool");
+    exit(1);
+  }
+  // Linked so the lowest slots get used first
+  for (unsigned int i = 0; i < PLAYER_POOL_CHUNK; i++) {
+    player_slot *s = &chunks[c][i];
+    s->gen = 1;
+    s->next_free = (i + 1 < PLAYER_POOL_CHUNK) ? nslots + i + 2 : free_head;
+  }
+  free_head = nslots + 1;
+  __atomic_store_n(&nslots, nslots + PLAYER_POOL_CHUNK, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * player_alloc takes a slot from the pool, and returns the (not yet
+ * initialized) player in it, with its handle in self.
+ */
+player_info *player_alloc() {
+  // Slots of players who left may be waiting for their readers to finish
+  if (__atomic_load_n(&free_head, __ATOMIC_RELAXED) == 0) epoch_reclaim();
+
+  pthread_mutex_lock(&pool_lock);
+  if (free_head == 0) pool_grow();
+  unsigned int i = free_head - 1;
+  player_slot *s = pool_slot(i);
+  free_head = s->next_free;
+  pthread_mutex_unlock(&pool_lock);
+
+  s->player.self = ((player_handle)s->gen << 32) | i;
+  return &s->player;
+}
+
+/* Puts a slot nobody can see anymore back on the free list */
+static void player_recycle(void *arg) {
+  player_slot *s = (player_slot *)arg;
+  unsigned int i = (unsigned int)s->player.self;
+  pthread_mutex_lock(&pool_lock);
+  s->next_free = free_head;
+  free_head = i + 1;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/************************************************************************
+ * player_free gives the player's slot back to the pool. Handles to the
+ * player stop resolving right away, but the slot is only reused once
+ * every read section that might have found the player has ended. The
+ * player must have been taken out of the playerlist and roomlist.
+ */
+void player_free(player_info *player) {
+  player_slot *s = pool_slot((unsigned int)player->self);
+  unsigned int gen = s->gen + 1;
+  __atomic_store_n(&s->gen, (gen == 0) ? 1 : gen, __ATOMIC_RELEASE);
+  epoch_retire(s, player_recycle);
+}
+
+/************************************************************************
+ * player_get returns the player the handle names, or NULL if that
+ * player has been freed (or the handle is PLAYER_NONE).
+ */
+player_info *player_get(player_handle handle) {
+  unsigned int i = (unsigned int)handle;
+  unsigned int gen = (unsigned int)(handle >> 32);
+  if (gen == 0 || i >= __atomic_load_n(&nslots, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  player_slot *s = pool_slot(i);
+  if (__atomic_load_n(&s->gen, __ATOMIC_ACQUIRE) != gen) return NULL;
+  return &s->player;
+}
 
 /************************************************************************
  * player_init initializes an player structure in the initial PLAYER_UNREG
- * state, with given send and receive FILE objects.
+ * state. The handle (self) is left alone, as it belongs to the pool.
  */
-void player_init(player_info *player, FILE *fp_send, FILE *fp_recv) {
+void player_init(player_info *player) {
   player->name[0] = '\0';
+  player->id = 0;
   player->state = PLAYER_UNREG;
   player->duel_status = DUEL_NONE;
-  player->choice = NULL;
-  player->opponent = NULL;
+  player->choice = CHOICE_NONE;
+  player->opponent = PLAYER_NONE;
+  player->duel_serial = 0;
+  player->wins = player->losses = player->draws = 0;
+  player->rating = MATCH_RATING_START;
+  player->queued = NULL;
   player->in_room = 0;
-  player->fp_send = fp_send;
-  player->fp_recv = fp_recv;
+  player->listed = 0;
+  player->conn = NULL;
 }
 
 /************************************************************************
- * new_player returns a pointer to fully initialized player with correct
- * read/write file handles and memory allocated to it.
+ * new_player returns a pointer to fully initialized player, in a slot
+ * taken from the pool. Its connection (see conn.c) owns the socket.
  */
-player_info *new_player(int comm_fd) {
-  /* Set up file descriptors for read/write */
-  int infd = dup(comm_fd);
-  FILE *player_in = NULL;
-  FILE *player_out = NULL;
-  player_in = fdopen(infd, "r");
-  player_out = fdopen(comm_fd, "w");
-  setvbuf(player_in, NULL, _IOLBF, 0);
-  setvbuf(player_out, NULL, _IOLBF, 0);
+player_info *new_player() {
+  player_info *player = player_alloc();
+  player_init(player);
+  return player;
+}
 
-  /* Set up player to handle and add to global playerlist */
-  player_info *player = NULL;
-  if ((player = malloc(sizeof(player_info))) == NULL) {
-    perror("player malloc");
+/************************************************************************
+ * player_destroy marks a player as done, so that it can be free'ed.
+ */
+void player_destroy(void *player) {
+  ((player_info *)player)->state = PLAYER_DONE;  // Just to make sure....
+}
+
+static player_array *player_array_alloc(int count) {
+  player_array *a =
+      malloc(sizeof(player_array) + count * sizeof(player_info *));
+  if (a == NULL) {
+    perror("malloc player_array");
     exit(1);
   }
-  player_init(player, player_out, player_in);
+  a->count = count;
+  return a;
+}
 
-  return player;
+/************************************************************************
+ * player_array_with returns a new array holding the players of a (which
+ * may be NULL, for none) followed by player.
+ */
+player_array *player_array_with(const player_array *a, player_info *player) {
+  int n = (a != NULL) ? a->count : 0;
+  player_array *copy = player_array_alloc(n + 1);
+  if (n > 0) memcpy(copy->players, a->players, n * sizeof(player_info *));
+  copy->players[n] = player;
+  return copy;
 }
 
 /************************************************************************
- * player_destroy frees up any resources associated with a player, like
- * file handles, so that it can be free'ed.
+ * player_array_without returns a new array holding the players of a
+ * except player, in the same order.
  */
-void player_destroy(void *player) {
-  ((player_info *)player)->state = PLAYER_DONE;  // Just to make sure....
-  fclose(((player_info *)player)->fp_send);
-  fclose(((player_info *)player)->fp_recv);
+player_array *player_array_without(const player_array *a,
+                                   player_info *player) {
+  int n = (a != NULL) ? a->count : 0;
+  player_array *copy = player_array_alloc(n);
+  int j = 0;
+  for (int i = 0; i < n; i++) {
+    if (a->players[i] != player) copy->players[j++] = a->players[i];
+  }
+  copy->count = j;
+  return copy;
 }
@@ -2,6 +2,7 @@
 #define _PLAYER_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 
 // The maximum length of a player name
@@ -21,25 +22,69 @@ typedef enum duel_status {
   DUEL_ACTIVE,
 } duel_status;
 
+// What a player picked in a duel, in the order each beats the one before
+typedef enum duel_choice {
+  CHOICE_NONE,
+  CHOICE_ROCK,
+  CHOICE_PAPER,
+  CHOICE_SCISSORS,
+} duel_choice;
+
+// Names a player by pool slot (low 32 bits) and generation (high 32
+// bits). The generation changes whenever the slot is freed, so a handle
+// kept after its player is gone resolves to NULL instead of to whoever
+// got the slot next. PLAYER_NONE never resolves to anybody.
+typedef uint64_t player_handle;
+#define PLAYER_NONE 0
+
+// Slots are added to the pool this many at a time
+#define PLAYER_POOL_CHUNK 1024
+// and there are at most this many chunks (so 4M players)
+#define PLAYER_POOL_MAXCHUNKS 4096
+
 // The struct to keep track of all information about a player in
 // the system.
 typedef struct player_info player_info; // forward declaration so it can have a pointer to itself
 
 struct player_info {
   char name[PLAYER_MAXNAME + 1];
+  unsigned int id;  // number naming the player in the binary protocol
+  player_handle self;  // this player's own handle, set by the pool
   player_state state;
   duel_status duel_status;
-  const char *choice; // Latest duel choice - meaningless if duel_status not DUEL_ACTIVE
-  player_info *opponent;  // pointer to challenger - meaningless if duel_status DUEL_NONE
+  duel_choice choice; // Latest duel choice - meaningless if duel_status not DUEL_ACTIVE
+  player_handle opponent;  // challenger or challenged - meaningless if duel_status DUEL_NONE
+  unsigned int duel_serial;  // counts the player's challenges, so old duel timeouts can tell
+  int wins, losses, draws;  // duels fought, kept across sessions (see records.c)
+  int rating;  // Elo rating, from the duels they fought
+  struct match_entry* queued;  // entry in a matchmaking pool, or NULL (see match.c)
   int in_room;
-  FILE *fp_send;
-  FILE *fp_recv;
+  int listed;  // in the roomlist (in room in_room)
+  struct conn *conn;  // connection all output to the player goes through
 }; 
 
+// A published, never changing list of players (see playerlist.c and
+// roomlist.c). Writers make a changed copy and swap it in; readers walk
+// the version they loaded, inside a read section.
+typedef struct player_array {
+  int count;
+  player_info* players[];
+} player_array;
+
 // Basic allocation/initializer and destructor functions
 
-void player_init(player_info* player, FILE* fp_send, FILE* fp_recv);
-player_info* new_player(int comm_fd);
+void player_init(player_info* player);
+player_info* new_player();
 void player_destroy(void* player);
 
+// The player pool
+player_info* player_alloc();
+void player_free(player_info* player);
+player_info* player_get(player_handle handle);
+
+// Copies of player arrays, with one player more or less
+player_array* player_array_with(const player_array* a, player_info* player);
+player_array* player_array_without(const player_array* a,
+                                   player_info* player);
+
 #endif  // _PLAYER_H
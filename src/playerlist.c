@@ -1,5 +1,13 @@
-// Module which manages the global playerlist structure. Uses underlying generic
-// alist struct.
+// Module which manages the global playerlist structure. Keeps all players in
+// a hash table for looking them up by id, plus the namehash index for
+// looking them up by name.
+//
+// None of the reads take a lock. Like the namehash, the id table is read
+// inside a read section (see epoch.c), removed players leave a marker
+// behind instead of moving anyone, and a table that grows is replaced as
+// a whole. Adding or removing a player touches one slot, so apart from the
+// odd rehash, connecting and disconnecting take no longer with many
+// players than with few.
 
 #include "playerlist.h"
 
@@ -8,102 +16,172 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "alist.h"
+#include "cluster.h"
+#include "epoch.h"
+#include "namehash.h"
 #include "player.h"
 
 playerlist* global_plist;
 
+#define ID_GONE ((player_info*)1)  // marks the slot of a removed player
+
+// Open addressing table of all players by id. Changed only under the
+// playerlist lock, read without it. Ids are handed out in sequence, so
+// the low bits make a fine hash.
+typedef struct {
+  size_t cap;  // a power of two
+  player_info* slots[];
+} id_table;
+
+static id_table* ids = NULL;
+static size_t nids = 0;   // players in the table
+static size_t nused = 0;  // slots holding a player or ID_GONE
+static unsigned int next_id = 0;
+
+/* Returns the player with the given id in table t, or NULL. Safe without
+ * the lock, inside a read section. */
+static player_info* id_lookup(id_table* t, unsigned int id) {
+  for (size_t i = id & (t->cap - 1);; i = (i + 1) & (t->cap - 1)) {
+    player_info* p = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+    if (p == NULL) return NULL;
+    if (p != ID_GONE && p->id == id) return p;
+  }
+}
+
+/* Puts the player in the first free slot for their id. Caller holds the
+ * playerlist lock and has made sure there is room. */
+static void id_place(id_table* t, player_info* player) {
+  size_t i = player->id & (t->cap - 1);
+  while (t->slots[i] != NULL && t->slots[i] != ID_GONE) {
+    i = (i + 1) & (t->cap - 1);
+  }
+  if (t->slots[i] == NULL) nused++;
+  __atomic_store_n(&t->slots[i], player, __ATOMIC_RELEASE);
+}
+
+/* Replaces the id table with one without removed slots, twice as big if
+ * more than a quarter of it would be players. Caller holds the playerlist
+ * lock. */
+static void id_rehash() {
+  id_table* old = ids;
+  size_t cap = (old == NULL) ? 64 : old->cap;
+  while (4 * (nids + 1) > cap) cap *= 2;
+  id_table* t = calloc(1, sizeof(id_table) + cap * sizeof(player_info*));
+  if (t == NULL) {
+    perror("malloc ids");
+    exit(1);
+  }
+  t->cap = cap;
+  nused = 0;
+  for (size_t i = 0; old != NULL && i < old->cap; i++) {
+    if (old->slots[i] != NULL && old->slots[i] != ID_GONE) {
+      id_place(t, old->slots[i]);
+    }
+  }
+  __atomic_store_n(&ids, t, __ATOMIC_RELEASE);
+  if (old != NULL) epoch_retire(old, free);
+}
+
+/* Gives the player an unused id and enters them in the id table. Caller
+ * holds the playerlist lock. */
+static void id_add(player_info* player) {
+  if (ids == NULL || 2 * (nused + 1) > ids->cap) id_rehash();
+
+  // The node number goes in the top bits, so ids are unique in a cluster
+  do {
+    next_id = (next_id + 1) & 0xffffff;
+    player->id = ((unsigned int)cluster_node << 24) | next_id;
+  } while (next_id == 0 || id_lookup(ids, player->id) != NULL);
+  id_place(ids, player);
+  nids++;
+}
+
+/* Takes the player out of the id table. Caller holds the playerlist
+ * lock. */
+static void id_remove(player_info* player) {
+  if (ids == NULL) return;
+  for (size_t i = player->id & (ids->cap - 1); ids->slots[i] != NULL;
+       i = (i + 1) & (ids->cap - 1)) {
+    if (ids->slots[i] == player) {
+      __atomic_store_n(&ids->slots[i], ID_GONE, __ATOMIC_RELEASE);
+      nids--;
+      return;
+    }
+  }
+}
+
 /* Initializes the list of players */
 void playerlist_init() {
   if ((global_plist = malloc(sizeof(playerlist))) == NULL) {
     perror("malloc global_list");
     exit(1);
   }
-  alist* parrlist = NULL;
-  if ((parrlist = malloc(sizeof(alist))) == NULL) {
-    perror("malloc parrlist");
-    exit(1);
-  }
-
-  alist_init(parrlist, player_destroy);
-  global_plist->parrlist = parrlist;
-
-  pthread_rwlock_init(&(global_plist->lock), NULL);
+  pthread_mutex_init(&(global_plist->lock), NULL);
+  namehash_init();
 }
 
 /* Returns the number of players in the list */
 int playerlist_getsize() {
-  int retval = 0;
-  pthread_rwlock_rdlock(&global_plist->lock);
-  retval = global_plist->parrlist->in_use;
-  pthread_rwlock_unlock(&global_plist->lock);
+  pthread_mutex_lock(&global_plist->lock);
+  int retval = nids;
+  pthread_mutex_unlock(&global_plist->lock);
   return retval;
 }
 
 /* Adds a player to the player list */
 void playerlist_addplayer(player_info* player) {
-  pthread_rwlock_wrlock(&global_plist->lock);
-  alist_add(global_plist->parrlist, player);
-  pthread_rwlock_unlock(&global_plist->lock);
+  pthread_mutex_lock(&global_plist->lock);
+  id_add(player);
+  pthread_mutex_unlock(&global_plist->lock);
 }
 
-/* Removes a player from the player list */
+/* Removes a player from the player list and marks them done.
+ * Players are matched by identity, not by name, since players that have
+ * not logged in all share the empty name. */
 void playerlist_removeplayer(player_info* player) {
-  player_info* curr = NULL;
-  pthread_rwlock_wrlock(&global_plist->lock);
-  for (size_t i = 0; i < global_plist->parrlist->in_use; i++) {
-    curr = (player_info*)alist_get(global_plist->parrlist, i);
-    if (!strcmp(curr->name, player->name)) {
-      alist_remove(global_plist->parrlist, i);
-    }
-  }
-  pthread_rwlock_unlock(&global_plist->lock);
+  namehash_remove(player);
+  pthread_mutex_lock(&global_plist->lock);
+  id_remove(player);
+  pthread_mutex_unlock(&global_plist->lock);
+  player_destroy(player);
 }
 
 /* Returns the corresponding player struct, given a name. Returns NULL if player
- * not found. */
+ * not found. The caller must be in a read section, see namehash_find. */
 player_info* playerlist_findplayer(char* name) {
-  player_info* curr = NULL;
-
-  pthread_rwlock_rdlock(&global_plist->lock);
-  for (size_t i = 0; i < global_plist->parrlist->in_use; i++) {
-    curr = (player_info*)alist_get(global_plist->parrlist, i);
-    if (!strcmp(curr->name, name)) {
-      pthread_rwlock_unlock(&global_plist->lock);
-      return curr;
-    }
-  }
-
-  pthread_rwlock_unlock(&global_plist->lock);
-  return NULL;
+  return namehash_find(name);
 }
 
-/* Return player at index i */
-player_info* playerlist_get(int i) {
-  player_info* retval = NULL;
-  pthread_rwlock_rdlock(&global_plist->lock);
-  retval = (player_info*)alist_get(global_plist->parrlist, i);
-  pthread_rwlock_unlock(&global_plist->lock);
+/* Returns the player with the given id, or NULL if there is none. Takes
+ * no lock. The caller must be in a read section (epoch_enter) for as long
+ * as it uses the player. */
+player_info* playerlist_findid(unsigned int id) {
+  epoch_enter();
+  id_table* t = __atomic_load_n(&ids, __ATOMIC_ACQUIRE);
+  player_info* retval = (t != NULL) ? id_lookup(t, id) : NULL;
+  epoch_exit();
   return retval;
 }
 
-/* Changes the name of the given player to given new name. Returns negative
- * value if name is already in use. */
+/* Changes the name of the (not yet named) given player to given new name.
+ * Returns negative value if name is already in use. Checking and claiming
+ * the name is one atomic step, so two players cannot both claim a name. */
 int playerlist_changeplayername(player_info* player, char* name) {
-  if (playerlist_findplayer(name) != NULL) {  // duplicate name found
-    return -1;
-  }
-  pthread_rwlock_wrlock(&global_plist->lock);
-  strcpy(player->name, name);
-  pthread_rwlock_unlock(&global_plist->lock);
-  return 0;
+  return namehash_reserve(player, name);
 }
 
 /* Frees all resources used by the given playerlist. Frees space allocated for
  * playerlist, so all operations on it afterwards are illegal! */
 void playerlist_destroy() {
-  alist_destroy(global_plist->parrlist);
-  free(global_plist->parrlist);
-  pthread_rwlock_destroy(&global_plist->lock);
+  for (size_t i = 0; ids != NULL && i < ids->cap; i++) {
+    if (ids->slots[i] != NULL && ids->slots[i] != ID_GONE) {
+      player_destroy(ids->slots[i]);
+    }
+  }
+  pthread_mutex_destroy(&global_plist->lock);
   free(global_plist);
+  free(ids);
+  ids = NULL;
+  nids = nused = 0;
+  namehash_destroy();
 }
\ No newline at end of file
@@ -4,12 +4,10 @@
 
 #include <pthread.h>
 
-#include "alist.h"
 #include "player.h"
 
 typedef struct {
-  alist* parrlist;
-  pthread_rwlock_t lock;
+  pthread_mutex_t lock;  // keeps writers apart, readers never take it
 } playerlist;
 
 void playerlist_init();
@@ -17,7 +15,7 @@ int playerlist_getsize();
 void playerlist_addplayer(player_info* player);
 void playerlist_removeplayer(player_info* player);
 player_info* playerlist_findplayer(char* name);
-player_info* playerlist_get(int i);
+player_info* playerlist_findid(unsigned int id);
 int playerlist_changeplayername(player_info* player, char* name);
 void playerlist_destroy();
 #endif
\ No newline at end of file
@@ -1,132 +1,377 @@
-/* Job queue for use by notification manager.
+/* Job queues for use by the notification manager workers.
  * Jobs on the queue contain a variety of info which is
  * discussed in the typedef for jobs, in queue.h.
+ *
+ * Every arena maps to exactly one queue (and so to one worker), which
+ * keeps the jobs for an arena in order while different arenas are
+ * handled in parallel.
+ *
+ * Each queue is the intrusive multi-producer/single-consumer queue
+ * described by Dmitry Vyukov: producers atomically swap themselves in
+ * as the new head and then link the old head to them, so enqueueing
+ * takes no lock and allocates nothing. The consumer only blocks (on an
+ * eventfd) once it has found the queue empty, and only the first
+ * producer to see it asleep pays for the write that wakes it up.
  */
+#define _GNU_SOURCE
 
 #include "queue.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
-queue* jobq;
+#include "slab.h"
+#include "stats.h"
+#include "trace.h"
 
-typedef struct node {
-  job* job;
-  struct node* next;
-} node;
+queue* jobqs;
+int njobqs;
+static slab job_slab;
+
+// Names of the job types, for statistics and traces
+const char* const job_names[NUM_JOB_TYPES] = {
+    "DONE",   "MSG",    "JOIN",   "LEAVE",     "CHALLENGE",
+    "ACCEPT", "REJECT", "CHOICE", "BROADCAST", "FIND",
+    "QUEUE",  "UNQUEUE",
+};
 
 /******************************************************************
- * Initialize a queue (it starts empty)
+ * Initialize nqueues queues (they start empty)
  */
-void queue_init() {
-  if ((jobq = malloc(sizeof(queue))) == NULL) {
+void queue_init(int nqueues) {
+  if ((jobqs = aligned_alloc(64, nqueues * sizeof(queue))) == NULL) {
     perror("malloc");
     exit(1);
   }
-  jobq->first = jobq->last = NULL;
-  pthread_mutex_init(&jobq->lock, NULL);
-  pthread_cond_init(&jobq->waiter, NULL);
+  slab_init(&job_slab, sizeof(job));
+  for (int i = 0; i < nqueues; i++) {
+    queue* jobq = &jobqs[i];
+    memset(jobq, 0, sizeof(queue));
+    jobq->stub.next = NULL;
+    jobq->head = jobq->tail = &jobq->stub;
+    jobq->sleeping = 0;
+    if ((jobq->event_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+      perror("eventfd");
+      exit(1);
+    }
+  }
+  njobqs = nqueues;
 }
 
 /******************************************************************
- * Add a new job to the queue
+ * Returns the number of queues.
  */
-void queue_enqueue(job* job) {
-  node* newnode = malloc(sizeof(node));
-  if ((newnode == NULL)) {
-    fprintf(stderr, "Out of memory! Exiting program.\n");
-    exit(1);
+int queue_count() { return njobqs; }
+
+/******************************************************************
+ * Returns the index of the queue that handles the given arena.
+ */
+int queue_of_room(int room) { return room % njobqs; }
+
+/******************************************************************
+ * Returns the queue a job belongs on. JOIN and LEAVE go to the queue
+ * of the arena they announce, everything else to the queue of the arena
+ * the issuing player is in.
+ */
+static queue* queue_route(job* job) {
+  int room = (job->type == JOB_JOIN || job->type == JOB_LEAVE)
+                 ? job->to.room
+                 : job->origin_room;
+  return &jobqs[queue_of_room(room)];
+}
+
+/******************************************************************
+ * Links a chain of jobs, first to last, already linked together through
+ * their next pointers, onto the head of the given queue. The whole chain
+ * goes in with one atomic exchange, so it arrives in one piece and in
+ * order. Lock-free, and safe to call from any number of threads at once.
+ */
+static void queue_link_chain(queue* jobq, job* first, job* last) {
+  __atomic_store_n(&last->next, NULL, __ATOMIC_RELAXED);
+  struct job* prev = __atomic_exchange_n(&jobq->head, last, __ATOMIC_SEQ_CST);
+  // Between the exchange and this store the consumer sees a gap in the
+  // list; it waits that out rather than mistaking it for the end.
+  __atomic_store_n(&prev->next, first, __ATOMIC_RELEASE);
+}
+
+static void queue_link(queue* jobq, job* job) {
+  queue_link_chain(jobq, job, job);
+}
+
+/******************************************************************
+ * Add a chain of jobs to the end of the given queue, waking the consumer
+ * up if it went to sleep.
+ */
+static void queue_push_chain(queue* jobq, job* first, job* last) {
+  queue_link_chain(jobq, first, last);
+
+  if (__atomic_load_n(&jobq->sleeping, __ATOMIC_SEQ_CST) &&
+      __atomic_exchange_n(&jobq->sleeping, 0, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    if (write(jobq->event_fd, &one, sizeof(one)) < 0) {
+      perror("write eventfd");
+    }
   }
+}
 
-  pthread_mutex_lock(&jobq->lock);
-  newnode->job = job;
-  newnode->next = NULL;
+static void queue_push(queue* jobq, job* job) {
+  queue_push_chain(jobq, job, job);
+}
 
-  if (jobq->first == NULL)
-    jobq->first = newnode;
-  else
-    jobq->last->next = newnode;
+/******************************************************************
+ * Takes the oldest job off the queue. Returns NULL if the queue is
+ * empty, or if a producer is halfway through linking in the next job.
+ * Only the consumer may call this.
+ */
+static job* queue_pop(queue* jobq) {
+  job* tail = jobq->tail;
+  job* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &jobq->stub) {  // skip over the stub
+    if (next == NULL) return NULL;
+    jobq->tail = tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+  if (next != NULL) {
+    jobq->tail = next;
+    return tail;
+  }
 
-  jobq->last = newnode;
-  pthread_cond_signal(&jobq->waiter);
-  pthread_mutex_unlock(&jobq->lock);
+  // tail is the last job. Put the stub back behind it so tail can be
+  // handed out without leaving the list empty.
+  if (tail != __atomic_load_n(&jobq->head, __ATOMIC_ACQUIRE)) return NULL;
+  queue_link(jobq, &jobq->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next != NULL) {
+    jobq->tail = next;
+    return tail;
+  }
+  return NULL;
 }
 
 /******************************************************************
- * Return the job at the front of the queue. Returns NULL if the
- * queue is empty.
+ * Returns true if jobs have been pushed that the consumer has not
+ * taken yet (including ones that are not fully linked in yet).
  */
-job* queue_front() {
-  if (jobq->first == NULL) {
-    return NULL;
+static int queue_has_work(queue* jobq) {
+  job* tail = jobq->tail;
+  return __atomic_load_n(&jobq->head, __ATOMIC_SEQ_CST) != tail ||
+         __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE) != NULL;
+}
+
+// Pushes a JOB_DONE, which has to reach every worker, so each of the
+// other queues gets its own copy. The copies are not counted as queued.
+static void queue_push_done(job* job) {
+  for (int i = 1; i < njobqs; i++) {
+    queue_push(&jobqs[i], newjob(JOB_DONE, NULL, NULL, NULL));
+  }
+  queue_push(&jobqs[0], job);
+}
+
+/******************************************************************
+ * Add a new job to the queue of the arena it concerns.
+ */
+void queue_enqueue(job* job) {
+  stats_add(STATS_JOBS_QUEUED, 1);
+  trace_stamp(&job->enqueued);
+  if (job->type == JOB_DONE) {
+    queue_push_done(job);
   } else {
-    return jobq->first->job;
+    queue_push(queue_route(job), job);
   }
 }
 
 /******************************************************************
- * Removes the front item from the queue. Waits for queue to have
- * an item if currently empty.
+ * Add n jobs at once. The jobs bound for each queue are chained
+ * together (keeping their order) and pushed with a single atomic
+ * exchange, so the worker finds them all at once and back to back,
+ * and is woken up at most once.
  */
-job* queue_dequeue_wait() {
-  pthread_mutex_lock(&jobq->lock);
-  while (jobq->first == NULL) {
-    pthread_cond_wait(&jobq->waiter, &jobq->lock);
+void queue_enqueue_batch(job** jobs, int n) {
+  stats_add(STATS_JOBS_QUEUED, n);
+  job* first[njobqs];
+  job* last[njobqs];
+  for (int i = 0; i < njobqs; i++) first[i] = last[i] = NULL;
+
+  for (int i = 0; i < n; i++) {
+    trace_stamp(&jobs[i]->enqueued);
+    if (jobs[i]->type == JOB_DONE) {
+      queue_push_done(jobs[i]);  // already counted and stamped
+      continue;
+    }
+    int q = queue_route(jobs[i]) - jobqs;
+    if (first[q] == NULL) {
+      first[q] = jobs[i];
+    } else {
+      last[q]->next = jobs[i];
+    }
+    last[q] = jobs[i];
   }
-  node* front = jobq->first;
-  job* retval = front->job;
-  jobq->first = jobq->first->next;
-  pthread_mutex_unlock(&jobq->lock);
 
-  free(front);
-  return retval;
+  for (int q = 0; q < njobqs; q++) {
+    if (first[q] != NULL) queue_push_chain(&jobqs[q], first[q], last[q]);
+  }
 }
 
 /******************************************************************
- * Destroy a queue - frees up all resources associated with the queue.
+ * Return the job at the front of queue q. Returns NULL if the
+ * queue is empty. Only the consumer of q may call this.
+ */
+job* queue_front(int q) {
+  queue* jobq = &jobqs[q];
+  job* front = jobq->tail;
+  if (front == &jobq->stub) {
+    front = __atomic_load_n(&front->next, __ATOMIC_ACQUIRE);
+  }
+  return front;
+}
+
+/******************************************************************
+ * Takes the oldest job off queue q, waiting for one if the queue is
+ * empty, for up to timeout_ms (-1 for no limit). Returns NULL if no job
+ * turned up by then, or if it was woken up by queue_wake instead.
+ */
+static job* queue_wait(int q, int timeout_ms) {
+  queue* jobq = &jobqs[q];
+  int woken = 0;
+  while (1) {
+    job* job = queue_pop(jobq);
+    if (job != NULL) return job;
+
+    if (queue_has_work(jobq)) {  // a producer is mid-push, let it finish
+      sched_yield();
+      continue;
+    }
+    if (woken) return NULL;
+
+    // Announce that we are going to sleep, then look once more so a
+    // producer cannot slip a job in between our check and the sleep.
+    __atomic_store_n(&jobq->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (queue_has_work(jobq)) {
+      __atomic_store_n(&jobq->sleeping, 0, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    woken = 1;
+    struct pollfd pfd = {.fd = jobq->event_fd, .events = POLLIN};
+    if (timeout_ms >= 0 && poll(&pfd, 1, timeout_ms) <= 0) {
+      // Timed out (or interrupted by a signal)
+      __atomic_store_n(&jobq->sleeping, 0, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    uint64_t count;
+    if (read(jobq->event_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+      perror("read eventfd");
+      exit(1);
+    }
+    __atomic_store_n(&jobq->sleeping, 0, __ATOMIC_SEQ_CST);
+  }
+}
+
+/******************************************************************
+ * Removes the front item from queue q. Waits for queue to have
+ * an item if currently empty.
+ */
+job* queue_dequeue_wait(int q) {
+  job* job;
+  while ((job = queue_wait(q, -1)) == NULL) continue;
+  return job;
+}
+
+/******************************************************************
+ * Takes up to max jobs off queue q and stores them in jobs, oldest
+ * first. Waits for at least one job if the queue is empty, but never
+ * for more, and for no longer than timeout_ms (-1 for no limit) or
+ * until queue_wake is called. Returns the number of jobs taken, which
+ * is 0 only if it stopped waiting for one of those reasons. Only the
+ * consumer of q may call this.
+ */
+int queue_dequeue_batch(int q, job** jobs, int max, int timeout_ms) {
+  queue* jobq = &jobqs[q];
+  int n = 0;
+  if ((jobs[n] = queue_wait(q, timeout_ms)) == NULL) return 0;
+  n++;
+  while (n < max && (jobs[n] = queue_pop(jobq)) != NULL) n++;
+  return n;
+}
+
+/******************************************************************
+ * Wakes the consumer of queue q up, if it is waiting in
+ * queue_dequeue_batch, even though there is no new job. If it is not
+ * waiting right now, its next wait returns straight away instead.
+ */
+void queue_wake(int q) {
+  uint64_t one = 1;
+  if (write(jobqs[q].event_fd, &one, sizeof(one)) < 0) {
+    perror("write eventfd");
+  }
+}
+
+/******************************************************************
+ * Destroy the queues - frees up all resources associated with them.
  */
 void queue_destroy() {
-  while (jobq->first != NULL) {
-    node* curr = jobq->first;
-    jobq->first = curr->next;
-    destroyjob(curr->job);
-    free(curr);
+  for (int i = 0; i < njobqs; i++) {
+    queue* jobq = &jobqs[i];
+    job* job;
+    while ((job = queue_pop(jobq)) != NULL) {
+      destroyjob(job);
+    }
+    close(jobq->event_fd);
   }
-  free(jobq);
+  free(jobqs);
 }
 
 /************************************************************************
  * Create a new job struct, fully allocated and initialized with desired
- * values. See struct definition for more info on fields.
+ * values. See struct definition for more info on fields. Returns NULL
+ * if the target name is too long to be a player's name (callers check
+ * that first), rather than aim the job at whoever has a prefix of it.
  */
 job* newjob(job_type type, void* to, char* content, player_info* origin) {
-  job* new_job = NULL;
-  if ((new_job = malloc(sizeof(job))) == NULL) {
-    perror("malloc job");
-    exit(1);
+  if ((type == JOB_MSG || type == JOB_CHALLENGE || type == JOB_FIND) &&
+      strlen((char*)to) > PLAYER_MAXNAME) {
+    return NULL;
   }
+  job* new_job = slab_alloc(&job_slab);
 
   new_job->type = type;
 
   if (type == JOB_MSG || type == JOB_CHALLENGE || type == JOB_FIND) {
-    new_job->to.player_name = (char*)to;
+    // The name may live in a buffer that is reused before the job runs
+    strcpy(new_job->to_name, (char*)to);
+    new_job->to.player_name = new_job->to_name;
   } else if (type == JOB_JOIN || type == JOB_LEAVE) {
     new_job->to.room = *(int*)to;
   }
 
   if (content != NULL) {
-    new_job->content = malloc(strlen(content) + 1);
-    if (new_job->content == NULL) {
+    size_t len = strlen(content);
+    if (len <= MAX_MSG_LEN) {
+      new_job->content = new_job->inline_content;
+    } else if ((new_job->content = malloc(len + 1)) == NULL) {
       perror("malloc jobcontent");
       exit(1);
     }
-    strcpy(new_job->content, content);
+    memcpy(new_job->content, content, len + 1);
   } else {
     new_job->content = NULL;
   }
 
-  new_job->origin = origin;
+  new_job->origin = (origin != NULL) ? origin->self : PLAYER_NONE;
+  new_job->origin_id = (origin != NULL) ? origin->id : 0;
+  new_job->origin_room = (origin != NULL) ? origin->in_room : 0;
+  new_job->next = NULL;
+  // Jobs that no command caused (say, a player hanging up) arrive now
+  new_job->arrived = (trace_on && trace_arrival == 0) ? stats_now()
+                                                      : trace_arrival;
 
   return new_job;
 }
@@ -135,8 +380,8 @@ job* newjob(job_type type, void* to, char* content, player_info* origin) {
  * Frees all necessary fields of this job and the job itself.
  */
 void destroyjob(job* job) {
-  if (job->content != NULL) {
+  if (job->content != NULL && job->content != job->inline_content) {
     free(job->content);
   }
-  free(job);
+  slab_free(&job_slab, job);
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <pthread.h>
 
+#include "arena_protocol.h"
 #include "player.h"
 #include "util.h"
 
@@ -17,25 +18,34 @@ typedef enum job_type {
   JOB_CHOICE,
   JOB_BROADCAST,
   JOB_FIND,
+  JOB_QUEUE,
+  JOB_UNQUEUE,
+  NUM_JOB_TYPES,
 } job_type;
 
-// Data types and function prototypes for a queue of jobs structure
-
-// Typedef for queue, featuring blocking condition variable and lock
-typedef struct queue {
-  pthread_mutex_t lock;
-  pthread_cond_t waiter;
-  struct node* first;
-  struct node* last;
-} queue;
+// Data types and function prototypes for a queue of jobs structure. There
+// is one queue per notification manager worker, and each job is routed
+// to a queue by the arena it concerns.
 
 /************************************************************************
  * Typedef for jobs, for the notification manager.
  * type: job_type.
  * to: if MSG, playername of recipient. if JOIN/LEAVE, room number that
  * should receive this notification. if challenge, playername of the target.
- * content: if MSG, content of message to be sent.
- * origin: for all types, playername who issued this job.
+ * to_name holds a copy of the player name.
+ * content: if MSG, content of message to be sent. Points at inline_content
+ * unless the content is too long to fit there.
+ * origin: for all types, handle of the player who issued this job. The
+ * player may be gone by the time the job is handled, in which case
+ * player_get(origin) returns NULL.
+ * origin_id: the id of origin, still good after origin has gone away.
+ * origin_room: the arena origin was in when the job was created.
+ * arrived, enqueued, dequeued: when the command that caused the job
+ * arrived, and when the job was queued and taken off the queue again,
+ * kept only while tracing (see trace.c).
+ *
+ * Jobs come from a slab (see slab.c), so creating and destroying one
+ * normally does not touch malloc at all.
  */
 typedef struct job {
   job_type type;
@@ -44,13 +54,42 @@ typedef struct job {
     int room;
   } to;
   char* content;
-  player_info* origin;
+  player_handle origin;
+  unsigned int origin_id;
+  int origin_room;
+  long long arrived, enqueued, dequeued;
+  struct job* next;  // link in the job queue
+  char to_name[PLAYER_MAXNAME + 1];
+  char inline_content[MAX_MSG_LEN + 1];
 } job;
 
-void queue_init();
+/************************************************************************
+ * Typedef for queue: a lock-free multi-producer/single-consumer list of
+ * jobs, linked through the jobs themselves. Producers push onto head,
+ * the consumer pops from tail. The consumer sleeps on event_fd when
+ * the queue is empty; "sleeping" tells producers they need to wake it.
+ */
+typedef struct queue {
+  job* head;  // most recently pushed job, swapped in by producers
+  char pad1[64 - sizeof(job*)];
+  job* tail;  // next job to pop, only touched by the consumer
+  job stub;   // placeholder node that keeps the list from ever being empty
+  int event_fd;
+  int sleeping;
+  char pad2[64];
+} __attribute__((aligned(64))) queue;  // whole cache lines, for aligned_alloc
+
+extern const char* const job_names[NUM_JOB_TYPES];
+
+void queue_init(int nqueues);
+int queue_count();
+int queue_of_room(int room);
 void queue_enqueue(job* job);
-job* queue_front();
-job* queue_dequeue_wait();
+void queue_enqueue_batch(job** jobs, int n);
+job* queue_front(int q);
+job* queue_dequeue_wait(int q);
+int queue_dequeue_batch(int q, job** jobs, int max, int timeout_ms);
+void queue_wake(int q);
 void queue_destroy();
 
 job* newjob(job_type type, void* to, char* content, player_info* origin);
@@ -0,0 +1,142 @@
+/* Benchmark for the job queue. A number of producer threads enqueue
+ * jobs as fast as they can while a single consumer (standing in for a
+ * notification manager worker) dequeues them. Reports the enqueue
+ * throughput for a range of producer counts, up to 64, first one job at
+ * a time and then using the batch calls on both ends.
+ *
+ * Usage: queue_bench [jobs_per_producer]
+ */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "player.h"
+#include "queue.h"
+
+#define DEF_JOBS_PER_PRODUCER 100000
+#define BENCH_BATCH 16    // jobs per queue_enqueue_batch call
+#define BENCH_DEQUEUE 64  // most jobs per queue_dequeue_batch call
+
+static long jobs_per_producer = DEF_JOBS_PER_PRODUCER;
+static player_info* origin;  // all jobs claim to come from this player
+static pthread_barrier_t start_line;
+
+typedef struct producer {
+  pthread_t thread;
+  job* jobs;
+  job** ptrs;  // pointers to jobs, for queue_enqueue_batch
+  int batch;   // jobs per enqueue, 1 for plain queue_enqueue
+} producer;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/************************************************************************
+ * Enqueues all of a producer's (preallocated) jobs, so that only the
+ * queue itself is being measured.
+ */
+static void* produce(void* arg) {
+  producer* p = (producer*)arg;
+  pthread_barrier_wait(&start_line);
+  if (p->batch == 1) {
+    for (long i = 0; i < jobs_per_producer; i++) {
+      queue_enqueue(&p->jobs[i]);
+    }
+  } else {
+    for (long i = 0; i < jobs_per_producer; i += p->batch) {
+      long n = jobs_per_producer - i;
+      queue_enqueue_batch(&p->ptrs[i], n < p->batch ? n : p->batch);
+    }
+  }
+  return NULL;
+}
+
+/************************************************************************
+ * Runs one round with nproducers producers, each enqueueing batch jobs
+ * at a time, and prints the results.
+ */
+static void run(int nproducers, int batch) {
+  producer* producers = calloc(nproducers, sizeof(producer));
+  if (producers == NULL) {
+    perror("malloc producers");
+    exit(1);
+  }
+  for (int i = 0; i < nproducers; i++) {
+    producers[i].jobs = calloc(jobs_per_producer, sizeof(job));
+    producers[i].ptrs = calloc(jobs_per_producer, sizeof(job*));
+    if (producers[i].jobs == NULL || producers[i].ptrs == NULL) {
+      perror("malloc jobs");
+      exit(1);
+    }
+    producers[i].batch = batch;
+    for (long j = 0; j < jobs_per_producer; j++) {
+      producers[i].jobs[j].type = JOB_MSG;
+      producers[i].jobs[j].origin = origin->self;
+      producers[i].ptrs[j] = &producers[i].jobs[j];
+    }
+  }
+
+  pthread_barrier_init(&start_line, NULL, nproducers + 1);
+  for (int i = 0; i < nproducers; i++) {
+    pthread_create(&producers[i].thread, NULL, &produce, &producers[i]);
+  }
+
+  long total = jobs_per_producer * nproducers;
+  pthread_barrier_wait(&start_line);
+  double start = now();
+  if (batch == 1) {
+    for (long i = 0; i < total; i++) {
+      queue_dequeue_wait(0);
+    }
+  } else {
+    job* jobs[BENCH_DEQUEUE];
+    for (long i = 0; i < total;) {
+      i += queue_dequeue_batch(0, jobs, BENCH_DEQUEUE, -1);
+    }
+  }
+  double elapsed = now() - start;
+
+  for (int i = 0; i < nproducers; i++) {
+    pthread_join(producers[i].thread, NULL);
+    free(producers[i].jobs);
+    free(producers[i].ptrs);
+  }
+  pthread_barrier_destroy(&start_line);
+  free(producers);
+
+  printf("%6d %9d %12ld %10.3f %12.2f %10.1f\n", batch, nproducers, total,
+         elapsed, total / elapsed / 1e6, elapsed * 1e9 / total);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1) {
+    jobs_per_producer = strtol(argv[1], NULL, 10);
+    if (jobs_per_producer <= 0) {
+      fprintf(stderr, "Usage: %s [jobs_per_producer]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  origin = player_alloc();
+  player_init(origin);
+  queue_init(1);
+
+  printf("%6s %9s %12s %10s %12s %10s\n", "batch", "producers", "jobs",
+         "seconds", "Mjobs/s", "ns/job");
+  int counts[] = {1, 2, 4, 8, 16, 32, 64};
+  int batches[] = {1, BENCH_BATCH};
+  for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+      run(counts[i], batches[b]);
+    }
+  }
+
+  queue_destroy();
+  return 0;
+}
@@ -0,0 +1,148 @@
+/* Edge-triggered epoll reactor. Instead of a thread per player, a small
+ * fixed set of reactor threads each own an epoll instance and the client
+ * sockets assigned to it. Sockets are read without blocking straight
+ * into the connection's receive ring, and the conn module runs complete
+ * lines through docommand on the reactor thread.
+ *
+ * A connection is only ever watched by one reactor, so all reads and
+ * the final cleanup of a connection happen on a single thread. Sockets
+ * are also watched for EPOLLOUT: being edge-triggered it only fires
+ * once the send buffer frees up after filling, which is exactly when
+ * backed-up output can be flushed.
+ */
+#define _GNU_SOURCE
+
+#include "reactor.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cluster.h"
+#include "conn.h"
+
+#define REACTOR_MAXEVENTS 256
+
+typedef struct reactor {
+  int epoll_fd;
+  pthread_t thread;
+} reactor;
+
+static reactor* reactors = NULL;
+static int nreactors = 0;
+static unsigned int next_reactor = 0;
+
+/************************************************************************
+ * Reads everything currently available on the connection. Since the
+ * socket is registered edge-triggered we have to keep reading until the
+ * kernel says it would block. Returns -1 if the connection is finished.
+ */
+static int reactor_read(conn* c) {
+  while (1) {
+    char* buf;
+    size_t space = conn_recv_space(c, &buf);
+    ssize_t n = recv(c->fd, buf, space, MSG_DONTWAIT);
+    if (n > 0) {
+      if (conn_received(c, n) < 0) return -1;
+    } else if (n == 0) {
+      return -1;  // client disconnected
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    } else {
+      return -1;
+    }
+  }
+}
+
+/************************************************************************
+ * Code run by each reactor thread. Waits for activity on any of its
+ * connections and services them.
+ */
+static void* reactor_main(void* arg) {
+  reactor* r = (reactor*)arg;
+  struct epoll_event events[REACTOR_MAXEVENTS];
+
+  while (1) {
+    int n = epoll_wait(r->epoll_fd, events, REACTOR_MAXEVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+
+    for (int i = 0; i < n; i++) {
+      conn* c = (conn*)events[i].data.ptr;
+      int closing = 0;
+      if (events[i].events & EPOLLOUT) {
+        conn_flush(c);
+      }
+      if (events[i].events & EPOLLIN) {
+        closing = (reactor_read(c) < 0);
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+        // Drain whatever is left, then drop the connection
+        if (!closing) reactor_read(c);
+        closing = 1;
+      }
+      if (closing) {
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        if (c->move_to >= 0) {
+          cluster_handoff(c);  // moving to an arena on another node
+        } else {
+          conn_close(c);
+        }
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/************************************************************************
+ * Starts nthreads reactor threads. Returns 0 on success, -1 on error.
+ */
+int reactor_init(int nthreads) {
+  if ((reactors = calloc(nthreads, sizeof(reactor))) == NULL) {
+    perror("malloc reactors");
+    exit(1);
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    if ((reactors[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      perror("epoll_create1");
+      return -1;
+    }
+    if (pthread_create(&reactors[i].thread, NULL, &reactor_main,
+                       &reactors[i]) != 0) {
+      perror("pthread_create reactor");
+      return -1;
+    }
+    pthread_detach(reactors[i].thread);
+    nreactors++;
+  }
+  return 0;
+}
+
+/************************************************************************
+ * Hands a connection over to one of the reactors. Connections are spread
+ * over the reactors round-robin. Safe to call from any number of threads
+ * at once.
+ */
+void reactor_adopt(conn* c) {
+  unsigned int next = __atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED);
+  reactor* r = &reactors[next % nreactors];
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+    perror("epoll_ctl add");
+    conn_close(c);
+  }
+}
@@ -0,0 +1,10 @@
+// Function prototypes for the epoll reactor I/O engine
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include "conn.h"
+
+int reactor_init(int nthreads);
+void reactor_adopt(conn* c);
+
+#endif  // _REACTOR_H
@@ -0,0 +1,539 @@
+/* The store of every player's duel record (wins, losses, draws and
+ * rating), kept across restarts in two memory-mapped files.
+ *
+ * The record file holds an open addressing hash table of records, keyed
+ * by name. Duels do not touch it. Each result is appended to the log
+ * file instead, a ring of entries that hold both players' records as
+ * they were after the duel: a writer takes the next position with one
+ * atomic add, copies the records in and marks the entry written. That
+ * is all plain memory, so recording a result makes no system call, and
+ * once it is in the mapping it survives the server crashing.
+ *
+ * A compactor thread folds the log into the table every
+ * RECORD_COMPACT_MS (or sooner if the log is filling up), in order, and
+ * then moves the applied position on to free up the ring. Entries hold
+ * whole records rather than changes, so applying one twice does no
+ * harm, and a crash between updating the table and moving applied on is
+ * nothing to worry about. Should the ring fill up anyway, the writer
+ * compacts it itself.
+ *
+ * Starting up is just mapping the files and applying what is left in
+ * the log, so it takes milliseconds however many players are on record.
+ * Players are looked up when they log in: in the table, and in the part
+ * of the log that is not in it yet.
+ *
+ * All nodes of a cluster may share the files. Each holds a shared lock
+ * on the record file while it runs; the first to start (the only one
+ * able to get an exclusive lock) sets the files up, or repairs what a
+ * crashed run left behind.
+ *
+ * Every player with a record is also ranked by rating on a ladder (see
+ * ladder.c), the global leaderboard, which each result moves the two
+ * duelists on as it is recorded. With a store the ladder is built from
+ * the table at startup, and in a cluster the background thread keeps
+ * following the log, so the results of the other nodes get ranked too.
+ * Entries are ranked by their place in the log, so a result that shows
+ * up there after a newer one of the same player was ranked is ignored.
+ */
+#define _GNU_SOURCE
+
+#include "records.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ladder.h"
+#include "match.h"
+
+#define RECORD_POLL_MS 100    // how often the compactor checks on the log
+#define RECORD_STALL_MS 5000  // how long an entry may stay half written
+
+static record_table* table = NULL;
+static record_log* results = NULL;
+static size_t table_size, results_size;
+static int table_fd = -1;  // kept open for the lock on it
+static int compacting = 0;  // this process compacts the log
+static int following = 0;   // and this one follows it for the ranking
+static pthread_t record_thread;
+static volatile int stopping = 0;
+
+static ladder ranking;  // everybody on record, by rating
+static pthread_mutex_t ranking_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ranking_once = PTHREAD_ONCE_INIT;
+static uint64_t followed = 0;  // log entries ranked so far, when following
+
+static void ranking_setup() { ladder_init(&ranking); }
+
+/* FNV-1a hash of a name */
+static uint32_t record_hash(const char* name) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* Locks the table, repairing the lock if its last owner died holding it.
+ * The table is never left half-updated, so it is still good. */
+static void record_lock() {
+  if (pthread_mutex_lock(&table->lock) == EOWNERDEAD) {
+    pthread_mutex_consistent(&table->lock);
+  }
+}
+
+/* Returns the slot of the player called name, or the free slot they
+ * would go in (NULL if the table is full). Caller holds the lock. */
+static record* record_find(const char* name) {
+  uint32_t hash = record_hash(name);
+  for (uint32_t n = 0; n < table->nslots; n++) {
+    record* r = &table->slots[(hash + n) & (table->nslots - 1)];
+    if (!r->used || strcmp(r->name, name) == 0) return r;
+  }
+  return NULL;
+}
+
+/************************************************************************
+ * Copies a record from the log into the table. Players past the point
+ * where the table is three quarters full are not recorded. Caller holds
+ * the lock.
+ */
+static void record_apply(const record* from) {
+  record* r = record_find(from->name);
+  if (r == NULL) return;
+  if (!r->used) {
+    if (table->count >= table->nslots / 4 * 3) return;
+    table->count++;
+  }
+  *r = *from;
+  r->used = 1;
+}
+
+/************************************************************************
+ * Folds the written entries of the log into the table, in order, and
+ * frees their places in the ring. Stops at an entry that is not written
+ * yet, unless skip_at says it has waited long enough: then it is skipped
+ * (its writer must have died). Returns the position it stopped at.
+ */
+static uint64_t record_compact(uint64_t skip_at) {
+  record_lock();
+  uint64_t pos = results->applied;
+  uint64_t tail = __atomic_load_n(&results->tail, __ATOMIC_ACQUIRE);
+  for (; pos < tail; pos++) {
+    record_entry* e = &results->entries[pos % results->nslots];
+    if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+      if (pos != skip_at) break;
+      continue;
+    }
+    record_apply(&e->players[0]);
+    record_apply(&e->players[1]);
+  }
+  __atomic_store_n(&results->applied, pos, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&table->lock);
+  return pos;
+}
+
+/************************************************************************
+ * Ranks everybody on record afresh: the players in the table, then the
+ * results in the log ahead of it, in order.
+ */
+static void record_rank_all() {
+  record_lock();
+  ladder_row* rows = malloc((table->count + 1) * sizeof(ladder_row));
+  if (rows == NULL) {
+    perror("malloc ranking");
+    exit(1);
+  }
+  size_t n = 0;
+  for (uint32_t i = 0; i < table->nslots && n < table->count; i++) {
+    record* r = &table->slots[i];
+    if (!r->used) continue;
+    memcpy(rows[n].name, r->name, sizeof(rows[n].name));
+    rows[n].rating = r->rating;
+    n++;
+  }
+
+  pthread_mutex_lock(&ranking_lock);
+  ladder_destroy(&ranking);
+  ladder_init(&ranking);
+  ladder_build(&ranking, rows, n);
+  // The log ahead of the table cannot be overwritten while we hold the
+  // lock. Following goes on from the first entry not written yet.
+  uint64_t tail = __atomic_load_n(&results->tail, __ATOMIC_ACQUIRE);
+  followed = tail;
+  for (uint64_t pos = results->applied; pos < tail; pos++) {
+    record_entry* e = &results->entries[pos % results->nslots];
+    if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+      if (followed == tail) followed = pos;
+      continue;
+    }
+    for (int i = 0; i < 2; i++) {
+      ladder_set(&ranking, e->players[i].name, e->players[i].rating, pos + 1);
+    }
+  }
+  pthread_mutex_unlock(&ranking_lock);
+  pthread_mutex_unlock(&table->lock);
+  free(rows);
+}
+
+/************************************************************************
+ * Ranks the results logged since the last call, which in a cluster
+ * includes those of the other nodes, up to the first entry that is not
+ * written yet. If the ring came round over entries before they were
+ * ranked, everybody is ranked afresh.
+ */
+static void record_follow() {
+  uint64_t tail = __atomic_load_n(&results->tail, __ATOMIC_ACQUIRE);
+  int lapped = 0;
+  pthread_mutex_lock(&ranking_lock);
+  for (; followed < tail; followed++) {
+    if (tail - followed > results->nslots) {
+      lapped = 1;
+      break;
+    }
+    record_entry* e = &results->entries[followed % results->nslots];
+    if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != followed + 1) {
+      if (__atomic_load_n(&results->tail, __ATOMIC_ACQUIRE) >
+          followed + results->nslots) {
+        lapped = 1;
+        break;
+      }
+      // The compactor gives up on an entry whose writer died
+      if (followed < __atomic_load_n(&results->applied, __ATOMIC_ACQUIRE)) {
+        continue;
+      }
+      break;
+    }
+    record_entry copy = *e;
+    // Nobody may start overwriting the entry before claiming the place
+    // one ring further on, so if that has not happened yet the copy is
+    // whole
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&results->tail, __ATOMIC_RELAXED) >
+        followed + results->nslots) {
+      lapped = 1;
+      break;
+    }
+    for (int i = 0; i < 2; i++) {
+      ladder_set(&ranking, copy.players[i].name, copy.players[i].rating,
+                 followed + 1);
+    }
+  }
+  pthread_mutex_unlock(&ranking_lock);
+  if (lapped) record_rank_all();
+}
+
+static void* record_main(void* arg) {
+  long waited = 0;  // ms since the last compaction
+  uint64_t stuck = UINT64_MAX;  // unwritten entry the last one stopped at
+  long stuck_ms = 0;
+  while (!stopping) {
+    usleep(RECORD_POLL_MS * 1000);
+    if (following) record_follow();
+    if (!compacting) continue;
+    waited += RECORD_POLL_MS;
+    uint64_t tail = __atomic_load_n(&results->tail, __ATOMIC_ACQUIRE);
+    uint64_t applied = __atomic_load_n(&results->applied, __ATOMIC_RELAXED);
+    if (tail == applied) continue;
+    if (waited < RECORD_COMPACT_MS && tail - applied < results->nslots / 2) {
+      continue;
+    }
+
+    // An entry nobody finished writing in all that time had a writer
+    // that died (with another node of the cluster)
+    uint64_t pos =
+        record_compact(stuck_ms >= RECORD_STALL_MS ? stuck : UINT64_MAX);
+    // Write the table back before the log forgets what went into it
+    msync(table, table_size, MS_SYNC);
+    msync(results, results_size, MS_ASYNC);
+    if (pos < tail && pos == stuck) {
+      stuck_ms += waited;
+    } else {
+      stuck = (pos < tail) ? pos : UINT64_MAX;
+      stuck_ms = 0;
+    }
+    waited = 0;
+  }
+  return NULL;
+}
+
+/************************************************************************
+ * Maps size bytes of the file fd. Returns NULL on error.
+ */
+static void* record_map(int fd, size_t size, const char* what) {
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "mmap %s: %s\n", what, strerror(errno));
+    return NULL;
+  }
+  return p;
+}
+
+/************************************************************************
+ * Opens (creating it if need be) and maps a file of the store, which
+ * must be size bytes long or empty. Returns NULL on error.
+ */
+static void* record_open(const char* path, size_t size, int* fdp) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (st.st_size != 0 && st.st_size != size)) {
+    fprintf(stderr,
+            "%s is not an arena record file (or is from an incompatible "
+            "version)\n",
+            path);
+    close(fd);
+    return NULL;
+  }
+  // Sparse, so only the parts in use take up space
+  if (st.st_size == 0 && ftruncate(fd, size) < 0) {
+    fprintf(stderr, "ftruncate %s: %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  if (fdp != NULL) *fdp = fd;
+  void* p = record_map(fd, size, path);
+  if (fdp == NULL) close(fd);
+  return p;
+}
+
+/************************************************************************
+ * Sets up the mapped files, if they are new, or checks them and repairs
+ * what a crash left behind, if not. Only done by the first node to
+ * start, while it holds the exclusive lock.
+ */
+static int record_setup(const char* path) {
+  if (table->magic == 0) {
+    table->nslots = RECORD_SLOTS;
+    table->count = 0;
+    results->magic = RECORD_LOG_MAGIC;
+    results->nslots = RECORD_LOG_SLOTS;
+    results->tail = results->applied = 0;
+  } else if (table->magic != RECORD_MAGIC ||
+             table->nslots != RECORD_SLOTS ||
+             results->magic != RECORD_LOG_MAGIC ||
+             results->nslots != RECORD_LOG_SLOTS) {
+    fprintf(stderr, "%s is not an arena record file (or is from an "
+            "incompatible version)\n", path);
+    return -1;
+  }
+
+  // Nobody else is running, so the lock may have been left held by a
+  // run that never got to release it
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&table->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  // Whatever was half written when the last run stopped is lost
+  uint64_t tail = results->tail;
+  while (record_compact(results->applied) < tail) {
+  }
+  msync(table, table_size, MS_SYNC);
+  __atomic_store_n(&table->magic, RECORD_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/************************************************************************
+ * Opens the record store at path (the log goes next to it, with .log
+ * added), creating it if it does not exist, and ranks everybody on
+ * record. If compactor is set, starts the thread that compacts the log;
+ * in a cluster only one node should. If follow is set, the thread also
+ * ranks the results other processes log; in a cluster every node
+ * should. Returns 0 on success, -1 on error.
+ */
+int record_init(const char* path, int compactor, int follow) {
+  char log_path[PATH_MAX];
+  snprintf(log_path, sizeof(log_path), "%s.log", path);
+  table_size = sizeof(record_table) + RECORD_SLOTS * sizeof(record);
+  results_size = sizeof(record_log) + RECORD_LOG_SLOTS * sizeof(record_entry);
+
+  if ((table = record_open(path, table_size, &table_fd)) == NULL) return -1;
+  if ((results = record_open(log_path, results_size, NULL)) == NULL) {
+    return -1;
+  }
+
+  // Whoever gets the exclusive lock is first, and sets things up
+  if (flock(table_fd, LOCK_EX | LOCK_NB) == 0) {
+    if (record_setup(path) < 0) return -1;
+    flock(table_fd, LOCK_SH);
+  } else if (flock(table_fd, LOCK_SH) < 0) {
+    perror("flock records");
+    return -1;
+  }
+  if (__atomic_load_n(&table->magic, __ATOMIC_ACQUIRE) != RECORD_MAGIC) {
+    fprintf(stderr, "%s was not set up\n", path);
+    return -1;
+  }
+
+  pthread_once(&ranking_once, ranking_setup);
+  record_rank_all();
+
+  compacting = compactor;
+  following = follow;
+  stopping = 0;
+  if (compacting || following) {
+    if (pthread_create(&record_thread, NULL, &record_main, NULL) != 0) {
+      perror("pthread_create records");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/************************************************************************
+ * Fills in a player's record (by their name) from the store, or with
+ * that of a new player if they have none.
+ */
+void record_lookup(player_info* player) {
+  player->wins = player->losses = player->draws = 0;
+  player->rating = MATCH_RATING_START;
+  if (table == NULL) return;
+
+  const record* found = NULL;
+  record_lock();
+  record* r = record_find(player->name);
+  if (r != NULL && r->used) found = r;
+
+  // The log ahead of the table cannot be overwritten while we hold the
+  // lock, as applied cannot move
+  uint64_t tail = __atomic_load_n(&results->tail, __ATOMIC_ACQUIRE);
+  for (uint64_t pos = results->applied; pos < tail; pos++) {
+    record_entry* e = &results->entries[pos % results->nslots];
+    if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != pos + 1) continue;
+    for (int i = 0; i < 2; i++) {
+      if (strcmp(e->players[i].name, player->name) == 0) {
+        found = &e->players[i];
+      }
+    }
+  }
+  if (found != NULL) {
+    player->wins = found->wins;
+    player->losses = found->losses;
+    player->draws = found->draws;
+    player->rating = found->rating;
+  }
+  pthread_mutex_unlock(&table->lock);
+}
+
+// Copies a player's record into a log entry
+static void record_fill(record* r, const player_info* player) {
+  memcpy(r->name, player->name, sizeof(r->name));
+  r->used = 1;
+  r->wins = player->wins;
+  r->losses = player->losses;
+  r->draws = player->draws;
+  r->rating = player->rating;
+}
+
+/************************************************************************
+ * Appends both players' records to the log. Returns the entry's place.
+ */
+static uint64_t record_log_result(player_info* p1, player_info* p2) {
+  // Claimed before anything is written, see record_follow
+  uint64_t pos = __atomic_fetch_add(&results->tail, 1, __ATOMIC_ACQUIRE);
+  while (pos - __atomic_load_n(&results->applied, __ATOMIC_ACQUIRE) >=
+         results->nslots) {
+    record_compact(UINT64_MAX);  // the ring is full
+  }
+  record_entry* e = &results->entries[pos % results->nslots];
+  record_fill(&e->players[0], p1);
+  record_fill(&e->players[1], p2);
+  __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+  return pos;
+}
+
+/************************************************************************
+ * Counts a duel between p1 and p2, which winner won (NULL for a draw),
+ * in their records, logs the result if there is a store, and moves both
+ * on the ranking.
+ */
+void record_result(player_info* p1, player_info* p2, player_info* winner) {
+  if (winner == NULL) {
+    p1->draws++;
+    p2->draws++;
+  } else {
+    player_info* loser = (winner == p1) ? p2 : p1;
+    winner->wins++;
+    loser->losses++;
+  }
+  uint64_t stamp = (results != NULL) ? record_log_result(p1, p2) + 1 : 0;
+
+  pthread_once(&ranking_once, ranking_setup);
+  pthread_mutex_lock(&ranking_lock);
+  ladder_set(&ranking, p1->name, p1->rating, stamp);
+  ladder_set(&ranking, p2->name, p2->rating, stamp);
+  pthread_mutex_unlock(&ranking_lock);
+}
+
+/************************************************************************
+ * Returns the rank of the player called name among everybody on record
+ * (1 for the best), and stores their rating in *rating and the number of
+ * players ranked in *ranked. Returns 0 if they have no record.
+ */
+unsigned int record_rank(const char* name, int* rating, unsigned int* ranked) {
+  pthread_once(&ranking_once, ranking_setup);
+  pthread_mutex_lock(&ranking_lock);
+  unsigned int rank = ladder_rank(&ranking, name, rating);
+  *ranked = ranking.count;
+  pthread_mutex_unlock(&ranking_lock);
+  return rank;
+}
+
+/************************************************************************
+ * Fills in rows with the n best players on record, and stores the
+ * number of players ranked in *ranked. Returns how many rows it filled.
+ */
+int record_top(int n, ladder_row* rows, unsigned int* ranked) {
+  pthread_once(&ranking_once, ranking_setup);
+  pthread_mutex_lock(&ranking_lock);
+  n = ladder_top(&ranking, n, rows);
+  *ranked = ranking.count;
+  pthread_mutex_unlock(&ranking_lock);
+  return n;
+}
+
+/************************************************************************
+ * Tells how many players are on record, and how many results wait in
+ * the log. Both are 0 without a store.
+ */
+void record_counts(unsigned long* players, unsigned long* backlog) {
+  *players = *backlog = 0;
+  if (table == NULL) return;
+  *players = __atomic_load_n(&table->count, __ATOMIC_RELAXED);
+  *backlog = __atomic_load_n(&results->tail, __ATOMIC_RELAXED) -
+             __atomic_load_n(&results->applied, __ATOMIC_RELAXED);
+}
+
+/************************************************************************
+ * Stops the compactor, folds in what is left of the log and writes the
+ * store back, if there is one. The notifiers must have stopped.
+ */
+void record_shutdown() {
+  if (table == NULL) return;
+  if (compacting || following) {
+    stopping = 1;
+    pthread_join(record_thread, NULL);
+  }
+  if (compacting) record_compact(UINT64_MAX);
+  msync(table, table_size, MS_SYNC);
+  msync(results, results_size, MS_SYNC);
+  munmap(table, table_size);
+  munmap(results, results_size);
+  close(table_fd);
+  table = NULL;
+  results = NULL;
+}
@@ -0,0 +1,61 @@
+// Data types and function prototypes for the store of players' duel records
+#ifndef _RECORDS_H
+#define _RECORDS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ladder.h"
+#include "player.h"
+
+#define RECORD_MAGIC 0x61726e72      // "arnr", bump when the layout changes
+#define RECORD_LOG_MAGIC 0x61726e6c  // "arnl"
+#define RECORD_SLOTS (1 << 21)       // players the store can hold (a power of two)
+#define RECORD_LOG_SLOTS (1 << 16)   // results waiting to be compacted
+#define RECORD_COMPACT_MS 1000       // how often the log is compacted
+
+// A player's duel record
+typedef struct record {
+  char name[PLAYER_MAXNAME + 1];
+  int8_t used;  // 0 never used, 1 holds a player
+  int32_t wins, losses, draws;
+  int32_t rating;
+} record;
+
+// Layout of the record file: an open addressing hash table of records,
+// keyed by name
+typedef struct record_table {
+  uint32_t magic;  // set last, once everything else is initialized
+  uint32_t nslots;
+  uint32_t count;        // players on record
+  pthread_mutex_t lock;  // process-shared and robust, held to change the table
+  record slots[];
+} record_table;
+
+// One duel result: both players' records as they were after it
+typedef struct record_entry {
+  uint64_t seq;  // position in the log plus one, once written
+  record players[2];
+} record_entry;
+
+// Layout of the log file: a ring of the results not yet in the table
+typedef struct record_log {
+  uint32_t magic;
+  uint32_t nslots;
+  char pad1[56];
+  uint64_t tail;  // results ever logged, moved by every writer
+  char pad2[56];
+  uint64_t applied;  // results in the table, moved under the table's lock
+  char pad3[56];
+  record_entry entries[];
+} record_log;
+
+int record_init(const char* path, int compactor, int follow);
+void record_lookup(player_info* player);
+void record_result(player_info* p1, player_info* p2, player_info* winner);
+unsigned int record_rank(const char* name, int* rating, unsigned int* ranked);
+int record_top(int n, ladder_row* rows, unsigned int* ranked);
+void record_counts(unsigned long* players, unsigned long* backlog);
+void record_shutdown();
+
+#endif  // _RECORDS_H
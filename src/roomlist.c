@@ -0,0 +1,172 @@
+// Module which keeps track of which logged in players are in each room, so
+// that sending something to everyone in a room only has to look at the
+// players actually in it instead of the whole global playerlist.
+//
+// Each room's members are a copy on write player_array, like the
+// playerlist's: joining or leaving a room publishes a new version and
+// retires the old one (see epoch.c). Walking a room is then one atomic
+// load and a plain loop over a version nobody changes, so the notifiers
+// never wait for a player who is moving, and never skip a member or see
+// one twice because the array shifted under them.
+//
+// A player's in_room is only changed while holding the lock of the
+// room(s) involved. A move adds the player to the new room before taking
+// them out of the old one, so a walker can briefly see a mover in both
+// rooms, but never in neither.
+//
+// Each room also ranks its members by rating on a ladder (see ladder.c),
+// the arena's leaderboard. It changes with the members, under the same
+// lock, and when a member's rating does (see roomlist_rerank).
+
+#include "roomlist.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena_protocol.h"
+#include "epoch.h"
+
+static room rooms[NUM_ROOMS];
+
+/* Initializes the (empty) rooms */
+void roomlist_init() {
+  for (int i = 0; i < NUM_ROOMS; i++) {
+    rooms[i].members = player_array_without(NULL, NULL);  // empty
+    rooms[i].nmembers = 0;
+    ladder_init(&rooms[i].ladder);
+    pthread_mutex_init(&rooms[i].lock, NULL);
+  }
+}
+
+/* Swaps in a new version of room r's members and retires the old one.
+ * Caller holds r's lock. */
+static void room_publish(room* r, player_array* members) {
+  player_array* old = r->members;
+  __atomic_store_n(&r->members, members, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->nmembers, members->count, __ATOMIC_RELAXED);
+  epoch_retire(old, free);
+}
+
+/* Appends player to room r. Caller holds r's lock. */
+static void room_insert(room* r, player_info* player) {
+  room_publish(r, player_array_with(r->members, player));
+  ladder_set(&r->ladder, player->name, player->rating, 0);
+}
+
+/* Takes player out of room r. Caller holds r's lock. */
+static void room_delete(room* r, player_info* player) {
+  room_publish(r, player_array_without(r->members, player));
+  ladder_remove(&r->ladder, player->name);
+}
+
+/* Adds a player who is not in any room yet to room roomnum */
+void roomlist_add(player_info* player, int roomnum) {
+  room* r = &rooms[roomnum];
+  pthread_mutex_lock(&r->lock);
+  player->in_room = roomnum;
+  player->listed = 1;
+  room_insert(r, player);
+  pthread_mutex_unlock(&r->lock);
+}
+
+/* Moves a player from the room they are in to room newroom. Both rooms are
+ * locked (lowest number first) for the move. */
+void roomlist_move(player_info* player, int newroom) {
+  int oldroom = player->in_room;
+  room* first = &rooms[oldroom < newroom ? oldroom : newroom];
+  room* second = &rooms[oldroom < newroom ? newroom : oldroom];
+
+  pthread_mutex_lock(&first->lock);
+  pthread_mutex_lock(&second->lock);
+  room_insert(&rooms[newroom], player);
+  player->in_room = newroom;
+  room_delete(&rooms[oldroom], player);
+  pthread_mutex_unlock(&second->lock);
+  pthread_mutex_unlock(&first->lock);
+}
+
+/* Removes a player from whatever room they are in. Does nothing if the
+ * player is not in the index. */
+void roomlist_remove(player_info* player) {
+  if (!player->listed) return;
+  room* r = &rooms[player->in_room];
+  pthread_mutex_lock(&r->lock);
+  room_delete(r, player);
+  player->listed = 0;
+  pthread_mutex_unlock(&r->lock);
+}
+
+/* Moves a player on the ladder of their room after their rating
+ * changed. Does nothing if the player is not in the index. */
+void roomlist_rerank(player_info* player) {
+  for (;;) {
+    int roomnum = __atomic_load_n(&player->in_room, __ATOMIC_RELAXED);
+    room* r = &rooms[roomnum];
+    pthread_mutex_lock(&r->lock);
+    // They may have moved on before we got the lock
+    if (player->in_room == roomnum) {
+      if (player->listed) {
+        ladder_set(&r->ladder, player->name, player->rating, 0);
+      }
+      pthread_mutex_unlock(&r->lock);
+      return;
+    }
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+/* Returns the rank of the player called name among the members of room
+ * roomnum (1 for the best, 0 if they are not in it), and stores their
+ * rating in *rating and the number of members in *ranked. */
+unsigned int roomlist_rank(int roomnum, const char* name, int* rating,
+                           unsigned int* ranked) {
+  room* r = &rooms[roomnum];
+  pthread_mutex_lock(&r->lock);
+  unsigned int rank = ladder_rank(&r->ladder, name, rating);
+  *ranked = r->ladder.count;
+  pthread_mutex_unlock(&r->lock);
+  return rank;
+}
+
+/* Fills in rows with the n best rated members of room roomnum, and
+ * stores the number of members in *ranked. Returns how many rows it
+ * filled. */
+int roomlist_top(int roomnum, int n, ladder_row* rows, unsigned int* ranked) {
+  room* r = &rooms[roomnum];
+  pthread_mutex_lock(&r->lock);
+  n = ladder_top(&r->ladder, n, rows);
+  *ranked = r->ladder.count;
+  pthread_mutex_unlock(&r->lock);
+  return n;
+}
+
+/* Calls fn(player, arg) for every player in room roomnum, as the room was
+ * when the call started. Takes no lock, so fn may do anything, including
+ * moving players between rooms. */
+void roomlist_foreach(int roomnum, void (*fn)(player_info* player, void* arg),
+                      void* arg) {
+  epoch_enter();
+  player_array* members =
+      __atomic_load_n(&rooms[roomnum].members, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < members->count; i++) {
+    fn(members->players[i], arg);
+  }
+  epoch_exit();
+}
+
+/* Returns the number of players in room roomnum */
+int roomlist_count(int roomnum) {
+  return __atomic_load_n(&rooms[roomnum].nmembers, __ATOMIC_RELAXED);
+}
+
+/* Frees all resources used by the rooms. The players themselves belong to
+ * the playerlist. */
+void roomlist_destroy() {
+  for (int i = 0; i < NUM_ROOMS; i++) {
+    free(rooms[i].members);
+    rooms[i].members = NULL;
+    rooms[i].nmembers = 0;
+    ladder_destroy(&rooms[i].ladder);
+    pthread_mutex_destroy(&rooms[i].lock);
+  }
+}
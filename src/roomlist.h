@@ -0,0 +1,31 @@
+// Function prototypes and typedefs for the per-room membership index
+#ifndef _ROOMLIST_H
+#define _ROOMLIST_H
+
+#include <pthread.h>
+
+#include "ladder.h"
+#include "player.h"
+
+// The logged in players currently in one room
+typedef struct {
+  player_array* members;  // current version, in order of arrival
+  int nmembers;
+  ladder ladder;  // the members by rating, only used under the lock
+  pthread_mutex_t lock;  // keeps writers apart, readers never take it
+} room;
+
+void roomlist_init();
+void roomlist_add(player_info* player, int roomnum);
+void roomlist_move(player_info* player, int newroom);
+void roomlist_remove(player_info* player);
+void roomlist_rerank(player_info* player);
+unsigned int roomlist_rank(int roomnum, const char* name, int* rating,
+                           unsigned int* ranked);
+int roomlist_top(int roomnum, int n, ladder_row* rows, unsigned int* ranked);
+void roomlist_foreach(int roomnum, void (*fn)(player_info* player, void* arg),
+                      void* arg);
+int roomlist_count(int roomnum);
+void roomlist_destroy();
+
+#endif  // _ROOMLIST_H
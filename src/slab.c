@@ -0,0 +1,160 @@
+/* A simple slab allocator for small objects that are allocated on one
+ * thread and freed on another (like jobs, which are made by the player
+ * threads and freed by the notification manager).
+ *
+ * Every thread keeps its own cache of free objects, so allocating and
+ * freeing is normally just a list push or pop. When a thread's cache
+ * runs dry it takes a batch of SLAB_BATCH objects from the shared depot,
+ * and when it holds too many it gives a batch back, so the depot lock
+ * is only taken once per batch. Memory is only requested from malloc
+ * when the depot is empty too, and is never given back: once the
+ * server has warmed up, objects just circulate between the threads.
+ */
+
+#include "slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// A thread's private cache for one slab
+typedef struct slab_cache {
+  slab_obj* free;
+  int nfree;
+} slab_cache;
+
+static slab* slabs[SLAB_MAX];
+static int nslabs = 0;
+static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread slab_cache caches[SLAB_MAX];
+static __thread int cache_registered = 0;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+/************************************************************************
+ * Gives a chain of nobjs free objects to the depot as one batch.
+ */
+static void slab_depot_put(slab* s, slab_obj* first, int nobjs) {
+  first->nobjs = nobjs;
+  pthread_mutex_lock(&s->lock);
+  first->next_batch = s->depot;
+  s->depot = first;
+  pthread_mutex_unlock(&s->lock);
+}
+
+/************************************************************************
+ * Runs when a thread that used a slab exits, and hands everything in
+ * its caches back to the depots so no objects get stranded.
+ */
+static void slab_thread_exit(void* unused) {
+  for (int i = 0; i < nslabs; i++) {
+    slab_cache* cache = &caches[i];
+    if (cache->nfree > 0) {
+      slab_depot_put(slabs[i], cache->free, cache->nfree);
+      cache->free = NULL;
+      cache->nfree = 0;
+    }
+  }
+}
+
+static void slab_make_key() {
+  if (pthread_key_create(&cache_key, slab_thread_exit) != 0) {
+    perror("pthread_key_create slab");
+    exit(1);
+  }
+}
+
+/************************************************************************
+ * Initializes a slab for objects of objsize bytes.
+ */
+void slab_init(slab* s, size_t objsize) {
+  if (objsize < sizeof(slab_obj)) objsize = sizeof(slab_obj);
+  s->objsize = (objsize + 15) & ~(size_t)15;  // keep objects 16-byte aligned
+  s->depot = NULL;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_once(&cache_key_once, slab_make_key);
+
+  pthread_mutex_lock(&slabs_lock);
+  if (nslabs == SLAB_MAX) {
+    fprintf(stderr, "Too many slabs (max %d)\n", SLAB_MAX);
+    exit(1);
+  }
+  s->id = nslabs;
+  slabs[nslabs++] = s;
+  pthread_mutex_unlock(&slabs_lock);
+}
+
+/************************************************************************
+ * Refills an empty thread cache, from the depot if it has a batch, or
+ * else with a freshly allocated one.
+ */
+static void slab_refill(slab* s, slab_cache* cache) {
+  if (!cache_registered) {  // so slab_thread_exit runs for this thread
+    pthread_setspecific(cache_key, caches);
+    cache_registered = 1;
+  }
+
+  pthread_mutex_lock(&s->lock);
+  slab_obj* batch = s->depot;
+  if (batch != NULL) s->depot = batch->next_batch;
+  pthread_mutex_unlock(&s->lock);
+
+  if (batch != NULL) {
+    cache->free = batch;
+    cache->nfree = batch->nobjs;
+    return;
+  }
+
+  char* chunk = malloc(SLAB_BATCH * s->objsize);
+  if (chunk == NULL) {
+    perror("malloc slab");
+    exit(1);
+  }
+  for (int i = 0; i < SLAB_BATCH; i++) {
+    slab_obj* obj = (slab_obj*)(chunk + i * s->objsize);
+    obj->next = (i + 1 < SLAB_BATCH)
+                    ? (slab_obj*)(chunk + (i + 1) * s->objsize)
+                    : NULL;
+  }
+  cache->free = (slab_obj*)chunk;
+  cache->nfree = SLAB_BATCH;
+}
+
+/************************************************************************
+ * Returns an uninitialized object from the slab.
+ */
+void* slab_alloc(slab* s) {
+  slab_cache* cache = &caches[s->id];
+  if (cache->nfree == 0) slab_refill(s, cache);
+
+  slab_obj* obj = cache->free;
+  cache->free = obj->next;
+  cache->nfree--;
+  return obj;
+}
+
+/************************************************************************
+ * Returns an object to the slab. It does not have to be freed by the
+ * thread that allocated it.
+ */
+void slab_free(slab* s, void* ptr) {
+  slab_cache* cache = &caches[s->id];
+  slab_obj* obj = (slab_obj*)ptr;
+  obj->next = cache->free;
+  cache->free = obj;
+  cache->nfree++;
+
+  if (cache->nfree == 2 * SLAB_BATCH) {
+    // Keep one batch for ourselves and pass the other one on
+    slab_obj* last = cache->free;
+    for (int i = 1; i < SLAB_BATCH; i++) last = last->next;
+    slab_obj* batch = last->next;
+    last->next = NULL;
+    cache->nfree = SLAB_BATCH;
+    if (!cache_registered) {
+      pthread_setspecific(cache_key, caches);
+      cache_registered = 1;
+    }
+    slab_depot_put(s, batch, SLAB_BATCH);
+  }
+}
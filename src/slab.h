@@ -0,0 +1,30 @@
+// Data types and function prototypes for the slab allocator
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define SLAB_BATCH 64  // objects moved between a thread and the depot at once
+#define SLAB_MAX 8     // most slabs a program can create
+
+// Header laid over a free object
+typedef struct slab_obj {
+  struct slab_obj* next;        // next free object in the same batch/cache
+  struct slab_obj* next_batch;  // next batch in the depot (first object only)
+  int nobjs;                    // objects in this batch (first object only)
+} slab_obj;
+
+// A pool of equally sized objects
+typedef struct slab {
+  size_t objsize;
+  int id;
+  pthread_mutex_t lock;  // protects depot
+  slab_obj* depot;       // batches of free objects shared by all threads
+} slab;
+
+void slab_init(slab* s, size_t objsize);
+void* slab_alloc(slab* s);
+void slab_free(slab* s, void* obj);
+
+#endif  // _SLAB_H
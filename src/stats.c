@@ -0,0 +1,123 @@
+/* Server statistics. Every thread that counts something gets its own
+ * stats_block the first time it does, so updating a counter is just a
+ * store to memory no other thread writes, and neither docommand nor the
+ * notifier loop ever waits on a lock or a contended cache line for it.
+ * Collecting the statistics means adding up the blocks of all threads,
+ * which is only done when somebody asks for them (see admin.c).
+ *
+ * The blocks are kept on a list that only grows. When a thread exits its
+ * block is marked free and the next new thread takes it over, counts
+ * and all, so with the thread per player engine the number of blocks
+ * is the most threads that were ever alive at once.
+ */
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+__thread stats_block* stats_self = NULL;
+
+static stats_block* blocks = NULL;  // never shrinks, so readers need no lock
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+
+/************************************************************************
+ * Runs when a thread that has a block exits, and frees it up for the
+ * next thread.
+ */
+static void stats_thread_exit(void* arg) {
+  stats_block* b = (stats_block*)arg;
+  b->notifier = -1;
+  pthread_mutex_lock(&blocks_lock);
+  b->in_use = 0;
+  pthread_mutex_unlock(&blocks_lock);
+}
+
+static void stats_make_key() {
+  if (pthread_key_create(&block_key, stats_thread_exit) != 0) {
+    perror("pthread_key_create stats");
+    exit(1);
+  }
+}
+
+/************************************************************************
+ * Gives the calling thread a block of its own, either one left behind
+ * by a thread that exited or a new one.
+ */
+stats_block* stats_register() {
+  pthread_once(&block_key_once, stats_make_key);
+
+  pthread_mutex_lock(&blocks_lock);
+  stats_block* b = blocks;
+  while (b != NULL && b->in_use) b = b->next;
+  if (b == NULL) {
+    if ((b = calloc(1, sizeof(stats_block))) == NULL) {
+      perror("malloc stats_block");
+      exit(1);
+    }
+    b->notifier = -1;
+    b->next = blocks;
+    __atomic_store_n(&blocks, b, __ATOMIC_RELEASE);
+  }
+  b->in_use = 1;
+  pthread_mutex_unlock(&blocks_lock);
+
+  pthread_setspecific(block_key, b);
+  return b;
+}
+
+/************************************************************************
+ * Marks the calling thread as the notification manager worker for queue
+ * q, so its busy time can be told apart from the other workers'.
+ */
+void stats_set_notifier(int q) { stats_mine()->notifier = q; }
+
+static unsigned long stats_load(unsigned long* counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static stats_block* stats_first() {
+  return __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+}
+
+/* Returns the total of one counter over all threads */
+unsigned long stats_sum(stats_counter counter) {
+  unsigned long total = 0;
+  for (stats_block* b = stats_first(); b != NULL; b = b->next) {
+    total += stats_load(&b->counters[counter]);
+  }
+  return total;
+}
+
+/* Returns how many jobs of the given type have been handled */
+unsigned long stats_sum_jobs(job_type type) {
+  unsigned long total = 0;
+  for (stats_block* b = stats_first(); b != NULL; b = b->next) {
+    total += stats_load(&b->jobs[type]);
+  }
+  return total;
+}
+
+/* Adds up the latency histogram of one command over all threads */
+void stats_sum_latency(command_id cmd, unsigned long buckets[STATS_BUCKETS]) {
+  for (int i = 0; i < STATS_BUCKETS; i++) buckets[i] = 0;
+  for (stats_block* b = stats_first(); b != NULL; b = b->next) {
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+      buckets[i] += stats_load(&b->latency[cmd][i]);
+    }
+  }
+}
+
+/* Returns the nanoseconds the worker for queue q has spent handling jobs */
+unsigned long stats_notifier_busy(int q) {
+  unsigned long total = 0;
+  for (stats_block* b = stats_first(); b != NULL; b = b->next) {
+    if (__atomic_load_n(&b->notifier, __ATOMIC_RELAXED) == q) {
+      total += stats_load(&b->counters[STATS_NOTIF_BUSY_NS]);
+    }
+  }
+  return total;
+}
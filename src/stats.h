@@ -0,0 +1,87 @@
+// Data types and function prototypes for the server statistics
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <time.h>
+
+#include "arena_protocol.h"
+#include "queue.h"
+
+// Command latency buckets: bucket 0 is under 1 microsecond, and bucket b
+// under 2^b microseconds. The last one takes everything slower.
+#define STATS_BUCKETS 24
+
+// Plain counters kept by every thread
+typedef enum stats_counter {
+  STATS_ACCEPTS,  // by the acceptors or the uring engine
+  STATS_ACCEPT_ERRORS,
+  STATS_CONNS_OPENED,
+  STATS_CONNS_CLOSED,
+  STATS_BYTES_IN,
+  STATS_BYTES_OUT,
+  STATS_JOBS_QUEUED,
+  STATS_JOBS_DONE,
+  STATS_NOTIF_BUSY_NS,
+  STATS_CHALLENGES_EXPIRED,
+  STATS_DUELS_TIMED_OUT,
+  STATS_IDLE_HANGUPS,
+  STATS_MATCHES,
+  STATS_NCOUNTERS,
+} stats_counter;
+
+// One thread's statistics. Only the owning thread writes them (with
+// plain relaxed stores, so no locked instructions are involved), and
+// readers add up the blocks of all threads. A block outlives its thread
+// and is handed to the next new thread, so nothing is ever lost.
+typedef struct stats_block {
+  unsigned long counters[STATS_NCOUNTERS];
+  unsigned long jobs[NUM_JOB_TYPES];  // jobs handled, by type
+  unsigned long latency[NUM_COMMANDS][STATS_BUCKETS];
+  int notifier;  // queue of the notification manager worker, or -1
+  int in_use;    // owned by a live thread
+  struct stats_block* next;
+} stats_block;
+
+extern __thread stats_block* stats_self;
+
+stats_block* stats_register();
+void stats_set_notifier(int q);
+unsigned long stats_sum(stats_counter counter);
+unsigned long stats_sum_jobs(job_type type);
+void stats_sum_latency(command_id cmd, unsigned long buckets[STATS_BUCKETS]);
+unsigned long stats_notifier_busy(int q);
+
+static inline long long stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline stats_block* stats_mine() {
+  if (stats_self == NULL) stats_self = stats_register();
+  return stats_self;
+}
+
+static inline void stats_bump(unsigned long* counter, unsigned long n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// Adds n to one of the calling thread's counters
+static inline void stats_add(stats_counter counter, unsigned long n) {
+  stats_bump(&stats_mine()->counters[counter], n);
+}
+
+// Counts a job of the given type handled by the calling thread
+static inline void stats_job(job_type type) {
+  stats_bump(&stats_mine()->jobs[type], 1);
+}
+
+// Records that a command took ns nanoseconds
+static inline void stats_command(command_id cmd, long long ns) {
+  unsigned long long us = (ns > 0) ? ns / 1000 : 0;
+  int b = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+  if (b >= STATS_BUCKETS) b = STATS_BUCKETS - 1;
+  stats_bump(&stats_mine()->latency[cmd][b], 1);
+}
+
+#endif  // _STATS_H
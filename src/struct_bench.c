@@ -0,0 +1,537 @@
+/* Microbenchmarks for the data structures behind the player bookkeeping:
+ * the generic alist, the job queue, the timer wheel, the matchmaking
+ * pools, the record store, the leaderboards and the global playerlist.
+ * Each measurement is printed as one CSV line (after a header), so
+ * results can be compared across changes with a script:
+ *
+ *   benchmark,size,threads,ops,ns_per_op
+ *
+ * - alist_add/alist_get/alist_remove: filling a list of size items,
+ *   reading every item by index, and removing items at random indexes
+ *   until the list is empty (which, being quadratic, is only done once)
+ * - queue_enqueue: jobs enqueued by threads producers and taken off by
+ *   one consumer with queue_dequeue_wait (size is unused)
+ * - timer_arm/timer_fire: arming size timers at random deadlines within
+ *   the next hour, and moving the clock on from one expiry to the next
+ *   until all of them have fired
+ * - match_add/match_pair: queueing size players with ratings spread
+ *   around the start rating, and running match passes MATCH_INTERVAL_MS
+ *   apart until all of them are paired (per pair made)
+ * - record_result/record_load/record_lookup: logging duel results
+ *   between size players in a record store in a scratch directory,
+ *   opening the store again (per player on record, with a full log to
+ *   fold in), and looking players up
+ * - ladder_build/ladder_set/ladder_move/ladder_rank/ladder_top: ranking
+ *   size players at once from an array (per player), one by one, moving
+ *   random players after their rating changed, looking up the rank of
+ *   random players and getting the best LADDER_TOP_MAX, up to a million
+ *   players
+ * - playerlist_findplayer/playerlist_findid: looking up random players by
+ *   name and by id, with threads threads doing it at the same time on a
+ *   list of size players
+ *
+ * Every measurement is repeated until it has done at least min_ops
+ * operations.
+ *
+ * Usage: struct_bench [min_ops]
+ */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alist.h"
+#include "epoch.h"
+#include "ladder.h"
+#include "match.h"
+#include "player.h"
+#include "playerlist.h"
+#include "queue.h"
+#include "records.h"
+#include "timer.h"
+
+#define DEF_MIN_OPS 1000000
+#define TIMER_SPAN_MS (3600 * 1000)  // timers are armed within this
+#define MAX_THREADS 16
+
+static long min_ops = DEF_MIN_OPS;
+static const int sizes[] = {1000, 10000, 100000};
+static const int ladder_sizes[] = {1000, 10000, 100000, 1000000};
+static const int thread_counts[] = {1, 2, 4, 8, 16};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, int size, int threads, long ops,
+                   double elapsed) {
+  printf("%s,%d,%d,%ld,%.2f\n", name, size, threads, ops,
+         elapsed * 1e9 / ops);
+  fflush(stdout);
+}
+
+static void no_free(void* data) {}
+
+/************************************************************************
+ * Measures alist_add, alist_get and alist_remove on a list that holds
+ * size items.
+ */
+static void bench_alist(int size) {
+  long rounds = (min_ops + size - 1) / size;
+  int* order = malloc(size * sizeof(int));
+  if (order == NULL) {
+    perror("malloc order");
+    exit(1);
+  }
+  double add = 0, get = 0, remove = 0;
+  void* volatile sink;  // so the reads are not optimized away
+
+  for (long r = 0; r < rounds; r++) {
+    alist a;
+    alist_init(&a, no_free);
+
+    double start = now();
+    for (int i = 0; i < size; i++) alist_add(&a, &order[i]);
+    add += now() - start;
+
+    start = now();
+    for (int i = 0; i < size; i++) sink = alist_get(&a, i);
+    get += now() - start;
+
+    if (r == 0) {
+      // Removing from a random index is what the playerlist does
+      for (int i = 0; i < size; i++) order[i] = random() % (size - i);
+      start = now();
+      for (int i = 0; i < size; i++) alist_remove(&a, order[i]);
+      remove += now() - start;
+    }
+
+    alist_destroy(&a);
+  }
+  free(order);
+  (void)sink;
+
+  report("alist_add", size, 1, rounds * size, add);
+  report("alist_get", size, 1, rounds * size, get);
+  report("alist_remove", size, 1, size, remove);
+}
+
+typedef struct producer {
+  pthread_t thread;
+  job* jobs;
+  long njobs;
+} producer;
+
+static pthread_barrier_t start_line;
+
+static void* produce(void* arg) {
+  producer* p = (producer*)arg;
+  pthread_barrier_wait(&start_line);
+  for (long i = 0; i < p->njobs; i++) queue_enqueue(&p->jobs[i]);
+  return NULL;
+}
+
+/************************************************************************
+ * Measures how long it takes nproducers threads to get min_ops jobs
+ * through the queue to a single consumer.
+ */
+static void bench_queue(int nproducers, player_info* origin) {
+  producer producers[MAX_THREADS];
+  long per_producer = (min_ops + nproducers - 1) / nproducers;
+  for (int i = 0; i < nproducers; i++) {
+    producers[i].njobs = per_producer;
+    if ((producers[i].jobs = calloc(per_producer, sizeof(job))) == NULL) {
+      perror("malloc jobs");
+      exit(1);
+    }
+    for (long j = 0; j < per_producer; j++) {
+      producers[i].jobs[j].type = JOB_MSG;
+      producers[i].jobs[j].origin = origin->self;
+    }
+  }
+
+  pthread_barrier_init(&start_line, NULL, nproducers + 1);
+  for (int i = 0; i < nproducers; i++) {
+    pthread_create(&producers[i].thread, NULL, &produce, &producers[i]);
+  }
+  long total = per_producer * nproducers;
+  pthread_barrier_wait(&start_line);
+  double start = now();
+  for (long i = 0; i < total; i++) queue_dequeue_wait(0);
+  double elapsed = now() - start;
+
+  for (int i = 0; i < nproducers; i++) {
+    pthread_join(producers[i].thread, NULL);
+    free(producers[i].jobs);
+  }
+  pthread_barrier_destroy(&start_line);
+  report("queue_enqueue", 0, nproducers, total, elapsed);
+}
+
+typedef struct bench_timer {
+  timer t;
+  long long deadline;
+} bench_timer;
+
+static long timers_fired, timers_early;
+
+static void count_fire(timer_wheel* w, timer* t, long long now) {
+  timers_fired++;
+  if (now < ((bench_timer*)t)->deadline) timers_early++;
+}
+
+/************************************************************************
+ * Measures arming size timers and running them all through the wheel.
+ * Complains if any fired early or not at all.
+ */
+static void bench_timers(int size) {
+  long rounds = (min_ops + size - 1) / size;
+  bench_timer* timers = malloc(size * sizeof(bench_timer));
+  timer_wheel* w = malloc(sizeof(timer_wheel));
+  if (timers == NULL || w == NULL) {
+    perror("malloc timers");
+    exit(1);
+  }
+  double arm = 0, fire = 0;
+  timers_fired = timers_early = 0;
+
+  for (long r = 0; r < rounds; r++) {
+    timer_wheel_init(w, 0);
+    for (int i = 0; i < size; i++) {
+      timers[i].t.fire = count_fire;
+      timers[i].deadline = random() % TIMER_SPAN_MS;
+    }
+
+    double start = now();
+    for (int i = 0; i < size; i++) {
+      timer_arm(w, &timers[i].t, timers[i].deadline);
+    }
+    arm += now() - start;
+
+    // Jump from one expiry to the next, as a notifier sleeps in between
+    start = now();
+    long long clock = 0, wait;
+    while ((wait = timer_next(w, clock)) >= 0) {
+      clock += wait;
+      timer_advance(w, clock);
+    }
+    fire += now() - start;
+  }
+
+  if (timers_fired != rounds * size || timers_early > 0) {
+    fprintf(stderr, "timer wheel: %ld of %ld timers fired, %ld early\n",
+            timers_fired, rounds * size, timers_early);
+  }
+  report("timer_arm", size, 1, rounds * size, arm);
+  report("timer_fire", size, 1, rounds * size, fire);
+  free(timers);
+  free(w);
+}
+
+// Returns a rating between 400 and 1600, roughly bell shaped
+static int random_rating() {
+  int rating = 400;
+  for (int k = 0; k < 4; k++) rating += random() % 301;
+  return rating;
+}
+
+static long pairs_made;
+
+static void count_pair(player_info* p1, player_info* p2) { pairs_made++; }
+
+/************************************************************************
+ * Measures queueing size players in a matchmaking pool and pairing them
+ * all up. players holds at least size players, who are not in a duel.
+ */
+static void bench_match(int size, player_info** players) {
+  long rounds = (min_ops + size - 1) / size;
+  match_pool* pool = malloc(sizeof(match_pool));
+  if (pool == NULL) {
+    perror("malloc pool");
+    exit(1);
+  }
+  double add = 0, pair = 0;
+  pairs_made = 0;
+
+  epoch_enter();
+  for (long r = 0; r < rounds; r++) {
+    match_pool_init(pool, 1);
+    for (int i = 0; i < size; i++) players[i]->rating = random_rating();
+
+    double start = now();
+    for (int i = 0; i < size; i++) match_add(pool, players[i], 0);
+    add += now() - start;
+
+    start = now();
+    for (long long clock = 0; pool->count > 0; clock += MATCH_INTERVAL_MS) {
+      match_run(pool, clock, count_pair);
+    }
+    pair += now() - start;
+  }
+  epoch_exit();
+
+  if (pairs_made != rounds * size / 2) {
+    fprintf(stderr, "matchmaking: %ld of %ld pairs made\n", pairs_made,
+            rounds * size / 2);
+  }
+  report("match_add", size, 1, rounds * size, add);
+  report("match_pair", size, 1, pairs_made, pair);
+  free(pool);
+}
+
+/************************************************************************
+ * Measures the leaderboards with size players.
+ */
+static void bench_ladder(int size) {
+  ladder_row* rows = malloc(size * sizeof(ladder_row));
+  if (rows == NULL) {
+    perror("malloc rows");
+    exit(1);
+  }
+  for (int i = 0; i < size; i++) {
+    snprintf(rows[i].name, sizeof(rows[i].name), "l%d", i);
+    rows[i].rating = random_rating();
+  }
+  ladder l;
+
+  ladder_init(&l);
+  double start = now();
+  ladder_build(&l, rows, size);  // sorts rows
+  report("ladder_build", size, 1, size, now() - start);
+  ladder_destroy(&l);
+
+  ladder_init(&l);
+  start = now();
+  for (int i = 0; i < size; i++) {
+    ladder_set(&l, rows[i].name, rows[i].rating, 0);
+  }
+  report("ladder_set", size, 1, size, now() - start);
+
+  start = now();
+  for (long i = 0; i < min_ops; i++) {
+    ladder_row* r = &rows[random() % size];
+    r->rating += (int)(random() % 33) - 16;  // like after a duel
+    ladder_set(&l, r->name, r->rating, 0);
+  }
+  report("ladder_move", size, 1, min_ops, now() - start);
+
+  unsigned long sum = 0;  // so the lookups cannot be left out
+  start = now();
+  for (long i = 0; i < min_ops; i++) {
+    int rating;
+    sum += ladder_rank(&l, rows[random() % size].name, &rating);
+  }
+  report("ladder_rank", size, 1, min_ops, now() - start);
+  if (sum == 0) fprintf(stderr, "ladder_rank: nobody found\n");
+
+  ladder_row top[LADDER_TOP_MAX];
+  start = now();
+  for (long i = 0; i < min_ops; i++) {
+    sum += ladder_top(&l, LADDER_TOP_MAX, top);
+  }
+  report("ladder_top", size, 1, min_ops, now() - start);
+  ladder_destroy(&l);
+  free(rows);
+}
+
+/************************************************************************
+ * Measures the record store with size players, using the first size of
+ * players (which get names of their own).
+ */
+static void bench_records(int size, player_info** players) {
+  char dir[] = "/tmp/struct_bench.XXXXXX";
+  char path[sizeof(dir) + 16], log_path[sizeof(path) + 4];
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  snprintf(path, sizeof(path), "%s/records", dir);
+  snprintf(log_path, sizeof(log_path), "%s.log", path);
+  for (int i = 0; i < size; i++) {
+    snprintf(players[i]->name, sizeof(players[i]->name), "r%d", i);
+  }
+
+  // Every player fights at least once, and the log ends up full
+  long ops = min_ops;
+  if (ops < size + RECORD_LOG_SLOTS) ops = size + RECORD_LOG_SLOTS;
+  if (record_init(path, 0, 0) < 0) exit(1);
+  double start = now();
+  for (long i = 0; i < ops; i++) {
+    player_info* p1 = players[i % size];
+    player_info* p2 = players[(i + 1 + random() % (size - 1)) % size];
+    record_result(p1, p2, (i & 1) ? p1 : NULL);
+  }
+  report("record_result", size, 1, ops, now() - start);
+  record_shutdown();
+
+  start = now();
+  if (record_init(path, 0, 0) < 0) exit(1);
+  report("record_load", size, 1, size, now() - start);
+
+  player_info* p = player_alloc();
+  player_init(p);
+  start = now();
+  for (long i = 0; i < min_ops; i++) {
+    snprintf(p->name, sizeof(p->name), "r%ld", random() % size);
+    record_lookup(p);
+  }
+  report("record_lookup", size, 1, min_ops, now() - start);
+  player_free(p);
+  record_shutdown();
+
+  unlink(log_path);
+  unlink(path);
+  rmdir(dir);
+}
+
+// Ways of reading the playerlist
+typedef enum read_mode {
+  READ_FIND,  // look up random players by name
+  READ_ID,    // look up random players by id
+} read_mode;
+
+typedef struct reader {
+  pthread_t thread;
+  read_mode mode;
+  int size;
+  long ops;
+  unsigned int seed;
+} reader;
+
+static void* read_players(void* arg) {
+  reader* r = (reader*)arg;
+  char name[PLAYER_MAXNAME + 1];
+  long done = 0;
+  pthread_barrier_wait(&start_line);
+
+  while (done < r->ops) {
+    if (r->mode == READ_FIND) {
+      snprintf(name, sizeof(name), "p%d", rand_r(&r->seed) % r->size);
+      if (playerlist_findplayer(name) == NULL) {
+        fprintf(stderr, "Lost player %s\n", name);
+        exit(1);
+      }
+      done++;
+    } else {
+      // Players get ids 1, 2, ... in the order they are added
+      unsigned int id = rand_r(&r->seed) % r->size + 1;
+      if (playerlist_findid(id) == NULL) {
+        fprintf(stderr, "Lost player %u\n", id);
+        exit(1);
+      }
+      done++;
+    }
+  }
+  r->ops = done;
+  return NULL;
+}
+
+/************************************************************************
+ * Measures lookups in the playerlist (which holds size players) with
+ * nthreads threads at once, each doing min_ops of them. Reports the
+ * wall time divided by the lookups of all threads together.
+ */
+static void bench_playerlist(const char* name, read_mode mode, int size,
+                             int nthreads) {
+  reader readers[MAX_THREADS];
+  pthread_barrier_init(&start_line, NULL, nthreads + 1);
+  for (int i = 0; i < nthreads; i++) {
+    readers[i].mode = mode;
+    readers[i].size = size;
+    readers[i].ops = min_ops;
+    readers[i].seed = i + 1;
+    pthread_create(&readers[i].thread, NULL, &read_players, &readers[i]);
+  }
+
+  // Timed from before the barrier, as the readers may well be done before
+  // this thread gets to run again after it
+  double start = now();
+  pthread_barrier_wait(&start_line);
+  long ops = 0;
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(readers[i].thread, NULL);
+    ops += readers[i].ops;
+  }
+  double elapsed = now() - start;
+  pthread_barrier_destroy(&start_line);
+  report(name, size, nthreads, ops, elapsed);
+}
+
+/************************************************************************
+ * Adds logged in players to the playerlist until it holds size of them.
+ */
+static void grow_playerlist(int size) {
+  for (int i = playerlist_getsize(); i < size; i++) {
+    player_info* player = player_alloc();
+    player_init(player);
+    playerlist_addplayer(player);
+    char name[PLAYER_MAXNAME + 1];
+    snprintf(name, sizeof(name), "p%d", i);
+    playerlist_changeplayername(player, name);
+    player->state = PLAYER_REG;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1) {
+    min_ops = strtol(argv[1], NULL, 10);
+    if (min_ops <= 0) {
+      fprintf(stderr, "Usage: %s [min_ops]\n", argv[0]);
+      exit(1);
+    }
+  }
+  size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  size_t nthreads = sizeof(thread_counts) / sizeof(thread_counts[0]);
+
+  printf("benchmark,size,threads,ops,ns_per_op\n");
+  for (size_t s = 0; s < nsizes; s++) bench_alist(sizes[s]);
+
+  player_info* origin = player_alloc();
+  player_init(origin);
+  queue_init(1);
+  for (size_t t = 0; t < nthreads; t++) bench_queue(thread_counts[t], origin);
+  queue_destroy();
+
+  for (size_t s = 0; s < nsizes; s++) bench_timers(sizes[s]);
+
+  int most = sizes[nsizes - 1];
+  player_info** players = malloc(most * sizeof(player_info*));
+  if (players == NULL) {
+    perror("malloc players");
+    exit(1);
+  }
+  for (int i = 0; i < most; i++) {
+    players[i] = player_alloc();
+    player_init(players[i]);
+    players[i]->state = PLAYER_REG;
+    players[i]->in_room = 1;
+  }
+  for (size_t s = 0; s < nsizes; s++) bench_match(sizes[s], players);
+  for (size_t s = 0; s < nsizes; s++) bench_records(sizes[s], players);
+  for (int i = 0; i < most; i++) player_free(players[i]);
+  free(players);
+
+  size_t nladders = sizeof(ladder_sizes) / sizeof(ladder_sizes[0]);
+  for (size_t s = 0; s < nladders; s++) bench_ladder(ladder_sizes[s]);
+
+  // The players are never freed: they stay in the playerlist to the end
+  playerlist_init();
+  for (size_t s = 0; s < nsizes; s++) {
+    grow_playerlist(sizes[s]);
+    for (size_t t = 0; t < nthreads; t++) {
+      bench_playerlist("playerlist_findplayer", READ_FIND, sizes[s],
+                       thread_counts[t]);
+    }
+    for (size_t t = 0; t < nthreads; t++) {
+      bench_playerlist("playerlist_findid", READ_ID, sizes[s],
+                       thread_counts[t]);
+    }
+  }
+  return 0;
+}
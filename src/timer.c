@@ -0,0 +1,162 @@
+/* A hierarchical timer wheel (Varghese and Lauck), for timeouts that are
+ * armed far more often than they fire and that only need to be roughly
+ * on time (challenges, duels, idle connections).
+ *
+ * Time is cut into ticks of TIMER_TICK_MS. Level 0 has a slot for each
+ * of the next 64 ticks; a slot of level 1 covers 64 ticks, one of level
+ * 2 covers 64^2, and so on. A timer goes into the lowest level whose
+ * range reaches its tick, which makes arming a list push. Every 64 ticks
+ * the next slot of level 1 is emptied into level 0 (and every 64^2 ticks
+ * the next slot of level 2 into level 1, ...), so a timer is moved at
+ * most TIMER_LEVELS - 1 times before it fires, however many are armed.
+ *
+ * A wheel belongs to one thread, which arms timers and runs them through
+ * timer_advance. Other threads hand timers in with timer_post, which
+ * pushes them onto a lock-free stack that the owner empties before each
+ * advance. Timers cannot be cancelled: the callback is expected to check
+ * whether what it was armed for still holds, and do nothing if not.
+ */
+
+#include "timer.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_RANGE (1LL << (TIMER_BITS * TIMER_LEVELS))  // ticks reachable
+
+/************************************************************************
+ * Sets up an empty wheel whose tick 0 starts at now (in ms).
+ */
+void timer_wheel_init(timer_wheel* w, long long now) {
+  w->base = now;
+  w->now = 0;
+  w->count = 0;
+  for (int l = 0; l < TIMER_LEVELS; l++) {
+    for (int s = 0; s < TIMER_SLOTS; s++) w->slots[l][s] = NULL;
+    w->occupied[l] = 0;
+  }
+  w->posted = NULL;
+}
+
+/************************************************************************
+ * Puts a timer whose expires tick is set into the slot for it. Timers
+ * that are overdue go into the slot of the next tick to run.
+ */
+static void timer_place(timer_wheel* w, timer* t) {
+  long long delta = t->expires - w->now;
+  int level = 0;
+  int slot;
+  if (delta < 0) {
+    slot = w->now & TIMER_MASK;
+  } else {
+    if (delta >= TIMER_RANGE) {
+      delta = TIMER_RANGE - 1;
+      t->expires = w->now + delta;
+    }
+    while (delta >= 1LL << (TIMER_BITS * (level + 1))) level++;
+    slot = (t->expires >> (TIMER_BITS * level)) & TIMER_MASK;
+  }
+  t->next = w->slots[level][slot];
+  w->slots[level][slot] = t;
+  w->occupied[level] |= 1ULL << slot;
+}
+
+/************************************************************************
+ * Arms a timer to fire once the clock reaches deadline (in ms), give or
+ * take a tick. Only the owner of the wheel may call this.
+ */
+void timer_arm(timer_wheel* w, timer* t, long long deadline) {
+  t->expires = (deadline - w->base + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  w->count++;
+  timer_place(w, t);
+}
+
+/************************************************************************
+ * Hands a timer to the owner of the wheel, to be armed for deadline (in
+ * ms) on its next timer_advance. Safe to call from any thread. Returns 1
+ * if the owner had nothing posted before, in which case the caller has
+ * to make sure it wakes up to look.
+ */
+int timer_post(timer_wheel* w, timer* t, long long deadline) {
+  t->expires = deadline;
+  timer* head = __atomic_load_n(&w->posted, __ATOMIC_RELAXED);
+  do {
+    t->next = head;
+  } while (!__atomic_compare_exchange_n(&w->posted, &head, t, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return head == NULL;
+}
+
+/************************************************************************
+ * Moves the timers of the current slot of a level down to the levels
+ * below, now that they are due within that level's range.
+ */
+static void timer_cascade(timer_wheel* w, int level) {
+  int slot = (w->now >> (TIMER_BITS * level)) & TIMER_MASK;
+  timer* t = w->slots[level][slot];
+  w->slots[level][slot] = NULL;
+  w->occupied[level] &= ~(1ULL << slot);
+  while (t != NULL) {
+    timer* next = t->next;
+    timer_place(w, t);
+    t = next;
+  }
+}
+
+/************************************************************************
+ * Arms the posted timers, then runs every timer that is due by now (in
+ * ms), in tick order. A timer's fire function may arm it again, or arm
+ * others. Only the owner of the wheel may call this.
+ */
+void timer_advance(timer_wheel* w, long long now) {
+  timer* t = __atomic_exchange_n(&w->posted, NULL, __ATOMIC_ACQUIRE);
+  while (t != NULL) {
+    timer* next = t->next;
+    timer_arm(w, t, t->expires);
+    t = next;
+  }
+
+  long long target = (now - w->base) / TIMER_TICK_MS;
+  if (w->count == 0 && w->now <= target) w->now = target + 1;
+  while (w->now <= target) {
+    // At the start of each round of a level, bring its next slot down
+    for (int l = 1; l < TIMER_LEVELS; l++) {
+      if ((w->now & ((1LL << (TIMER_BITS * l)) - 1)) != 0) break;
+      timer_cascade(w, l);
+    }
+
+    // Nothing left in level 0 this round: skip to the next one
+    int slot = w->now & TIMER_MASK;
+    if ((w->occupied[0] >> slot) == 0) {
+      long long next_round = (w->now | TIMER_MASK) + 1;
+      w->now = (next_round <= target) ? next_round : target + 1;
+      continue;
+    }
+
+    t = w->slots[0][slot];
+    w->slots[0][slot] = NULL;
+    w->occupied[0] &= ~(1ULL << slot);
+    w->now++;
+    while (t != NULL) {
+      timer* next = t->next;
+      w->count--;
+      t->fire(w, t, now);
+      t = next;
+    }
+  }
+}
+
+/************************************************************************
+ * Returns how many ms from now timer_advance will next have something to
+ * do, 0 if it has right away, or -1 if no timer is armed or posted. With
+ * only far off timers that is the next time a level has to be brought
+ * down, so the owner may wake up a few times for nothing.
+ */
+long long timer_next(timer_wheel* w, long long now) {
+  if (__atomic_load_n(&w->posted, __ATOMIC_RELAXED) != NULL) return 0;
+  if (w->count == 0) return -1;
+
+  int slot = w->now & TIMER_MASK;
+  unsigned long long ahead = w->occupied[0] >> slot;
+  long long ticks = (ahead != 0) ? __builtin_ctzll(ahead) : TIMER_SLOTS - slot;
+  long long at = w->base + (w->now + ticks) * TIMER_TICK_MS;
+  return (at > now) ? at - now : 0;
+}
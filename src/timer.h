@@ -0,0 +1,46 @@
+// Data types and function prototypes for the hierarchical timer wheel
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <time.h>
+
+#define TIMER_TICK_MS 100  // resolution of the wheel
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)  // slots per level
+#define TIMER_LEVELS 4                 // so timers reach 64^4 ticks (19 days)
+
+typedef struct timer_wheel timer_wheel;
+
+// A timer, embedded in whatever it is about. Only the wheel's owner may
+// arm it; other threads post it (see timer_post).
+typedef struct timer {
+  struct timer* next;
+  long long expires;  // tick it fires at (a deadline in ms while posted)
+  void (*fire)(timer_wheel* w, struct timer* t, long long now);
+} timer;
+
+// A wheel, owned by one thread. Level l holds the timers due within
+// 64^(l+1) ticks, in slots of 64^l ticks each.
+struct timer_wheel {
+  long long base;  // clock time of tick 0, in ms
+  long long now;   // next tick to run
+  long count;      // timers armed
+  timer* slots[TIMER_LEVELS][TIMER_SLOTS];
+  unsigned long long occupied[TIMER_LEVELS];  // one bit per non-empty slot
+  timer* posted;  // timers handed in by other threads, not armed yet
+};
+
+void timer_wheel_init(timer_wheel* w, long long now);
+void timer_arm(timer_wheel* w, timer* t, long long deadline);
+int timer_post(timer_wheel* w, timer* t, long long deadline);
+void timer_advance(timer_wheel* w, long long now);
+long long timer_next(timer_wheel* w, long long now);
+
+// A cheap clock in milliseconds (a few ms coarse), for deadlines
+static inline long long timer_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+#endif  // _TIMER_H
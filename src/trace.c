@@ -0,0 +1,165 @@
+/* Job latency tracing. When it is turned on (arena -T), every job
+ * carries the time the command that caused it arrived (stamped in
+ * conn_received), the time it was queued (queue_enqueue) and the time
+ * the notifier took it off the queue (notif_loop). Once the notifier is
+ * done with the job it adds the time the last notice was handed to the
+ * connections and puts the lot in a trace_record.
+ *
+ * Each notifier thread has a ring of records of its own, which only it
+ * writes and only the flusher thread reads, so tracing takes no lock
+ * and no locked instruction. The flusher writes out whatever is in the
+ * rings every TRACE_FLUSH_MS. If a ring fills up anyway, records are
+ * dropped (and counted) rather than making the notifier wait.
+ *
+ * trace_decode turns the file into per job type latency breakdowns.
+ */
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_FLUSH_MS 100
+
+int trace_on = 0;
+__thread long long trace_arrival = 0;
+
+typedef struct trace_ring {
+  trace_record records[TRACE_RINGSIZE];
+  unsigned long head;     // records written, only moved by the owner
+  unsigned long tail;     // records flushed, only moved by the flusher
+  unsigned long dropped;  // records lost to a full ring
+  struct trace_ring* next;
+} trace_ring;
+
+static __thread trace_ring* my_ring = NULL;
+static trace_ring* rings = NULL;  // never shrinks, so the flusher needs no lock
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* trace_file = NULL;
+static pthread_t flusher;
+static volatile int stopping = 0;
+static unsigned long written = 0;
+
+static trace_ring* trace_register() {
+  trace_ring* r = calloc(1, sizeof(trace_ring));
+  if (r == NULL) {
+    perror("malloc trace_ring");
+    exit(1);
+  }
+  pthread_mutex_lock(&rings_lock);
+  r->next = rings;
+  __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&rings_lock);
+  return r;
+}
+
+static uint32_t trace_span(long long from, long long to) {
+  if (to <= from) return 0;
+  return (to - from > UINT32_MAX) ? UINT32_MAX : (uint32_t)(to - from);
+}
+
+/************************************************************************
+ * Records a job the calling thread just finished with. Only called
+ * when tracing is on.
+ */
+void trace_job(job* job) {
+  if (job->type == JOB_DONE) return;
+  if (my_ring == NULL) my_ring = trace_register();
+  trace_ring* r = my_ring;
+
+  unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  if (r->head - tail == TRACE_RINGSIZE) {
+    __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  trace_record* rec = &r->records[r->head % TRACE_RINGSIZE];
+  rec->arrived = job->arrived;
+  rec->queued = trace_span(job->arrived, job->enqueued);
+  rec->waited = trace_span(job->enqueued, job->dequeued);
+  rec->handled = trace_span(job->dequeued, stats_now());
+  rec->type = job->type;
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * Writes out the records waiting in every ring.
+ */
+static void trace_flush() {
+  trace_ring* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  for (; r != NULL; r = r->next) {
+    unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = r->tail;
+    while (tail != head) {
+      // Up to the end of the ring at most, then around
+      size_t pos = tail % TRACE_RINGSIZE;
+      size_t n = head - tail;
+      if (n > TRACE_RINGSIZE - pos) n = TRACE_RINGSIZE - pos;
+      if (fwrite(&r->records[pos], sizeof(trace_record), n, trace_file) != n) {
+        perror("write trace");
+      }
+      tail += n;
+      written += n;
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+  }
+  fflush(trace_file);
+}
+
+static void* trace_main(void* arg) {
+  while (!stopping) {
+    usleep(TRACE_FLUSH_MS * 1000);
+    trace_flush();
+  }
+  return NULL;
+}
+
+/************************************************************************
+ * Creates the trace file at path and turns tracing on. Returns 0 on
+ * success, -1 on error.
+ */
+int trace_init(const char* path) {
+  if ((trace_file = fopen(path, "w")) == NULL) {
+    perror("fopen trace");
+    return -1;
+  }
+  trace_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(trace_record);
+  if (fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+    perror("write trace");
+    fclose(trace_file);
+    return -1;
+  }
+
+  if (pthread_create(&flusher, NULL, &trace_main, NULL) != 0) {
+    perror("pthread_create trace");
+    fclose(trace_file);
+    return -1;
+  }
+  trace_on = 1;
+  return 0;
+}
+
+/************************************************************************
+ * Writes out the last records and closes the trace file, if there is
+ * one. The notifiers must have stopped.
+ */
+void trace_shutdown() {
+  if (trace_file == NULL) return;
+  trace_on = 0;
+  stopping = 1;
+  pthread_join(flusher, NULL);
+  trace_flush();
+  fclose(trace_file);
+  trace_file = NULL;
+
+  unsigned long dropped = 0;
+  for (trace_ring* r = rings; r != NULL; r = r->next) dropped += r->dropped;
+  printf("Traced %lu jobs, %lu dropped\n", written, dropped);
+}
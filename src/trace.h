@@ -0,0 +1,51 @@
+// Data types and function prototypes for job latency tracing
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+#include "queue.h"
+#include "stats.h"
+
+#define TRACE_MAGIC "ARTR"
+#define TRACE_VERSION 1
+#define TRACE_RINGSIZE 8192  // records per thread waiting to be written
+
+// Start of a trace file. Everything in the file is in the byte order of
+// the machine that wrote it.
+typedef struct trace_header {
+  char magic[4];  // TRACE_MAGIC
+  uint32_t version;
+  uint32_t record_size;  // sizeof(trace_record)
+  uint32_t pad;
+} trace_header;
+
+// One job, from the line that caused it to its last notice being handed
+// to the recipients' connections. Stages are in nanoseconds, capped at
+// UINT32_MAX.
+typedef struct trace_record {
+  uint64_t arrived;  // CLOCK_MONOTONIC time the command arrived
+  uint32_t queued;   // from arrival to queue_enqueue
+  uint32_t waited;   // in the queue, until the notifier took it off
+  uint32_t handled;  // until the notifier was done sending it
+  uint32_t type;     // job_type
+} trace_record;
+
+extern int trace_on;
+extern __thread long long trace_arrival;
+
+int trace_init(const char* path);
+void trace_job(job* job);
+void trace_shutdown();
+
+// Records the current time in *t, if tracing
+static inline void trace_stamp(long long* t) {
+  if (trace_on) *t = stats_now();
+}
+
+// Tells the jobs created from here on that their command arrived now
+static inline void trace_arrive() {
+  if (trace_on) trace_arrival = stats_now();
+}
+
+#endif  // _TRACE_H
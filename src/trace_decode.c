@@ -0,0 +1,177 @@
+/* Decoder for the trace files written by arena -T (see trace.c). Reads
+ * one or more of them (say, one per cluster node) and prints, for each
+ * type of job, how long jobs spent in each stage:
+ *
+ * - queued: from the command arriving to the job being queued, which is
+ *   the time spent parsing and running the command
+ * - waited: in the queue, until a notifier took the job off
+ * - handled: in the notifier, until the last notice was handed to the
+ *   recipients' connections
+ * - total: all of the above
+ *
+ * with the mean, p50, p99, p999 and maximum in microseconds, followed by
+ * the time span the traces cover.
+ *
+ * Usage: trace_decode trace_file...
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "trace.h"
+
+#define NUM_STAGES 4
+
+static const char* stage_names[NUM_STAGES] = {"queued", "waited", "handled",
+                                              "total"};
+
+// The records of one job type
+typedef struct record_list {
+  trace_record* records;
+  size_t count;
+  size_t cap;
+} record_list;
+
+static record_list lists[NUM_JOB_TYPES];
+static uint64_t first_arrival = UINT64_MAX, last_arrival = 0;
+
+static void add_record(const trace_record* rec) {
+  record_list* l = &lists[rec->type];
+  if (l->count == l->cap) {
+    l->cap = (l->cap == 0) ? 1024 : l->cap * 2;
+    if ((l->records = realloc(l->records, l->cap * sizeof(trace_record))) ==
+        NULL) {
+      perror("malloc records");
+      exit(1);
+    }
+  }
+  l->records[l->count++] = *rec;
+  if (rec->arrived < first_arrival) first_arrival = rec->arrived;
+  if (rec->arrived > last_arrival) last_arrival = rec->arrived;
+}
+
+/************************************************************************
+ * Reads every record in the trace file at path. Returns the number of
+ * records read, or -1 if it is not a trace file we understand.
+ */
+static long read_trace(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  trace_header header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION ||
+      header.record_size != sizeof(trace_record)) {
+    fprintf(stderr, "%s: not a trace file (or from another version)\n",
+            path);
+    fclose(f);
+    return -1;
+  }
+
+  trace_record rec;
+  long n = 0;
+  while (fread(&rec, sizeof(rec), 1, f) == 1) {
+    if (rec.type >= NUM_JOB_TYPES) {
+      fprintf(stderr, "%s: bad job type %u in record %ld\n", path, rec.type,
+              n);
+      continue;
+    }
+    add_record(&rec);
+    n++;
+  }
+  fclose(f);
+  return n;
+}
+
+static uint64_t stage_value(const trace_record* rec, int stage) {
+  switch (stage) {
+    case 0:
+      return rec->queued;
+    case 1:
+      return rec->waited;
+    case 2:
+      return rec->handled;
+    default:
+      return (uint64_t)rec->queued + rec->waited + rec->handled;
+  }
+}
+
+static int compare_values(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t* sorted, size_t n, double p) {
+  return sorted[(size_t)(p * (n - 1))] / 1000.0;
+}
+
+/************************************************************************
+ * Prints the stage breakdown of one job type.
+ */
+static void print_type(job_type type, uint64_t* values) {
+  record_list* l = &lists[type];
+  for (int s = 0; s < NUM_STAGES; s++) {
+    double sum = 0;
+    for (size_t i = 0; i < l->count; i++) {
+      values[i] = stage_value(&l->records[i], s);
+      sum += values[i];
+    }
+    qsort(values, l->count, sizeof(uint64_t), compare_values);
+
+    if (s == 0) {
+      printf("%-10s %9zu", job_names[type], l->count);
+    } else {
+      printf("%-10s %9s", "", "");
+    }
+    printf(" %-8s %9.1f %9.1f %9.1f %9.1f %9.1f\n", stage_names[s],
+           sum / l->count / 1000.0, percentile(values, l->count, 0.5),
+           percentile(values, l->count, 0.99),
+           percentile(values, l->count, 0.999),
+           values[l->count - 1] / 1000.0);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s trace_file...\n", argv[0]);
+    exit(1);
+  }
+  long total = 0;
+  for (int i = 1; i < argc; i++) {
+    long n = read_trace(argv[i]);
+    if (n < 0) exit(1);
+    total += n;
+  }
+  if (total == 0) {
+    printf("No jobs traced\n");
+    return 0;
+  }
+
+  size_t most = 0;
+  for (int t = 0; t < NUM_JOB_TYPES; t++) {
+    if (lists[t].count > most) most = lists[t].count;
+  }
+  uint64_t* values = malloc(most * sizeof(uint64_t));
+  if (values == NULL) {
+    perror("malloc values");
+    exit(1);
+  }
+
+  printf("%-10s %9s %-8s %9s %9s %9s %9s %9s\n", "job", "count", "stage",
+         "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+  for (int t = 0; t < NUM_JOB_TYPES; t++) {
+    if (lists[t].count > 0) print_type(t, values);
+  }
+  printf("%ld jobs over %.1f s\n", total,
+         (last_arrival - first_arrival) / 1e9);
+
+  free(values);
+  for (int t = 0; t < NUM_JOB_TYPES; t++) free(lists[t].records);
+  return 0;
+}
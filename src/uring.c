@@ -0,0 +1,704 @@
+/* io_uring I/O engine. Each uring thread owns one ring, on which it
+ * keeps a multishot accept armed on the shared listener socket and a
+ * multishot receive armed on every connection it accepted. Receives
+ * pick their memory from a ring of provided buffers, so no buffer is
+ * tied up by idle players.
+ *
+ * Output produced on any thread is queued on the connection by
+ * conn_send_buf, whose kick hook puts the connection on its ring's
+ * pending list. The uring thread turns every pending connection into a
+ * sendmsg of its queued buffers on its next pass, so all the responses
+ * and notices produced while handling a batch of completions go to the
+ * kernel with a single io_uring_enter.
+ * Other threads only have to poke the ring's eventfd when the pending
+ * list goes from empty to non-empty.
+ *
+ * When a player moves to an arena on another node of the cluster, their
+ * receive is cancelled rather than the socket shut down, and once the
+ * ring is done with the connection it goes to cluster_handoff instead of
+ * conn_close. Connections coming the other way are passed in through
+ * uring_adopt.
+ *
+ * We talk to the kernel through the raw system calls rather than
+ * liburing. The engine needs multishot receive (Linux 6.0); uring_init
+ * fails on anything older so that the caller can fall back to another
+ * engine.
+ */
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "arena_protocol.h"
+#include "cluster.h"
+#include "conn.h"
+#include "stats.h"
+
+#define URING_ENTRIES 1024  // submission queue entries per ring
+#define URING_NBUFS 1024    // provided receive buffers per ring (power of 2)
+#define URING_BUFSIZE 2048  // size of each provided receive buffer
+#define URING_BGID 0        // buffer group id of the provided buffers
+
+// The low bits of user_data say what a completion is for
+#define TAG_MASK 7ULL
+enum { TAG_ACCEPT = 1, TAG_WAKE, TAG_RECV, TAG_SEND, TAG_CANCEL };
+
+typedef struct uring uring;
+typedef struct uring_conn uring_conn;
+
+// Per-connection state of the engine, hung off conn->io. The flags are
+// protected by the connection's outlock.
+struct uring_conn {
+  conn* c;
+  uring* ring;
+  // Buffers handed to the kernel, only touched by the ring thread
+  outbuf* sending[CONN_IOVMAX];
+  int nsending;
+  size_t sendoff;  // bytes of sending[0] already written
+  struct iovec iov[CONN_IOVMAX];
+  struct msghdr msg;
+  int queued;      // on the ring's pending list
+  int send_busy;   // a send is in flight
+  int recv_armed;  // the multishot receive has not terminated yet
+  int closing;     // connection is being torn down
+  uring_conn* next_pending;  // also links the adopting list
+};
+
+// One ring and the thread that drives it
+struct uring {
+  int fd;
+  int listen_fd;
+  pthread_t thread;
+
+  // Submission queue
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;
+  struct io_uring_sqe* sqes;
+
+  // Completion queue
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // Provided receive buffers
+  struct io_uring_buf_ring* br;
+  char* bufs;
+  unsigned short br_tail;
+
+  // Cross-thread wakeups for pending sends and adopted connections
+  int event_fd;
+  uint64_t event_val;
+  pthread_mutex_t pending_lock;
+  uring_conn* pending;
+  uring_conn* adopting;  // connections from other nodes, not started yet
+};
+
+static uring* rings = NULL;
+static int nrings = 0;
+static unsigned int next_ring = 0;
+static __thread uring* self_ring = NULL;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg,
+                                 unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/************************************************************************
+ * Checks that the kernel supports every operation the engine uses.
+ * IORING_OP_SEND_ZC arrived in the same release as multishot receive,
+ * which cannot be probed for directly.
+ */
+static int uring_probe(int ring_fd) {
+  size_t len = sizeof(struct io_uring_probe) +
+               256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, len);
+  if (probe == NULL) {
+    perror("malloc probe");
+    exit(1);
+  }
+
+  int ok = 0;
+  if (sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+    int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV,         IORING_OP_SENDMSG,
+                 IORING_OP_READ,   IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC};
+    ok = 1;
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+      if (ops[i] > probe->last_op ||
+          !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+        ok = 0;
+      }
+    }
+  }
+
+  free(probe);
+  return ok;
+}
+
+/************************************************************************
+ * Hands all queued submissions to the kernel and, if wait is set, waits
+ * for at least one completion.
+ */
+static void uring_enter(uring* r, int wait) {
+  __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+  unsigned to_submit =
+      r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if (to_submit == 0 && !wait) return;
+
+  if (sys_io_uring_enter(r->fd, to_submit, wait ? 1 : 0,
+                         wait ? IORING_ENTER_GETEVENTS : 0) < 0 &&
+      errno != EINTR && errno != EBUSY) {
+    perror("io_uring_enter");
+    exit(1);
+  }
+}
+
+/************************************************************************
+ * Returns a cleared submission queue entry, flushing the queue to the
+ * kernel first if it is full.
+ */
+static struct io_uring_sqe* uring_get_sqe(uring* r) {
+  while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+         r->sq_entries) {
+    uring_enter(r, 0);
+  }
+  struct io_uring_sqe* sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+  r->sq_local_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void uring_prep_accept(uring* r) {
+  struct io_uring_sqe* sqe = uring_get_sqe(r);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = r->listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = TAG_ACCEPT;
+}
+
+static void uring_prep_wake(uring* r) {
+  struct io_uring_sqe* sqe = uring_get_sqe(r);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = r->event_fd;
+  sqe->addr = (uintptr_t)&r->event_val;
+  sqe->len = sizeof(r->event_val);
+  sqe->user_data = TAG_WAKE;
+}
+
+static void uring_prep_recv(uring_conn* uc) {
+  struct io_uring_sqe* sqe = uring_get_sqe(uc->ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = uc->c->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = (uintptr_t)uc | TAG_RECV;
+  uc->recv_armed = 1;
+}
+
+static void uring_prep_cancel_recv(uring_conn* uc) {
+  struct io_uring_sqe* sqe = uring_get_sqe(uc->ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t)uc | TAG_RECV;
+  sqe->user_data = TAG_CANCEL;
+}
+
+static void uring_prep_send(uring_conn* uc) {
+  for (int i = 0; i < uc->nsending; i++) {
+    size_t off = (i == 0) ? uc->sendoff : 0;
+    uc->iov[i].iov_base = uc->sending[i]->data + off;
+    uc->iov[i].iov_len = uc->sending[i]->len - off;
+  }
+  memset(&uc->msg, 0, sizeof(uc->msg));
+  uc->msg.msg_iov = uc->iov;
+  uc->msg.msg_iovlen = uc->nsending;
+
+  struct io_uring_sqe* sqe = uring_get_sqe(uc->ring);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = uc->c->fd;
+  sqe->addr = (uintptr_t)&uc->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t)uc | TAG_SEND;
+}
+
+/************************************************************************
+ * Gives receive buffer bid back to the kernel.
+ */
+static void uring_recycle_buf(uring* r, unsigned short bid) {
+  struct io_uring_buf* buf = &r->br->bufs[r->br_tail & (URING_NBUFS - 1)];
+  buf->addr = (uintptr_t)(r->bufs + (size_t)bid * URING_BUFSIZE);
+  buf->len = URING_BUFSIZE;
+  buf->bid = bid;
+  r->br_tail++;
+  __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * Moves up to CONN_IOVMAX buffers from the connection's output queue
+ * over to the sending list. Must be called with outlock held, and only
+ * while no send is in flight.
+ */
+static void uring_take_out(uring_conn* uc) {
+  conn* c = uc->c;
+  size_t off;
+  outbuf* b;
+  uc->nsending = 0;
+  while (uc->nsending < CONN_IOVMAX && (b = conn_out_pop(c, &off)) != NULL) {
+    if (uc->nsending == 0) uc->sendoff = off;
+    uc->sending[uc->nsending++] = b;
+    c->outflight += b->len - off;
+  }
+}
+
+/************************************************************************
+ * Lets go of the first n bytes of the sending list, dropping every
+ * buffer that has been written completely.
+ */
+static void uring_sent(uring_conn* uc, size_t n) {
+  int done = 0;
+  while (done < uc->nsending) {
+    size_t rest = uc->sending[done]->len - uc->sendoff;
+    if (n < rest) break;
+    n -= rest;
+    uc->sendoff = 0;
+    conn_buf_put(uc->sending[done++]);
+  }
+  uc->sendoff += n;
+  uc->nsending -= done;
+  memmove(uc->sending, uc->sending + done, uc->nsending * sizeof(outbuf*));
+}
+
+/************************************************************************
+ * conn kick hook: makes sure the ring thread will send the connection's
+ * pending output. Called with outlock held, from any thread.
+ */
+static void uring_conn_kick(conn* c) {
+  uring_conn* uc = (uring_conn*)c->io;
+  uring* r = uc->ring;
+  if (uc->queued) return;
+
+  uc->queued = 1;
+  pthread_mutex_lock(&r->pending_lock);
+  int wake = (r->pending == NULL && r->adopting == NULL);
+  uc->next_pending = r->pending;
+  r->pending = uc;
+  pthread_mutex_unlock(&r->pending_lock);
+
+  // The ring thread drains the pending list before it sleeps again
+  if (wake && r != self_ring) {
+    uint64_t one = 1;
+    if (write(r->event_fd, &one, sizeof(one)) < 0) perror("write eventfd");
+  }
+}
+
+/************************************************************************
+ * Frees the connection once nothing in the kernel or on the pending
+ * list refers to it anymore. Notifiers stop kicking it in the same
+ * critical section, so nothing can put it back on the pending list.
+ */
+static void uring_conn_maybe_free(uring_conn* uc) {
+  pthread_mutex_lock(&uc->c->outlock);
+  int done = uc->closing && !uc->queued && !uc->send_busy && !uc->recv_armed;
+  if (done) uc->c->kick = NULL;
+  pthread_mutex_unlock(&uc->c->outlock);
+  if (!done) return;
+
+  for (int i = 0; i < uc->nsending; i++) conn_buf_put(uc->sending[i]);
+  if (uc->c->move_to >= 0) {
+    cluster_handoff(uc->c);
+  } else {
+    conn_close(uc->c);
+  }
+  free(uc);
+}
+
+/************************************************************************
+ * Starts tearing a connection down. Shutting down the read side ends
+ * the multishot receive, while output that is already queued (like the
+ * OK for a BYE) still gets sent. A connection moving to another node
+ * must stay usable, so its receive is cancelled instead.
+ */
+static void uring_conn_close(uring_conn* uc) {
+  pthread_mutex_lock(&uc->c->outlock);
+  int was_closing = uc->closing;
+  uc->closing = 1;
+  pthread_mutex_unlock(&uc->c->outlock);
+
+  if (!was_closing && uc->recv_armed) {
+    if (uc->c->move_to >= 0) {
+      uring_prep_cancel_recv(uc);
+    } else {
+      shutdown(uc->c->fd, SHUT_RD);
+    }
+  }
+  uring_conn_maybe_free(uc);
+}
+
+static void uring_handle_accept(uring* r, struct io_uring_cqe* cqe) {
+  // Counted like the acceptor threads count theirs
+  if (cqe->res >= 0) {
+    stats_add(STATS_ACCEPTS, 1);
+  } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+    stats_add(STATS_ACCEPT_ERRORS, 1);
+  }
+  if (cqe->res >= 0 && cluster_owner(ROOM_LOBBY) != cluster_node) {
+    cluster_handoff_fd(cqe->res);
+  } else if (cqe->res >= 0) {
+    uring_conn* uc = NULL;
+    if ((uc = calloc(1, sizeof(uring_conn))) == NULL) {
+      perror("uring_conn malloc");
+      exit(1);
+    }
+    uc->ring = r;
+    uc->c = conn_new(cqe->res);
+    uc->c->kick = uring_conn_kick;
+    uc->c->direct = 0;
+    uc->c->io = uc;
+    uring_prep_recv(uc);
+  } else {
+    fprintf(stderr, "io_uring accept: %s\n", strerror(-cqe->res));
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) uring_prep_accept(r);
+}
+
+static void uring_handle_recv(uring_conn* uc, struct io_uring_cqe* cqe) {
+  uring* r = uc->ring;
+  int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+  if (cqe->res > 0) {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    // Input still arriving for a moving player is kept for the new node
+    if ((!uc->closing || uc->c->move_to >= 0) &&
+        conn_input(uc->c, r->bufs + (size_t)bid * URING_BUFSIZE, cqe->res) < 0) {
+      uring_conn_close(uc);
+    }
+    uring_recycle_buf(r, bid);
+  }
+
+  if (more) return;
+  uc->recv_armed = 0;
+  if (!uc->closing && (cqe->res > 0 || cqe->res == -ENOBUFS)) {
+    uring_prep_recv(uc);  // ran out of buffers, just try again
+  } else {
+    uring_conn_close(uc);
+  }
+}
+
+static void uring_handle_send(uring_conn* uc, struct io_uring_cqe* cqe) {
+  conn* c = uc->c;
+  if (cqe->res < 0) {
+    pthread_mutex_lock(&c->outlock);
+    uc->send_busy = 0;
+    for (int i = 0; i < uc->nsending; i++) conn_buf_put(uc->sending[i]);
+    uc->nsending = 0;
+    c->outflight = 0;
+    c->outarmed = 0;
+    pthread_mutex_unlock(&c->outlock);
+    uring_conn_close(uc);
+    return;
+  }
+
+  uring_sent(uc, cqe->res);
+  stats_add(STATS_BYTES_OUT, cqe->res);
+  pthread_mutex_lock(&c->outlock);
+  c->outflight -= cqe->res;
+  int resend = 1;
+  if (uc->nsending == 0) {  // all done, look for more to send
+    if (c->outcount > 0 && !c->dead) {
+      uring_take_out(uc);
+    } else {
+      uc->send_busy = 0;
+      c->outarmed = 0;
+      resend = 0;
+    }
+  }
+  pthread_mutex_unlock(&c->outlock);
+
+  if (resend) {
+    uring_prep_send(uc);
+  } else {
+    uring_conn_maybe_free(uc);
+  }
+}
+
+/************************************************************************
+ * Starts serving a connection passed in by uring_adopt. Output queued
+ * for it before now is sent right away.
+ */
+static void uring_start_adopted(uring_conn* uc) {
+  conn* c = uc->c;
+  pthread_mutex_lock(&c->outlock);
+  c->kick = uring_conn_kick;
+  c->direct = 0;
+  c->io = uc;
+  if (c->outcount > 0) {
+    c->outarmed = 1;
+    uring_conn_kick(c);
+  }
+  pthread_mutex_unlock(&c->outlock);
+  uring_prep_recv(uc);
+}
+
+/************************************************************************
+ * Starts any newly adopted connections, then turns every connection on
+ * the pending list into a send submission.
+ */
+static void uring_drain_pending(uring* r) {
+  pthread_mutex_lock(&r->pending_lock);
+  uring_conn* uc = r->adopting;
+  r->adopting = NULL;
+  pthread_mutex_unlock(&r->pending_lock);
+
+  while (uc != NULL) {
+    uring_conn* next = uc->next_pending;
+    uring_start_adopted(uc);
+    uc = next;
+  }
+
+  pthread_mutex_lock(&r->pending_lock);
+  uc = r->pending;
+  r->pending = NULL;
+  pthread_mutex_unlock(&r->pending_lock);
+
+  while (uc != NULL) {
+    uring_conn* next = uc->next_pending;
+    conn* c = uc->c;
+
+    pthread_mutex_lock(&c->outlock);
+    uc->queued = 0;
+    int start = !uc->send_busy && c->outcount > 0 && !c->dead;
+    if (start) {
+      uring_take_out(uc);
+      uc->send_busy = 1;
+    } else if (!uc->send_busy) {
+      c->outarmed = 0;  // output was thrown away in the meantime
+    }
+    pthread_mutex_unlock(&c->outlock);
+
+    if (start) {
+      uring_prep_send(uc);
+    } else {
+      uring_conn_maybe_free(uc);
+    }
+    uc = next;
+  }
+}
+
+/************************************************************************
+ * Code run by each uring thread.
+ */
+static void* uring_main(void* arg) {
+  uring* r = (uring*)arg;
+  self_ring = r;
+
+  uring_prep_accept(r);
+  uring_prep_wake(r);
+
+  while (1) {
+    uring_drain_pending(r);
+    uring_enter(r, 1);
+
+    /* Only handle what has completed so far, so that the output it
+     * produces gets submitted before we look at newer completions. */
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+      __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+
+      uring_conn* uc = (uring_conn*)(uintptr_t)(cqe.user_data & ~TAG_MASK);
+      switch (cqe.user_data & TAG_MASK) {
+        case TAG_ACCEPT:
+          uring_handle_accept(r, &cqe);
+          break;
+        case TAG_WAKE:
+          uring_prep_wake(r);
+          break;
+        case TAG_RECV:
+          uring_handle_recv(uc, &cqe);
+          break;
+        case TAG_SEND:
+          uring_handle_send(uc, &cqe);
+          break;
+        case TAG_CANCEL:
+          break;  // the receive itself completes with -ECANCELED
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/************************************************************************
+ * Creates a ring, maps its queues and registers its provided buffers.
+ * Returns -1 if the kernel cannot do what the engine needs.
+ */
+static int uring_setup(uring* r, int listen_fd) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  if ((r->fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0) {
+    return -1;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP) || !uring_probe(r->fd)) {
+    close(r->fd);
+    return -1;
+  }
+
+  size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  size_t ring_len = (sq_len > cq_len) ? sq_len : cq_len;
+  char* rings = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) {
+    perror("mmap io_uring rings");
+    close(r->fd);
+    return -1;
+  }
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    perror("mmap io_uring sqes");
+    close(r->fd);
+    return -1;
+  }
+
+  r->sq_head = (unsigned*)(rings + p.sq_off.head);
+  r->sq_tail = (unsigned*)(rings + p.sq_off.tail);
+  r->sq_mask = *(unsigned*)(rings + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sq_local_tail = *r->sq_tail;
+  unsigned* sq_array = (unsigned*)(rings + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++) sq_array[i] = i;
+
+  r->cq_head = (unsigned*)(rings + p.cq_off.head);
+  r->cq_tail = (unsigned*)(rings + p.cq_off.tail);
+  r->cq_mask = *(unsigned*)(rings + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(rings + p.cq_off.cqes);
+
+  /* Register the provided buffer ring and fill it */
+  r->br = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf),
+               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->br == MAP_FAILED) {
+    perror("mmap io_uring buffer ring");
+    close(r->fd);
+    return -1;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)r->br;
+  reg.ring_entries = URING_NBUFS;
+  reg.bgid = URING_BGID;
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    close(r->fd);
+    return -1;
+  }
+  if ((r->bufs = malloc((size_t)URING_NBUFS * URING_BUFSIZE)) == NULL) {
+    perror("malloc io_uring buffers");
+    exit(1);
+  }
+  r->br_tail = 0;
+  for (unsigned i = 0; i < URING_NBUFS; i++) uring_recycle_buf(r, i);
+
+  if ((r->event_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+    perror("eventfd");
+    close(r->fd);
+    return -1;
+  }
+  pthread_mutex_init(&r->pending_lock, NULL);
+  r->pending = NULL;
+  r->adopting = NULL;
+  r->listen_fd = listen_fd;
+  return 0;
+}
+
+/************************************************************************
+ * Starts nthreads uring threads, all accepting on listen_fd. Returns -1
+ * without starting anything if the kernel lacks io_uring support (or
+ * has it disabled), so the caller can fall back to another engine.
+ */
+int uring_init(int listen_fd, int nthreads) {
+  if ((rings = calloc(nthreads, sizeof(uring))) == NULL) {
+    perror("malloc rings");
+    exit(1);
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    if (uring_setup(&rings[i], listen_fd) < 0) {
+      if (i == 0) {
+        free(rings);
+        return -1;
+      }
+      nthreads = i;  // run with the rings we managed to set up
+      break;
+    }
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&rings[i].thread, NULL, &uring_main, &rings[i]) != 0) {
+      perror("pthread_create uring");
+      exit(1);
+    }
+    pthread_detach(rings[i].thread);
+  }
+  nrings = nthreads;
+  return 0;
+}
+
+/************************************************************************
+ * Hands an existing connection over to one of the rings, round-robin.
+ * Safe to call from any thread.
+ */
+void uring_adopt(conn* c) {
+  unsigned int next = __atomic_fetch_add(&next_ring, 1, __ATOMIC_RELAXED);
+  uring* r = &rings[next % nrings];
+  uring_conn* uc = NULL;
+  if ((uc = calloc(1, sizeof(uring_conn))) == NULL) {
+    perror("uring_conn malloc");
+    exit(1);
+  }
+  uc->ring = r;
+  uc->c = c;
+
+  pthread_mutex_lock(&r->pending_lock);
+  int wake = (r->pending == NULL && r->adopting == NULL);
+  uc->next_pending = r->adopting;
+  r->adopting = uc;
+  pthread_mutex_unlock(&r->pending_lock);
+
+  if (wake && r != self_ring) {
+    uint64_t one = 1;
+    if (write(r->event_fd, &one, sizeof(one)) < 0) perror("write eventfd");
+  }
+}
@@ -0,0 +1,10 @@
+// Function prototypes for the io_uring I/O engine
+#ifndef _URING_H
+#define _URING_H
+
+#include "conn.h"
+
+int uring_init(int listen_fd, int nthreads);
+void uring_adopt(conn* c);
+
+#endif  // _URING_H